@@ -0,0 +1,851 @@
+// Host benchmarks for the file handling core. Filesystem calls are counted by wrapping the
+// libc entry points at link time (see BENCH_WRAP in the Makefile).
+// Usage: bench [-o results.csv] [-b baseline.csv] [list|sort|search|parse|copy|extract|cache|image|diff|build|dump|all]
+#include <dirent.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include "build.h"
+#include "cache.h"
+#include "copy.h"
+#include "diff.h"
+#include "dump.h"
+#include "extract.h"
+#include "image.h"
+#include "filelist.h"
+#include "preview.h"
+#include "romfs.h"
+#include "search.h"
+
+static u64 fscalls = 0;
+
+extern "C" {
+DIR *__real_opendir(const char *name);
+int __real_closedir(DIR *dir);
+struct dirent *__real_readdir(DIR *dir);
+FILE *__real_fopen(const char *path, const char *mode);
+int __real_fclose(FILE *file);
+int __real_fseek(FILE *file, long offset, int whence);
+long __real_ftell(FILE *file);
+int __real_stat(const char *path, struct stat *st);
+int __real_fstatat(int fd, const char *path, struct stat *st, int flags);
+
+DIR *__wrap_opendir(const char *name) { fscalls++; return __real_opendir(name); }
+int __wrap_closedir(DIR *dir) { fscalls++; return __real_closedir(dir); }
+struct dirent *__wrap_readdir(DIR *dir) { fscalls++; return __real_readdir(dir); }
+FILE *__wrap_fopen(const char *path, const char *mode) { fscalls++; return __real_fopen(path, mode); }
+int __wrap_fclose(FILE *file) { fscalls++; return __real_fclose(file); }
+int __wrap_fseek(FILE *file, long offset, int whence) { fscalls++; return __real_fseek(file, offset, whence); }
+long __wrap_ftell(FILE *file) { fscalls++; return __real_ftell(file); }
+int __wrap_stat(const char *path, struct stat *st) { fscalls++; return __real_stat(path, st); }
+int __wrap_fstatat(int fd, const char *path, struct stat *st, int flags) { fscalls++; return __real_fstatat(fd, path, st, flags); }
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t heapInUse() {
+    return mallinfo2().uordblks;
+}
+
+// Every number printed is also recorded as "bench,variant,params,metric,value" for the results
+// file, so runs can be diffed against a baseline.
+typedef struct {
+    std::string key;
+    double value;
+} bench_result;
+
+static std::vector<bench_result> results;
+
+static void record(const char *bench, const char *variant, const char *params, const char *metric, double value) {
+    bench_result result = {std::string(bench) + "," + variant + "," + params + "," + metric, value};
+    results.push_back(result);
+}
+
+static bool saveResults(const char *path) {
+    FILE *f = __real_fopen(path, "w");
+    if (!f) return false;
+    fprintf(f, "bench,variant,params,metric,value\n");
+    for (size_t i = 0; i < results.size(); i++) fprintf(f, "%s,%.6g\n", results[i].key.c_str(), results[i].value);
+    return __real_fclose(f) == 0;
+}
+
+// Times and throughputs that moved by more than a quarter against the baseline are flagged;
+// metrics where lower is better are the ones named *_ms, fscalls* and heap_kb.
+static void compareResults(const char *path) {
+    FILE *f = __real_fopen(path, "r");
+    if (!f) { fprintf(stderr, "%s: can't open baseline\n", path); return; }
+    std::map<std::string, double> baseline;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char *comma = strrchr(line, ',');
+        if (!comma || !strncmp(line, "bench,", 6)) continue;
+        baseline[std::string(line, comma - line)] = strtod(comma + 1, NULL);
+    }
+    __real_fclose(f);
+    printf("\ncompared to %s:\n", path);
+    u32 flagged = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        std::map<std::string, double>::const_iterator it = baseline.find(results[i].key);
+        if (it == baseline.end() || it->second == 0) continue;
+        double ratio = results[i].value / it->second;
+        const std::string &key = results[i].key;
+        bool lowerIsBetter = key.find("_ms") != std::string::npos || key.find("fscalls") != std::string::npos || key.find("heap_kb") != std::string::npos;
+        bool worse = lowerIsBetter ? ratio > 1.25 : ratio < 0.8;
+        bool better = lowerIsBetter ? ratio < 0.8 : ratio > 1.25;
+        if (!worse && !better) continue;
+        printf("  %-10s %s: %.6g -> %.6g (%+.0f%%)\n", worse ? "REGRESSED" : "improved", key.c_str(), it->second, results[i].value, (ratio - 1) * 100);
+        flagged++;
+    }
+    if (!flagged) printf("  no changes beyond 25%%\n");
+}
+
+// The listing as it was done before FileList: opendir per entry, fopen/fseek/ftell per file,
+// two strings per entry and a comparator that copies both entries.
+static void legacySortFileList(std::vector<filedata> *filelist) {
+    struct abc {
+        inline bool operator() (filedata a, filedata b) {
+            if(a.isDir == b.isDir)
+                return strcasecmp(a.name.c_str(), b.name.c_str()) < 0;
+            else return a.isDir;
+        }
+    } alphabetically;
+    std::sort((*filelist).begin(), (*filelist).end(), alphabetically);
+}
+
+static bool legacyIsDirectory(std::string path) {
+    bool result = false;
+    DIR *dir = opendir(path.c_str());
+    if (dir) result = true;
+    if (dir) closedir(dir);
+    return result;
+}
+
+static bool legacyFileList(std::vector<filedata> *dest, std::string directory) {
+    std::vector<filedata> result;
+    DIR* dir = opendir(directory.c_str());
+    if(dir == NULL) return false;
+    dirent* ent = NULL;
+    while ((ent = readdir(dir)) != NULL) {
+        std::string file(ent->d_name);
+        bool isDir = legacyIsDirectory(directory + file + "/");
+        u64 size = 0;
+        if (!isDir) {
+            FILE *tmp = fopen((directory + file).c_str(), "r");
+            fseek(tmp, 0L, SEEK_END);
+            size = ftell(tmp);
+            fclose(tmp);
+        }
+        if ((file!=".") && (file!="..")) result.push_back({file, directory + file, isDir, size});
+    }
+    closedir(dir);
+    legacySortFileList(&result);
+    dest->swap(result);
+    return true;
+}
+
+static std::string makeTree(u32 files, u32 dirs) {
+    char tmpl[] = "/tmp/romfsbench.XXXXXX";
+    std::string root = std::string(mkdtemp(tmpl)) + "/";
+    for (u32 i = 0; i < dirs; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "dir%05u", i);
+        mkdir((root + name).c_str(), 0777);
+    }
+    for (u32 i = 0; i < files; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "file%06u.bin", i);
+        FILE *f = __real_fopen((root + name).c_str(), "wb");
+        fwrite(name, 1, i % 64, f);
+        __real_fclose(f);
+    }
+    return root;
+}
+
+static void removeTree(const std::string &root) {
+    std::string cmd = "rm -rf '" + root + "'";
+    if (system(cmd.c_str()) != 0) fprintf(stderr, "failed to remove %s\n", root.c_str());
+}
+
+static void benchList(u32 files, u32 dirs) {
+    std::string root = makeTree(files, dirs);
+    std::vector<filedata> legacy;
+    FileList list;
+    for (int pass = 0; pass < 2; pass++) {
+        fscalls = 0;
+        double start = now();
+        bool ok = pass ? list.scan(root) : legacyFileList(&legacy, root);
+        if (pass) list.prepare(0, list.size());
+        double elapsed = now() - start;
+        if (!ok) { fprintf(stderr, "listing %s failed\n", root.c_str()); break; }
+        size_t count = pass ? list.size() : legacy.size();
+        char params[32];
+        snprintf(params, sizeof(params), "entries=%zu", count);
+        record("list", pass ? "scan" : "legacy", params, "fscalls", fscalls);
+        record("list", pass ? "scan" : "legacy", params, "time_ms", elapsed * 1000);
+        printf("list/%-6s entries=%-7zu fscalls=%-8llu per_entry=%-6.2f time=%.2fms\n", pass ? "scan" : "legacy", count,
+            (unsigned long long)fscalls, (double)fscalls / count, elapsed * 1000);
+    }
+    removeTree(root);
+}
+
+// Synthetic in-memory listings, to compare the filedata vector with the compact FileList.
+static void benchSort(u32 count) {
+    std::vector<std::string> names(count);
+    for (u32 i = 0; i < count; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%08x_asset_%u.%s", (i * 2654435761u), i, (i % 7) ? "bcres" : "dir");
+        names[i] = name;
+    }
+    std::string directory = "romfs:/Common/Graphics/Models/";
+
+    size_t heap = heapInUse();
+    double start = now();
+    std::vector<filedata> legacy;
+    for (u32 i = 0; i < count; i++) legacy.push_back({names[i], directory + names[i], (i % 7) == 0, i * 16ull});
+    double built = now();
+    legacySortFileList(&legacy);
+    double sorted = now();
+    char params[32];
+    snprintf(params, sizeof(params), "entries=%u", count);
+    record("sort", "legacy", params, "build_ms", (built - start) * 1000);
+    record("sort", "legacy", params, "sort_ms", (sorted - built) * 1000);
+    record("sort", "legacy", params, "heap_kb", (heapInUse() - heap) / 1024);
+    printf("sort/legacy  entries=%-7u build=%.2fms sort=%.2fms heap=%zuKB\n", count,
+        (built - start) * 1000, (sorted - built) * 1000, (heapInUse() - heap) / 1024);
+    std::vector<filedata>().swap(legacy);
+
+    heap = heapInUse();
+    start = now();
+    FileList list;
+    list.addDirectory(directory);
+    for (u32 i = 0; i < count; i++) list.add(names[i].c_str(), (i % 7) == 0, i * 16ull);
+    built = now();
+    list.prepare(0, 28);
+    double screen = now();
+    list.prepare(0, count);
+    sorted = now();
+    record("sort", "compact", params, "build_ms", (built - start) * 1000);
+    record("sort", "compact", params, "first_screen_ms", (screen - built) * 1000);
+    record("sort", "compact", params, "sort_ms", (sorted - built) * 1000);
+    record("sort", "compact", params, "heap_kb", (heapInUse() - heap) / 1024);
+    printf("sort/compact entries=%-7u build=%.2fms first_screen=%.2fms sort=%.2fms heap=%zuKB\n", count,
+        (built - start) * 1000, (screen - built) * 1000, (sorted - built) * 1000, (heapInUse() - heap) / 1024);
+}
+
+static std::string makeFile(u64 size) {
+    char tmpl[] = "/tmp/romfsbench.XXXXXX";
+    int fd = mkstemp(tmpl);
+    FILE *f = fdopen(fd, "wb");
+    std::vector<char> chunk(0x100000);
+    for (size_t i = 0; i < chunk.size(); i++) chunk[i] = rand();
+    for (u64 done = 0; done < size; done += chunk.size()) fwrite(chunk.data(), 1, chunk.size(), f);
+    __real_fclose(f);
+    return tmpl;
+}
+
+// The loop copyClipboard() used to run: one buffer, read then write.
+static u64 legacyCopy(FILE *src, FILE *dst, u32 bufsize) {
+    char *buffer = (char*)malloc(bufsize);
+    u64 size = 0;
+    while (!feof(src)) {
+        size_t rsize = fread(buffer, 1, bufsize, src);
+        if (rsize==0) break;
+        size += fwrite(buffer, 1, rsize, dst);
+    }
+    free(buffer);
+    return size;
+}
+
+static const u32 bufferSizes[] = {0x4000, 0x10000, 0x50000, 0x100000, 0x400000};
+
+// Each copy ends with fsync, so the numbers include getting the data to the disk. The legacy
+// loop runs once with its old 0x50000 buffer; the engine runs over a range of buffer sizes,
+// or just the default one unless sweep is set.
+static void benchCopy(u64 size, bool sweep) {
+    std::string from = makeFile(size);
+    std::string to = from + ".out";
+    u32 runs = sweep ? sizeof(bufferSizes) / sizeof(bufferSizes[0]) : 1;
+    for (u32 pass = 0; pass <= runs; pass++) {
+        u32 bufsize = (pass == 0 || !sweep) ? 0x50000 : bufferSizes[pass - 1];
+        FILE *src = __real_fopen(from.c_str(), "rb");
+        FILE *dst = __real_fopen(to.c_str(), "wb");
+        double start = now();
+        u64 copied = 0;
+        if (pass == 0) copied = legacyCopy(src, dst, bufsize);
+        else {
+            CopyEngine engine(bufsize, 4);
+            FileReader reader(src);
+            FileWriter writer(dst);
+            engine.start(&reader, &writer);
+            engine.wait();
+            copied = engine.getProgress();
+        }
+        fflush(dst);
+        fsync(fileno(dst));
+        double elapsed = now() - start;
+        __real_fclose(src);
+        __real_fclose(dst);
+        char params[48];
+        snprintf(params, sizeof(params), "size=%lluMB buffer=%uKB", (unsigned long long)(size >> 20), bufsize >> 10);
+        record("copy", pass ? "engine" : "legacy", params, "time_ms", elapsed * 1000);
+        record("copy", pass ? "engine" : "legacy", params, "mb_per_s", (copied / 1048576.0) / elapsed);
+        printf("copy/%-6s %s time=%.2fms throughput=%.1fMB/s%s\n", pass ? "engine" : "legacy", params,
+            elapsed * 1000, (copied / 1048576.0) / elapsed, copied == size ? "" : " (short copy)");
+    }
+    unlink(from.c_str());
+    unlink(to.c_str());
+}
+
+// First transfer over a new route calibrates the chunk size, the second one uses it.
+static void benchTunedCopy(u64 size) {
+    std::string from = makeFile(size);
+    std::string to = from + ".out";
+    char route[64];
+    snprintf(route, sizeof(route), "bench-%u>tmp", (u32)getpid());
+    CopyEngine engine(0, 4);
+    for (int pass = 0; pass < 2; pass++) {
+        FILE *src = __real_fopen(from.c_str(), "rb");
+        FILE *dst = __real_fopen(to.c_str(), "wb");
+        double start = now();
+        FileReader reader(src);
+        FileWriter writer(dst);
+        engine.setRoute(route, size);
+        engine.start(&reader, &writer);
+        engine.wait();
+        fflush(dst);
+        fsync(fileno(dst));
+        double elapsed = now() - start;
+        __real_fclose(src);
+        __real_fclose(dst);
+        char params[48];
+        snprintf(params, sizeof(params), "size=%lluMB", (unsigned long long)(size >> 20));
+        const char *variant = pass ? "tuned" : "calibrating";
+        record("copy", variant, params, "time_ms", elapsed * 1000);
+        record("copy", variant, params, "mb_per_s", (size / 1048576.0) / elapsed);
+        printf("copy/%-11s %s chunk=%uKB time=%.2fms throughput=%.1fMB/s\n", variant, params, chunkTuner().lookup(route) >> 10,
+            elapsed * 1000, (size / 1048576.0) / elapsed);
+    }
+    unlink(from.c_str());
+    unlink(to.c_str());
+}
+
+// Many small files: the ring and its two threads per file, against the single pooled buffer the
+// engine uses when it knows the stream is small.
+static void benchSmallCopies(u32 count, u32 size) {
+    std::string root = makeTree(0, 0);
+    std::vector<char> data(size, 'x');
+    std::string from = root + "small.bin";
+    FILE *f = __real_fopen(from.c_str(), "wb");
+    fwrite(data.data(), 1, size, f);
+    __real_fclose(f);
+    for (int pass = 0; pass < 2; pass++) {
+        CopyEngine engine(COPY_DEFAULT_CHUNK, 4);
+        double start = now();
+        for (u32 i = 0; i < count; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "out%06u.bin", i);
+            FILE *src = __real_fopen(from.c_str(), "rb");
+            FILE *dst = __real_fopen((root + name).c_str(), "wb");
+            FileReader reader(src);
+            FileWriter writer(dst);
+            engine.setRoute("", pass ? size : 0);
+            engine.start(&reader, &writer);
+            engine.wait();
+            __real_fclose(src);
+            __real_fclose(dst);
+        }
+        double elapsed = now() - start;
+        char params[48];
+        snprintf(params, sizeof(params), "files=%u size=%uKB", count, size >> 10);
+        record("copy", pass ? "small" : "ring", params, "time_ms", elapsed * 1000);
+        printf("copy/%-6s %s time=%.2fms per_file=%.3fms\n", pass ? "small" : "ring", params, elapsed * 1000, elapsed * 1000 / count);
+    }
+    removeTree(root);
+}
+
+// Packing a tree of one large and many small files; bare level 3 against IVFC hashed on 1 to 4
+// threads, which should come down to the bare time once hashing keeps up with the I/O.
+static void benchBuild(u64 size, u32 files) {
+    std::string root = makeTree(files, 0);
+    std::string big = makeFile(size);
+    rename(big.c_str(), (root + "big.bin").c_str());
+    std::string out = root.substr(0, root.size() - 1) + ".romfs";
+    for (u32 threads = 0; threads <= 4; threads = threads ? threads * 2 : 1) {
+        build_options options = defaultBuildOptions();
+        options.ivfc = (threads > 0);
+        options.threads = threads;
+        RomFSBuilder builder;
+        double start = now();
+        int status = builder.start(root, out, options) ? builder.wait() : COPY_WRITE_ERROR;
+        double elapsed = now() - start;
+        char params[48], variant[16];
+        snprintf(params, sizeof(params), "size=%lluMB files=%u", (unsigned long long)(size >> 20), files);
+        snprintf(variant, sizeof(variant), threads ? "ivfc_%ut" : "bare", threads);
+        record("build", variant, params, "time_ms", elapsed * 1000);
+        record("build", variant, params, "mb_per_s", (size / 1048576.0) / elapsed);
+        printf("build/%-7s %s time=%.2fms throughput=%.1fMB/s%s\n", variant, params, elapsed * 1000, (size / 1048576.0) / elapsed,
+            status == COPY_DONE ? "" : " (failed)");
+        unlink(out.c_str());
+    }
+    removeTree(root);
+}
+
+// Full dump pipeline (image reads, SHA-256, checkpoints, fsync of the result) per chunk size.
+static void benchDump(u64 size) {
+    std::string from = makeFile(size);
+    std::string to = from + ".dump";
+    StdioImage image;
+    if (!image.open(from.c_str())) { fprintf(stderr, "dump: can't open %s\n", from.c_str()); return; }
+    for (u32 i = 0; i < sizeof(bufferSizes) / sizeof(bufferSizes[0]); i++) {
+        dump_options options = defaultDumpOptions();
+        options.chunkSize = bufferSizes[i];
+        Dumper dumper;
+        double start = now();
+        int status = dumper.start(&image, to, options, false) ? dumper.wait() : COPY_WRITE_ERROR;
+        double elapsed = now() - start;
+        char params[48];
+        snprintf(params, sizeof(params), "size=%lluMB chunk=%uKB", (unsigned long long)(size >> 20), bufferSizes[i] >> 10);
+        record("dump", "dumper", params, "time_ms", elapsed * 1000);
+        record("dump", "dumper", params, "mb_per_s", (size / 1048576.0) / elapsed);
+        printf("dump/dumper %s time=%.2fms throughput=%.1fMB/s%s\n", params, elapsed * 1000, (size / 1048576.0) / elapsed,
+            status == COPY_DONE ? "" : " (failed)");
+        unlink(to.c_str());
+        unlink((to + ".sha256").c_str());
+        unlink((to + ".ckpt").c_str());
+    }
+    image.close();
+    unlink(from.c_str());
+}
+
+class MemoryImage : public ImageSource {
+public:
+    std::vector<u8> data;
+    bool read(u64 offset, void *buffer, u32 size) {
+        if (offset + size > data.size()) return false;
+        memcpy(buffer, &data[offset], size);
+        return true;
+    }
+    u64 size() { return data.size(); }
+    const u8 *map(u64 offset, u64 size) { return (offset + size <= data.size()) ? &data[offset] : NULL; }
+    const char *backend() const { return "memory"; }
+};
+
+static void put32(std::vector<u8> *dest, u32 value) {
+    for (int i = 0; i < 4; i++) dest->push_back(value >> (i * 8));
+}
+
+static void putName(std::vector<u8> *dest, const std::string &name) {
+    put32(dest, name.size() * 2);
+    for (size_t i = 0; i < name.size(); i++) { dest->push_back(name[i]); dest->push_back(0); }
+    while (dest->size() % 4) dest->push_back(0);
+}
+
+// Level 3 metadata for dirs directories of files files each, directly under the root. Only the
+// tables are generated (empty hash tables), which is all the index reads; with a dataSize every
+// file gets that many bytes of data, 0x10 aligned as in real images.
+static void makeMetadata(MemoryImage *image, u32 dirs, u32 files, u32 dataSize = 0) {
+    const char *exts[] = {"bcres", "bclim", "bcstm", "bin", "lz", "msbt", "arc"};
+    std::vector<u8> dirMeta;
+    std::vector<u8> fileMeta;
+    std::vector<u32> dirOffs(dirs);
+    u32 dirSize = 0x18;
+    for (u32 d = 0; d < dirs; d++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Folder%04u", d);
+        dirOffs[d] = dirSize;
+        dirSize += 0x18 + ((strlen(name) * 2 + 3) & ~3);
+    }
+    // root
+    put32(&dirMeta, 0); put32(&dirMeta, 0xFFFFFFFF); put32(&dirMeta, dirs ? dirOffs[0] : 0xFFFFFFFF);
+    put32(&dirMeta, 0xFFFFFFFF); put32(&dirMeta, 0xFFFFFFFF); put32(&dirMeta, 0);
+    for (u32 d = 0; d < dirs; d++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Folder%04u", d);
+        put32(&dirMeta, 0);
+        put32(&dirMeta, (d + 1 < dirs) ? dirOffs[d + 1] : 0xFFFFFFFF);
+        put32(&dirMeta, 0xFFFFFFFF);
+        put32(&dirMeta, files ? fileMeta.size() : 0xFFFFFFFF);
+        put32(&dirMeta, 0xFFFFFFFF);
+        for (u32 f = 0; f < files; f++) {
+            char fname[64];
+            u32 i = d * files + f;
+            snprintf(fname, sizeof(fname), "%08x_asset_%u.%s", i * 2654435761u, i, exts[i % 7]);
+            std::string fn(fname);
+            u32 next = fileMeta.size() + 0x20 + ((fn.size() * 2 + 3) & ~3);
+            put32(&fileMeta, dirOffs[d]);
+            put32(&fileMeta, (f + 1 < files) ? next : 0xFFFFFFFF);
+            put32(&fileMeta, dataSize ? i * ((dataSize + 15) & ~15) : i * 64); put32(&fileMeta, 0);
+            put32(&fileMeta, dataSize ? dataSize : (i * 37) % 100000); put32(&fileMeta, 0);
+            put32(&fileMeta, 0xFFFFFFFF);
+            putName(&fileMeta, fn);
+        }
+        putName(&dirMeta, name);
+    }
+    std::vector<u8> &out = image->data;
+    out.clear();
+    u32 dirHashOff = 0x28, dirMetaOff = dirHashOff + 4, fileHashOff = dirMetaOff + dirMeta.size();
+    u32 fileMetaOff = fileHashOff + 4, dataOff = fileMetaOff + fileMeta.size();
+    u32 header[10] = {0x28, dirHashOff, 4, dirMetaOff, (u32)dirMeta.size(), fileHashOff, 4, fileMetaOff, (u32)fileMeta.size(), dataOff};
+    for (int i = 0; i < 10; i++) put32(&out, header[i]);
+    put32(&out, 0xFFFFFFFF);
+    out.insert(out.end(), dirMeta.begin(), dirMeta.end());
+    put32(&out, 0xFFFFFFFF);
+    out.insert(out.end(), fileMeta.begin(), fileMeta.end());
+    if (dataSize) {
+        out.resize(dataOff + (u64)dirs * files * ((dataSize + 15) & ~15));
+        for (size_t i = dataOff; i < out.size(); i++) out[i] = i * 31;
+    }
+}
+
+// Adds a fixed delay to every read, standing in for the FS service round trip on the console.
+class SlowImage : public ImageSource {
+public:
+    SlowImage(ImageSource *image, u32 delayUs) : reads(0), image(image), delayUs(delayUs) {}
+    bool read(u64 offset, void *buffer, u32 size) {
+        reads++;
+        if (delayUs) usleep(delayUs);
+        return image->read(offset, buffer, size);
+    }
+    u64 size() { return image->size(); }
+    const char *backend() const { return "slow"; }
+    std::atomic<u32> reads;
+private:
+    ImageSource *image;
+    u32 delayUs;
+};
+
+// Records every read made through it, for replaying the same access pattern elsewhere.
+class TraceImage : public ImageSource {
+public:
+    TraceImage(ImageSource *image) : image(image) {}
+    bool read(u64 offset, void *buffer, u32 size) {
+        copy_span span = {offset, size};
+        trace.push_back(span);
+        return image->read(offset, buffer, size);
+    }
+    u64 size() { return image->size(); }
+    const char *backend() const { return "trace"; }
+    std::vector<copy_span> trace;
+private:
+    ImageSource *image;
+};
+
+class NullWriter : public Writer {
+public:
+    bool write(const void *buffer, u32 size) { (void)buffer; (void)size; return true; }
+};
+
+// Replays a browse and extract session: the index is parsed, every 10th file previewed and paged
+// through, then every file copied one at a time in data order, as copyClipboard() does with
+// a folder whose listing follows the image layout. The recorded reads
+// go to a slow image directly, then through block caches of a few sizes.
+static void benchCache(u32 dirs, u32 files, u32 size, u32 delayUs) {
+    MemoryImage memory;
+    makeMetadata(&memory, dirs, files, size);
+    TraceImage tracer(&memory);
+    RomFS romfs;
+    if (!romfs.open(&tracer, 0)) { fprintf(stderr, "cache: bad synthetic image\n"); return; }
+    std::vector<u32> dirList, fileList;
+    Extractor::collect(&romfs, 0, &dirList, &fileList);
+    Preview preview;
+    std::vector<std::string> lines;
+    for (size_t i = 0; i < fileList.size(); i += 10) {
+        preview.open(&tracer, romfs.entry(fileList[i]).offset, romfs.entry(fileList[i]).size);
+        for (int page = 0; page < 3; page++) {
+            preview.render(27, 50, &lines);
+            preview.pageDown();
+        }
+        preview.close();
+    }
+    std::vector<std::pair<u64, u32> > order;
+    for (size_t i = 0; i < fileList.size(); i++) order.push_back(std::make_pair(romfs.entry(fileList[i]).offset, fileList[i]));
+    std::sort(order.begin(), order.end());
+    for (size_t i = 0; i < order.size(); i++) fileList[i] = order[i].second;
+    CopyEngine engine(COPY_DEFAULT_CHUNK, 4);
+    for (size_t i = 0; i < fileList.size(); i++) {
+        ImageReader reader(&tracer, romfs.entry(fileList[i]).offset, romfs.entry(fileList[i]).size);
+        NullWriter writer;
+        engine.setRoute("", romfs.entry(fileList[i]).size);
+        engine.start(&reader, &writer);
+        engine.wait();
+    }
+    std::vector<u8> buffer;
+    char params[64];
+    snprintf(params, sizeof(params), "reads=%zu files=%u size=%uB read_delay=%uus", tracer.trace.size(), dirs * files, size, delayUs);
+    const u32 capacities[] = {0, 0x40000, CACHE_DEFAULT_SIZE, 0x400000};
+    for (u32 c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+        SlowImage slow(&memory, delayUs);
+        CachedImage *cache = capacities[c] ? new CachedImage(&slow, false, capacities[c]) : NULL;
+        ImageSource *image = cache ? (ImageSource*)cache : &slow;
+        bool ok = true;
+        double start = now();
+        for (size_t i = 0; i < tracer.trace.size(); i++) {
+            buffer.resize(tracer.trace[i].size);
+            ok = image->read(tracer.trace[i].offset, buffer.data(), tracer.trace[i].size) && ok;
+        }
+        double elapsed = now() - start;
+        cache_stats stats;
+        memset(&stats, 0, sizeof(stats));
+        if (cache) stats = cache->getStats();
+        delete cache;
+        char variant[16];
+        snprintf(variant, sizeof(variant), capacities[c] ? "cache_%uk" : "direct", capacities[c] >> 10);
+        double hitRate = (stats.hits + stats.misses) ? stats.hits * 100.0 / (stats.hits + stats.misses) : 0;
+        record("cache", variant, params, "time_ms", elapsed * 1000);
+        record("cache", variant, params, "image_reads", slow.reads);
+        record("cache", variant, params, "hit_pct", hitRate);
+        printf("cache/%-10s %s time=%.2fms image_reads=%u hits=%.1f%% ahead=%llu/%llu%s\n", variant, params, elapsed * 1000, (u32)slow.reads,
+            hitRate, (unsigned long long)stats.prefetchHits, (unsigned long long)stats.prefetched, ok ? "" : " (failed)");
+    }
+}
+
+// Index build time and query latency over a synthetic image; "first" is the time until the
+// first screen of results, "all" a complete scan.
+static void benchSearch(u32 dirs, u32 files) {
+    MemoryImage image;
+    makeMetadata(&image, dirs, files);
+    RomFS romfs;
+    double start = now();
+    if (!romfs.open(&image, 0)) { fprintf(stderr, "search: bad synthetic image\n"); return; }
+    double opened = now();
+    SearchIndex index;
+    index.build(&romfs);
+    double built = now();
+    char params[32];
+    snprintf(params, sizeof(params), "entries=%u", romfs.count());
+    record("search", "build", params, "open_ms", (opened - start) * 1000);
+    record("search", "build", params, "index_ms", (built - opened) * 1000);
+    printf("search/build entries=%-7u open=%.2fms index=%.2fms index_mem=%zuKB\n", romfs.count(),
+        (opened - start) * 1000, (built - opened) * 1000, index.memoryUsage() / 1024);
+    const char *queries[] = {"asset_4242", "nomatch", "*_12?.bclim", ".bcstm", ".msbt >50k", "folder0"};
+    for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+        search_query query;
+        parseQuery(queries[q], &query);
+        std::vector<u32> results;
+        u32 position = 0;
+        double begin = now();
+        double first = 0;
+        bool done = false;
+        while (!done) {
+            done = index.search(query, &position, 0x8000, &results);
+            if (!first && (results.size() >= 28 || done)) first = now();
+        }
+        double end = now();
+        std::string variant = std::string("query ") + queries[q];
+        record("search", variant.c_str(), params, "first_ms", (first - begin) * 1000);
+        record("search", variant.c_str(), params, "all_ms", (end - begin) * 1000);
+        printf("search/query %-14s results=%-6zu first=%.3fms all=%.3fms\n", queries[q], results.size(),
+            (first - begin) * 1000, (end - begin) * 1000);
+    }
+}
+
+// Extracting a tree of small files, against copying them one at a time through the engine the
+// way copyClipboard() used to go through romfs:/. Image reads can be given a delay per call.
+static void benchExtract(u32 dirs, u32 files, u32 size, u32 delayUs) {
+    MemoryImage memory;
+    makeMetadata(&memory, dirs, files, size);
+    SlowImage image(&memory, delayUs);
+    RomFS romfs;
+    if (!romfs.open(&image, 0)) { fprintf(stderr, "extract: bad synthetic image\n"); return; }
+    char params[64];
+    snprintf(params, sizeof(params), "files=%u size=%uB read_delay=%uus", dirs * files, size, delayUs);
+    for (int pass = 0; pass < 2; pass++) {
+        std::string root = makeTree(0, 0);
+        u32 count = 0;
+        image.reads = 0;
+        double start = now();
+        if (pass == 0) {
+            std::vector<u32> dirList, fileList;
+            Extractor::collect(&romfs, 0, &dirList, &fileList);
+            for (size_t i = 1; i < dirList.size(); i++) mkdir((root + romfs.path(dirList[i])).c_str(), 0777);
+            CopyEngine engine(COPY_DEFAULT_CHUNK, 4);
+            for (size_t i = 0; i < fileList.size(); i++) {
+                const romfs_entry &ent = romfs.entry(fileList[i]);
+                FILE *dst = __real_fopen((root + romfs.path(fileList[i])).c_str(), "wb");
+                ImageReader reader(&image, ent.offset, ent.size);
+                FileWriter writer(dst);
+                engine.setRoute("", ent.size);
+                engine.start(&reader, &writer);
+                if (engine.wait() == COPY_DONE) count++;
+                __real_fclose(dst);
+            }
+        } else {
+            Extractor extractor;
+            extract_options options = defaultExtractOptions();
+            options.incremental = false;
+            if (extractor.start(&romfs, 0, root, options) && extractor.wait() == COPY_DONE) count = extractor.getFilesDone();
+        }
+        double elapsed = now() - start;
+        const char *variant = pass ? "extractor" : "per_file";
+        record("extract", variant, params, "time_ms", elapsed * 1000);
+        record("extract", variant, params, "files_per_s", count / elapsed);
+        record("extract", variant, params, "image_reads", image.reads);
+        printf("extract/%-9s %s time=%.2fms files_per_s=%.0f image_reads=%u%s\n", variant, params, elapsed * 1000, count / elapsed, (u32)image.reads,
+            count == dirs * files ? "" : " (incomplete)");
+        removeTree(root);
+    }
+}
+
+// Two images with the same tree where every 100th file's contents changed, so every file goes
+// through the hashing pass.
+static void benchDiff(u32 dirs, u32 files, u32 size) {
+    MemoryImage older, newer;
+    makeMetadata(&older, dirs, files, size);
+    newer.data = older.data;
+    RomFS a, b;
+    if (!a.open(&older, 0) || !b.open(&newer, 0)) { fprintf(stderr, "diff: bad synthetic image\n"); return; }
+    for (u32 i = 0; i < b.count(); i++) {
+        if (!b.entry(i).isDir && i % 100 == 0) newer.data[b.entry(i).offset] ^= 0xFF;
+    }
+    char params[64];
+    snprintf(params, sizeof(params), "entries=%u size=%uB", b.count(), size);
+    Differ differ;
+    double start = now();
+    differ.start(&a, &b);
+    int result = differ.wait();
+    double end = now();
+    record("diff", "images", params, "time_ms", (end - start) * 1000);
+    printf("diff/%s time=%.2fms hashed=%.1fMB modified=%u%s\n", params, (end - start) * 1000, differ.getProgress() / 1048576.0,
+        differ.count(DIFF_MODIFIED), result == COPY_DONE ? "" : " (failed)");
+}
+
+// The same synthetic image on disk through each host backend: parsing the index, extracting every
+// file and diffing the image against itself (which hashes all file data).
+static void benchImage(u32 dirs, u32 files, u32 size) {
+    MemoryImage memory;
+    makeMetadata(&memory, dirs, files, size);
+    char tmpl[] = "/tmp/romfsbench.XXXXXX";
+    int fd = mkstemp(tmpl);
+    bool written = fd >= 0 && write(fd, memory.data.data(), memory.data.size()) == (ssize_t)memory.data.size();
+    if (fd >= 0) close(fd);
+    if (!written) { fprintf(stderr, "image: can't write %s\n", tmpl); unlink(tmpl); return; }
+    char params[64];
+    snprintf(params, sizeof(params), "files=%u size=%uB", dirs * files, size);
+    const int backends[] = {IMAGE_STDIO, IMAGE_PREAD, IMAGE_MMAP};
+    for (int i = 0; i < 3; i++) {
+        ImageSource *image = openImage(tmpl, backends[i]);
+        if (!image) { fprintf(stderr, "image: can't open %s\n", tmpl); continue; }
+        const char *variant = image->backend();
+        RomFS romfs, other;
+        double start = now();
+        bool opened = romfs.open(image, 0);
+        double parsed = now();
+        opened = opened && other.open(image, 0);
+        std::string root = makeTree(0, 0);
+        Extractor extractor;
+        extract_options options = defaultExtractOptions();
+        options.incremental = false;
+        bool ok = opened && extractor.start(&romfs, 0, root, options) && extractor.wait() == COPY_DONE;
+        double extracted = now();
+        Differ differ;
+        ok = ok && differ.start(&romfs, &other) && differ.wait() == COPY_DONE && differ.getResults().empty();
+        double end = now();
+        removeTree(root);
+        record("image", variant, params, "open_ms", (parsed - start) * 1000);
+        record("image", variant, params, "extract_ms", (extracted - parsed) * 1000);
+        record("image", variant, params, "diff_ms", (end - extracted) * 1000);
+        printf("image/%-5s %s open=%.2fms extract=%.2fms diff=%.2fms%s\n", variant, params, (parsed - start) * 1000,
+            (extracted - parsed) * 1000, (end - extracted) * 1000, ok ? "" : " (failed)");
+        delete image;
+    }
+    unlink(tmpl);
+}
+
+// Parsing level 3 metadata into the index, against loading the same index from its cache file.
+static void benchParse(u32 dirs, u32 files) {
+    MemoryImage image;
+    makeMetadata(&image, dirs, files);
+    RomFS romfs;
+    double start = now();
+    if (!romfs.open(&image, 0)) { fprintf(stderr, "parse: bad synthetic image\n"); return; }
+    double opened = now();
+    char tmpl[] = "/tmp/romfsbench.XXXXXX";
+    close(mkstemp(tmpl));
+    const char key[] = "bench";
+    bool saved = romfs.save(tmpl, key, sizeof(key));
+    double written = now();
+    RomFS cached;
+    bool loaded = saved && cached.load(&image, 0, tmpl, key, sizeof(key));
+    double end = now();
+    unlink(tmpl);
+    if (!loaded) { fprintf(stderr, "parse: index cache round trip failed\n"); return; }
+    char params[32];
+    snprintf(params, sizeof(params), "entries=%u", romfs.count());
+    record("parse", "open", params, "time_ms", (opened - start) * 1000);
+    record("parse", "save", params, "time_ms", (written - opened) * 1000);
+    record("parse", "load", params, "time_ms", (end - written) * 1000);
+    record("parse", "open", params, "heap_kb", romfs.memoryUsage() / 1024);
+    printf("parse/%-7s open=%.2fms save=%.2fms load=%.2fms index_mem=%zuKB\n", params, (opened - start) * 1000,
+        (written - opened) * 1000, (end - written) * 1000, romfs.memoryUsage() / 1024);
+}
+
+int main(int argc, char **argv) {
+    const char *output = NULL;
+    const char *baseline = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:b:")) != -1) {
+        if (opt == 'o') output = optarg;
+        else if (opt == 'b') baseline = optarg;
+        else { fprintf(stderr, "usage: bench [-o results.csv] [-b baseline.csv] [suite]\n"); return 1; }
+    }
+    const char *suite = (optind < argc) ? argv[optind] : "all";
+    bool all = !strcmp(suite, "all");
+    if (all || !strcmp(suite, "list")) {
+        benchList(1000, 100);
+        benchList(10000, 1000);
+    }
+    if (all || !strcmp(suite, "sort")) {
+        benchSort(10000);
+        benchSort(100000);
+    }
+    if (all || !strcmp(suite, "search")) {
+        benchSearch(50, 200);
+        benchSearch(500, 100);
+    }
+    if (all || !strcmp(suite, "parse")) {
+        benchParse(50, 200);
+        benchParse(500, 100);
+        benchParse(2000, 100);
+    }
+    if (all || !strcmp(suite, "copy")) {
+        benchCopy(64 << 20, true);
+        benchCopy(256 << 20, false);
+        benchTunedCopy(64 << 20);
+        benchSmallCopies(2000, 4096);
+    }
+    if (all || !strcmp(suite, "extract")) {
+        benchExtract(20, 250, 1000, 0);
+        benchExtract(20, 250, 1000, 200);
+    }
+    if (all || !strcmp(suite, "cache")) {
+        benchCache(20, 250, 3000, 200);
+    }
+    if (all || !strcmp(suite, "image")) {
+        benchImage(100, 100, 4000);
+    }
+    if (all || !strcmp(suite, "diff")) {
+        benchDiff(500, 100, 1000);
+    }
+    if (all || !strcmp(suite, "build")) {
+        benchBuild(128 << 20, 2000);
+    }
+    if (all || !strcmp(suite, "dump")) {
+        benchDump(64 << 20);
+    }
+    if (output && !saveResults(output)) { fprintf(stderr, "%s: can't write results\n", output); return 1; }
+    if (baseline) compareResults(baseline);
+    return 0;
+}
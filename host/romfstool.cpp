@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "build.h"
+#include "diff.h"
+#include "dump.h"
+#include "extract.h"
+#include "search.h"
+#include "smdh.h"
+#include "sha256.h"
+#include "image.h"
+#include "ivfc.h"
+#include "perf.h"
+#include "preview.h"
+#include "romfs.h"
+
+// Dumps made by RomFS Explorer (and real romfs files) start with an IVFC header, level 3 follows at 0x1000.
+static u64 detectBase(ImageSource *image) {
+    char magic[4];
+    if (image->read(0, magic, 4) && !memcmp(magic, "IVFC", 4)) return 0x1000;
+    return 0;
+}
+
+// $ROMFS_BACKEND picks the image backend (stdio, pread or mmap); the default is mmap.
+static ImageSource *openSource(const char *path) {
+    return openImage(path, imageBackend(getenv("ROMFS_BACKEND")));
+}
+
+static void usage() {
+    fprintf(stderr, "usage: romfstool ls <image> [path]\n"
+                    "       romfstool dump <image> <output> [chunk size] [depth]\n"
+                    "       romfstool verify <image> [threads]\n"
+                    "       romfstool extract [--full] [--trust-offsets] [--delete] <image> <output dir> [path]\n"
+                    "       romfstool find <image> <query>\n"
+                    "       romfstool preview <image> <path> [hex|text|smdh] [page]\n"
+                    "       romfstool diff <old image> <new image>\n"
+                    "       romfstool export <image> <output dir> <list file|old image>\n"
+                    "       romfstool build [--no-ivfc] <dir> <output> [threads]\n");
+}
+
+static int cmdList(RomFS &romfs, const char *path) {
+    u32 dir = romfs.find(path);
+    if (dir == ROMFS_NONE) { fprintf(stderr, "%s: not found\n", path); return 1; }
+    std::vector<u32> children;
+    if (!romfs.list(dir, &children)) { fprintf(stderr, "%s: not a directory\n", path); return 1; }
+    for (size_t i = 0; i < children.size(); i++) {
+        const romfs_entry &ent = romfs.entry(children[i]);
+        if (ent.isDir) printf("%12s  %s/\n", "<DIR>", romfs.name(children[i]));
+        else printf("%12llu  %s\n", (unsigned long long)ent.size, romfs.name(children[i]));
+    }
+    return 0;
+}
+
+// Same pipeline as the on-device dump, resuming from a checkpoint if one is left over.
+static int cmdDump(ImageSource *image, const char *output, int argc, char **argv) {
+    dump_options options = defaultDumpOptions();
+    if (argc > 0) options.chunkSize = strtoul(argv[0], NULL, 0);
+    if (argc > 1) options.depth = strtoul(argv[1], NULL, 0);
+    Dumper dumper;
+    if (!dumper.start(image, output, options, true)) { fprintf(stderr, "%s: can't write\n", output); return 1; }
+    if (dumper.getResumed()) printf("resuming at %llu\n", (unsigned long long)dumper.getResumed());
+    int status = dumper.wait();
+    if (status != COPY_DONE) { fprintf(stderr, "dump failed (%d)\n", status); return 1; }
+    printf("%s  %s\n", dumper.getHash().c_str(), output);
+    return 0;
+}
+
+static int cmdVerify(ImageSource *image, u32 threads) {
+    IVFCImage ivfc;
+    if (!ivfc.open(image)) { fprintf(stderr, "no valid IVFC header\n"); return 1; }
+    if (!ivfc.verify(threads)) { fprintf(stderr, "failed to read image\n"); return 1; }
+    const std::vector<ivfc_badrange> &bad = ivfc.getBadRanges();
+    for (size_t i = 0; i < bad.size(); i++) {
+        u64 offset = ivfc.levelOffset(bad[i].level) + bad[i].offset;
+        printf("level %u: bad blocks at 0x%llx-0x%llx (image offset 0x%llx)\n", bad[i].level, (unsigned long long)bad[i].offset,
+            (unsigned long long)(bad[i].offset + bad[i].size), (unsigned long long)offset);
+    }
+    printf("%s (%llu bytes of level 3 checked, %s)\n", bad.empty() ? "OK" : "CORRUPT", (unsigned long long)ivfc.getProgress(), sha256Backend());
+    return bad.empty() ? 0 : 2;
+}
+
+// Incremental unless --full: files the manifest of a previous run shows at the same size are hashed
+// and skipped if unchanged; with --trust-offsets, ones at the same data offset aren't even read.
+static int cmdExtract(RomFS &romfs, std::string output, const char *path, const extract_options &options) {
+    u32 index = romfs.find(path);
+    if (index == ROMFS_NONE) { fprintf(stderr, "%s: not found\n", path); return 1; }
+    if (output.empty() || output[output.size() - 1] != '/') output += "/";
+    Extractor extractor;
+    if (!extractor.start(&romfs, index, output, options)) { fprintf(stderr, "%s: can't create output\n", output.c_str()); return 1; }
+    int status = extractor.wait();
+    if (status != COPY_DONE) { fprintf(stderr, "extraction failed (%d)\n", status); return 1; }
+    printf("%u files written, %u unchanged, %u removed, %llu bytes read\n", extractor.getFilesDone(), extractor.getSkipped(),
+        extractor.getRemoved(), (unsigned long long)extractor.getSize());
+    return 0;
+}
+
+static int cmdFind(RomFS &romfs, int argc, char **argv) {
+    std::string text;
+    for (int i = 0; i < argc; i++) text += std::string(i ? " " : "") + argv[i];
+    search_query query;
+    if (!parseQuery(text, &query)) { fprintf(stderr, "%s: invalid query\n", text.c_str()); return 1; }
+    SearchIndex index;
+    index.build(&romfs);
+    std::vector<u32> results;
+    u32 position = 0;
+    while (!index.search(query, &position, 0x8000, &results));
+    for (size_t i = 0; i < results.size(); i++) {
+        const romfs_entry &ent = romfs.entry(results[i]);
+        if (ent.isDir) printf("%12s  %s/\n", "<DIR>", romfs.path(results[i]).c_str());
+        else printf("%12llu  %s\n", (unsigned long long)ent.size, romfs.path(results[i]).c_str());
+    }
+    return results.empty() ? 1 : 0;
+}
+
+#ifdef PERF
+static void printPerf() {
+    perfTraceClose();
+    fprintf(stderr, "%-8s %10s %10s %10s %14s\n", "counter", "calls", "total ms", "max ms", "bytes");
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        perf_counter counter = perfGet(i);
+        if (!counter.calls) continue;
+        fprintf(stderr, "%-8s %10llu %10.2f %10.3f %14llu\n", counter.name, (unsigned long long)counter.calls, perfMs(counter.ticks),
+            perfMs(counter.maxTicks), (unsigned long long)counter.bytes);
+    }
+}
+#endif
+
+// One 80x24 page of the on-device preview.
+static int cmdPreview(RomFS &romfs, const char *path, const char *mode, u32 page) {
+    u32 index = romfs.find(path);
+    if (index == ROMFS_NONE || romfs.entry(index).isDir) { fprintf(stderr, "%s: not a file\n", path); return 1; }
+    Preview preview;
+    preview.open(romfs.source(), romfs.entry(index).offset, romfs.entry(index).size);
+    for (int i = 0; mode && i < PREVIEW_MODES; i++) {
+        if (!strcasecmp(mode, Preview::modeName(i)) && !preview.setMode(i)) { fprintf(stderr, "%s: not %s\n", path, mode); return 1; }
+    }
+    std::vector<std::string> lines;
+    for (u32 i = 0; i < page; i++) {
+        preview.render(24, 80, &lines);
+        preview.pageDown();
+    }
+    if (!preview.render(24, 80, &lines)) { fprintf(stderr, "%s: read error\n", path); return 1; }
+    printf("%s%s%s, %llu / %llu bytes\n", Preview::modeName(preview.getMode()), preview.getMode() == PREVIEW_TEXT ? " " : "",
+        preview.getMode() == PREVIEW_TEXT ? preview.encoding() : "",
+        (unsigned long long)preview.getPosition(), (unsigned long long)preview.getSize());
+    for (size_t i = 0; i < lines.size(); i++) printf("%s\n", lines[i].c_str());
+    if (preview.getMode() == PREVIEW_SMDH) {
+        u16 icon[SMDH_ICON_SIZE * SMDH_ICON_SIZE];
+        if (!preview.readIcon(icon)) return 1;
+        // Every other row and column, brightness only.
+        for (u32 y = 0; y < SMDH_ICON_SIZE; y += 2) {
+            for (u32 x = 0; x < SMDH_ICON_SIZE; x++) {
+                u16 c = icon[y * SMDH_ICON_SIZE + x];
+                u32 level = ((c >> 11) * 2 + ((c >> 5) & 0x3F) + (c & 0x1F) * 2) * 4 / 187;
+                putchar(" .:*#"[level > 4 ? 4 : level]);
+            }
+            putchar('\n');
+        }
+    }
+    return 0;
+}
+
+// Prints a saveDiff() report, which export takes as a list. Exits with 0 if the images hold the
+// same files, 1 if they differ, like diff(1).
+static int cmdDiff(RomFS &older, const char *path) {
+    std::unique_ptr<ImageSource> image(openSource(path));
+    RomFS newer;
+    if (!image) { fprintf(stderr, "%s: can't open\n", path); return 2; }
+    if (!newer.open(image.get(), detectBase(image.get()))) { fprintf(stderr, "%s: not a valid romfs image\n", path); return 2; }
+    Differ differ;
+    if (!differ.start(&older, &newer) || differ.wait() != COPY_DONE) { fprintf(stderr, "diff failed\n"); return 2; }
+    const std::vector<diff_entry> &results = differ.getResults();
+    writeDiff(stdout, results);
+    fprintf(stderr, "%u added, %u removed, %u modified, %llu bytes hashed\n", differ.count(DIFF_ADDED), differ.count(DIFF_REMOVED),
+        differ.count(DIFF_MODIFIED), (unsigned long long)differ.getProgress());
+    return results.empty() ? 0 : 1;
+}
+
+// Writes the files named in a list, or the ones that changed since an older image, into a
+// directory laid out like the romfs. Exits with 1 if there is nothing to export, and with 2 after
+// exporting the rest if some listed paths weren't found.
+static int cmdExport(RomFS &romfs, const char *output, const char *from) {
+    std::unique_ptr<ImageSource> image(openSource(from));
+    RomFS older;
+    std::vector<u32> files;
+    std::vector<std::string> paths;
+    u32 missing = 0;
+    if (image && older.open(image.get(), detectBase(image.get()))) {
+        Differ differ;
+        if (!differ.start(&older, &romfs) || differ.wait() != COPY_DONE) { fprintf(stderr, "diff failed\n"); return 1; }
+        changedFiles(differ.getResults(), &files);
+    } else if (loadPathList(from, &paths)) {
+        missing = selectFiles(&romfs, paths, &files);
+        if (missing) fprintf(stderr, "%u listed path(s) not found\n", missing);
+    } else { fprintf(stderr, "%s: can't open\n", from); return 1; }
+    if (files.empty()) { fprintf(stderr, "no files to export\n"); return 1; }
+    Extractor extractor;
+    if (!extractor.start(&romfs, files, output, defaultExtractOptions())) { fprintf(stderr, "%s: can't create output files\n", output); return 1; }
+    int result = extractor.wait();
+    printf("%u files, %llu bytes exported\n", extractor.getFilesDone(), (unsigned long long)extractor.getSize());
+    if (result != COPY_DONE) return 1;
+    return missing ? 2 : 0;
+}
+
+static int cmdBuild(const char *source, const char *output, const build_options &options) {
+    RomFSBuilder builder;
+    if (!builder.start(source, output, options)) { fprintf(stderr, "%s: can't read tree or create %s\n", source, output); return 1; }
+    int result = builder.wait();
+    if (result != COPY_DONE) { fprintf(stderr, "%s: build failed\n", output); return 1; }
+    printf("%u directories, %u files, %llu bytes of level 3\n", builder.getDirCount(), builder.getFileCount(), (unsigned long long)builder.getSize());
+    return 0;
+}
+
+int main(int argc, char **argv) {
+#ifdef PERF
+    atexit(printPerf);
+    if (getenv("PERF_TRACE")) perfTraceOpen(getenv("PERF_TRACE"));
+#endif
+    extract_options extractOptions = defaultExtractOptions();
+    if (argc > 1 && !strcmp(argv[1], "extract")) {
+        while (argc > 2 && !strncmp(argv[2], "--", 2)) {
+            if (!strcmp(argv[2], "--full")) extractOptions.incremental = false;
+            else if (!strcmp(argv[2], "--trust-offsets")) extractOptions.trustOffsets = true;
+            else if (!strcmp(argv[2], "--delete")) extractOptions.removeStale = true;
+            else { usage(); return 1; }
+            memmove(argv + 2, argv + 3, (argc - 3) * sizeof(char*));
+            argc--;
+        }
+    }
+    if (argc > 2 && !strcmp(argv[1], "build")) {
+        build_options buildOptions = defaultBuildOptions();
+        buildOptions.threads = std::thread::hardware_concurrency();
+        if (!strcmp(argv[2], "--no-ivfc")) {
+            buildOptions.ivfc = false;
+            memmove(argv + 2, argv + 3, (argc - 3) * sizeof(char*));
+            argc--;
+        }
+        if (argc < 4) { usage(); return 1; }
+        if (argc > 4) buildOptions.threads = strtoul(argv[4], NULL, 0);
+        return cmdBuild(argv[2], argv[3], buildOptions);
+    }
+    if (argc < 3) { usage(); return 1; }
+    std::unique_ptr<ImageSource> image(openSource(argv[2]));
+    if (!image) { fprintf(stderr, "%s: can't open\n", argv[2]); return 1; }
+    if (!strcmp(argv[1], "verify")) return cmdVerify(image.get(), (argc > 3) ? strtoul(argv[3], NULL, 0) : std::thread::hardware_concurrency());
+    if (!strcmp(argv[1], "dump")) {
+        if (argc < 4) { usage(); return 1; }
+        return cmdDump(image.get(), argv[3], argc - 4, argv + 4);
+    }
+    RomFS romfs;
+    if (!romfs.open(image.get(), detectBase(image.get()))) { fprintf(stderr, "%s: not a valid romfs image\n", argv[2]); return 1; }
+    if (!strcmp(argv[1], "ls")) return cmdList(romfs, (argc > 3) ? argv[3] : "/");
+    if (!strcmp(argv[1], "find") && argc > 3) return cmdFind(romfs, argc - 3, argv + 3);
+    if (!strcmp(argv[1], "preview") && argc > 3) return cmdPreview(romfs, argv[3], (argc > 4) ? argv[4] : NULL, (argc > 5) ? strtoul(argv[5], NULL, 0) : 0);
+    if (!strcmp(argv[1], "export") && argc > 4) return cmdExport(romfs, argv[3], argv[4]);
+    if (!strcmp(argv[1], "diff") && argc > 3) return cmdDiff(romfs, argv[3]);
+    if (!strcmp(argv[1], "extract") && argc > 3) return cmdExtract(romfs, argv[3], (argc > 4) ? argv[4] : "/", extractOptions);
+    usage();
+    return 1;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Builds an image from a generated tree, then checks that romfstool verify passes it and reports
+# a byte flipped in level 3 as a bad block range, and that an incremental extract picks up a file
+# whose contents changed but whose size and data offset didn't.
+# Usage: test.sh <romfstool> <work dir>
+TOOL=$1
+WORK=$2
+fail() { echo "FAIL: $*"; exit 1; }
+
+rm -rf "$WORK"
+mkdir -p "$WORK/tree/data/sub" || fail "can't create $WORK"
+i=0
+while [ $i -lt 24 ]; do
+    awk -v n=$i 'BEGIN { for (j = 0; j < 40 * (n + 1); j++) printf "file %d line %d\n", n, j }' > "$WORK/tree/data/file$i.txt"
+    i=$((i + 1))
+done
+echo small > "$WORK/tree/data/sub/small.bin"
+"$TOOL" build "$WORK/tree" "$WORK/clean.romfs" > /dev/null || fail "build"
+
+"$TOOL" verify "$WORK/clean.romfs" > "$WORK/clean.txt"
+status=$?
+[ $status -eq 0 ] || fail "verify of the clean image exited $status"
+grep -q '^OK' "$WORK/clean.txt" || fail "clean image not reported OK"
+
+# Level 3 of a built image starts at 0x1000 and is hashed in 0x1000 byte blocks, so a byte at
+# level 3 offset 0x2345 makes the block at 0x2000 bad.
+cp "$WORK/clean.romfs" "$WORK/corrupt.romfs"
+printf '\377' | dd of="$WORK/corrupt.romfs" bs=1 seek=$((0x1000 + 0x2345)) conv=notrunc 2> /dev/null
+"$TOOL" verify "$WORK/corrupt.romfs" > "$WORK/corrupt.txt"
+status=$?
+[ $status -eq 2 ] || fail "verify of the corrupted image exited $status, expected 2"
+grep -q '^level 3: bad blocks at 0x2000-0x3000 (image offset 0x3000)$' "$WORK/corrupt.txt" || fail "bad range not reported: $(cat "$WORK/corrupt.txt")"
+grep -q '^CORRUPT' "$WORK/corrupt.txt" || fail "corrupted image not reported CORRUPT"
+
+echo "verify tests passed"
+
+"$TOOL" extract "$WORK/clean.romfs" "$WORK/out" > /dev/null || fail "extract"
+cp -r "$WORK/out" "$WORK/fast"
+cmp -s "$WORK/tree/data/file3.txt" "$WORK/out/data/file3.txt" || fail "extracted file differs"
+sed 's/line 7$/LINE 7/' "$WORK/tree/data/file3.txt" > "$WORK/file3.txt" && mv "$WORK/file3.txt" "$WORK/tree/data/file3.txt"
+"$TOOL" build "$WORK/tree" "$WORK/changed.romfs" > /dev/null || fail "build of the changed tree"
+"$TOOL" extract --trust-offsets "$WORK/changed.romfs" "$WORK/fast" > "$WORK/fast.txt" || fail "extract --trust-offsets"
+grep -q '^0 files written, 25 unchanged' "$WORK/fast.txt" || fail "--trust-offsets read unmoved files: $(cat "$WORK/fast.txt")"
+"$TOOL" extract "$WORK/changed.romfs" "$WORK/out" > "$WORK/extract.txt" || fail "incremental extract"
+grep -q '^1 files written, 24 unchanged' "$WORK/extract.txt" || fail "unexpected extract result: $(cat "$WORK/extract.txt")"
+cmp -s "$WORK/tree/data/file3.txt" "$WORK/out/data/file3.txt" || fail "same size change not extracted"
+
+echo "extract tests passed"
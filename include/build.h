@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "types.h"
+#include "copy.h"
+#include "thread.h"
+
+#define BUILD_DATA_ALIGN 0x10       // file data alignment inside level 3
+#define BUILD_BLOCK_LOG 12          // IVFC hash block size (log2) on every level
+#define BUILD_MAX_THREADS 8
+#define BUILD_HASH_BATCH 16         // blocks a hashing thread takes at once
+
+typedef struct {
+    bool ivfc;          // wrap level 3 in an IVFC hash tree, as dumps are; else write bare level 3
+    u32 threads;        // threads hashing level 3 blocks
+    u32 chunkSize;      // 0 to use the calibrated size for route
+    std::string route;  // see ChunkTuner
+} build_options;
+
+// One directory or file of the tree being packed; children of a directory are contiguous.
+typedef struct {
+    std::string path;       // source path
+    std::vector<u16> name;  // UTF-16, as stored in the metadata
+    u32 parent;
+    u32 dirs;               // first subdirectory, or ROMFS_NONE
+    u32 files;              // first file, or ROMFS_NONE
+    u32 sibling;            // next entry of the same kind in the same directory, or ROMFS_NONE
+    u32 metaOffset;
+    u32 nextHash;           // metadata offset of the next entry in the same bucket
+    u64 dataOffset;         // files: offset in the file data area
+    u64 size;
+} build_entry;
+
+// Packs a directory tree into a romfs image that mounts like a dump. The tree is scanned and laid
+// out up front (only metadata is kept in memory), then level 3 is streamed through the copy
+// engine straight from the source files. With IVFC on, every level 3 block is hashed on a pool
+// of threads while the next chunk is read and the current one written, and the two upper levels
+// and the master hash are written once level 3 is complete.
+class RomFSBuilder {
+public:
+    RomFSBuilder();
+    ~RomFSBuilder();
+
+    bool start(const std::string &source, const std::string &path, const build_options &options);
+    void cancel();
+    int wait();
+    void pause(bool paused) { if (engine) engine->pause(paused); }
+
+    bool isRunning() const { return status == COPY_RUNNING; }
+    u64 getProgress() const { return engine ? engine->getProgress() : 0; }
+    u64 getSize() const { return levelSize; }
+    u32 getFileCount() const { return files.size(); }
+    u32 getDirCount() const { return dirs.size(); }
+
+private:
+    // Level 3 as one stream: the metadata, then each file's data after its alignment padding.
+    class LayoutReader : public Reader {
+    public:
+        s64 read(void *buffer, u32 size);
+        RomFSBuilder *owner;
+        u64 position;
+        u32 next;
+        FILE *file;
+    };
+    // Writes level 3 out and hashes its blocks into level 2 on the hashing threads.
+    class HashWriter : public Writer {
+    public:
+        bool write(const void *buffer, u32 size);
+        RomFSBuilder *owner;
+        u64 blocks;         // level 3 blocks hashed or handed out
+        u32 carried;        // bytes of a partial block waiting in carry
+        std::vector<u8> carry;
+    };
+    bool scan(const std::string &source);
+    void layout();
+    bool finish();
+    static void run(void *arg);
+    static void hashThread(void *arg);
+    void hashBatches();
+    void close();
+
+    std::vector<build_entry> dirs;
+    std::vector<build_entry> files;
+    std::vector<u8> metadata;   // level 3 up to the file data
+    std::vector<u8> level2;     // level 3 block hashes
+    build_options options;
+    std::string path;
+    FILE *output;
+    u64 levelOffset;            // of level 3 in the output
+    u64 levelSize;
+    u32 blockSize;
+    u64 dataOffset;
+
+    // hashing pool: the writer hands out a batch of blocks and waits until they're hashed
+    Worker hashers[BUILD_MAX_THREADS];
+    u32 hasherCount;
+    Mutex mutex;
+    Condition changed;
+    const u8 *jobData;
+    u64 jobFirst;
+    u32 jobCount;
+    u32 jobNext;
+    u32 jobActive;
+    bool stopping;
+
+    LayoutReader reader;
+    HashWriter writer;
+    std::atomic<int> status;
+    std::atomic<bool> cancelled;
+    CopyEngine *engine;
+    Worker driver;
+};
+
+const build_options &defaultBuildOptions();
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include "types.h"
+#include "image.h"
+#include "thread.h"
+
+#define CACHE_BLOCK_SIZE 0x4000     // aligned block, the unit of every read from the image
+#define CACHE_DEFAULT_SIZE 0x100000 // per image; eight mounts stay well inside the 64MB mode
+#define CACHE_BYPASS_SIZE 0x10000   // reads this big (metadata, span reads) go straight to the image
+#define CACHE_READAHEAD 8           // blocks kept queued ahead of a sequential reader
+#define CACHE_SEQUENTIAL 2          // block steps in a row that count as a sequential pattern
+#define CACHE_NONE ((u64)-1)
+
+typedef struct {
+    u64 hits;
+    u64 misses;
+    u64 bypassed;       // reads too large to cache
+    u64 prefetched;     // blocks loaded by read-ahead
+    u64 prefetchHits;   // first hits on blocks that read-ahead loaded
+} cache_stats;
+
+// Block cache in front of another image, for the many small nearby reads of browsing, previews
+// and small file copies, which would otherwise each be a round trip to the FS service. Blocks
+// are evicted least recently used first. Once reads step through consecutive blocks, the next
+// CACHE_READAHEAD blocks are loaded on a background thread before they are asked for.
+class CachedImage : public ImageSource {
+public:
+    // Deletes image on destruction if owned.
+    CachedImage(ImageSource *image, bool owned, u32 capacity = CACHE_DEFAULT_SIZE, u32 blockSize = CACHE_BLOCK_SIZE);
+    ~CachedImage();
+    bool read(u64 offset, void *buffer, u32 size);
+    u64 size() { return length; }
+    const char *backend() const { return image->backend(); }
+
+    cache_stats getStats();
+    void resetStats();
+
+private:
+    typedef struct {
+        u64 block;          // CACHE_NONE if empty
+        u32 lastUse;
+        bool loading;       // being read from the image, others wait on changed
+        bool prefetched;    // loaded by read-ahead and not hit yet
+    } cache_slot;
+    bool readBlock(u64 block, u32 start, u8 *out, u32 len);
+    int claim(u64 block);
+    bool fill(int slot);
+    void loaded(int slot, bool ok);
+    void readAhead(u64 block);
+    static void aheadThread(void *arg);
+
+    ImageSource *image;
+    bool owned;
+    u64 length;
+    u32 blockSize;
+    u64 blockCount;
+    std::vector<u8> data;
+    std::vector<cache_slot> slots;
+    std::unordered_map<u64, u32> lookup;    // block to slot
+    u32 clock;
+    u64 lastBlock;
+    u32 streak;
+    u64 aheadNext;      // read-ahead works through [aheadNext, aheadEnd)
+    u64 aheadEnd;
+    bool aheadStarted;
+    bool stopping;
+    cache_stats stats;
+    Mutex mutex;
+    Condition changed;
+    Worker worker;
+};
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <stdio.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "types.h"
+#include "image.h"
+#include "thread.h"
+
+// Sequential byte stream feeding the copy engine. read() returns the number of bytes read,
+// 0 at the end of the stream and -1 on error.
+class Reader {
+public:
+    virtual ~Reader() {}
+    virtual s64 read(void *buffer, u32 size) = 0;
+    // Readers over a mapped image (see ImageSource::map) can hand out the data in place: borrow()
+    // works like read() but points data at the bytes instead of copying them. Only used when
+    // mapped() is true.
+    virtual bool mapped() { return false; }
+    virtual s64 borrow(const void **data, u32 size) { (void)data; (void)size; return -1; }
+};
+
+class Writer {
+public:
+    virtual ~Writer() {}
+    virtual bool write(const void *buffer, u32 size) = 0;
+};
+
+class FileReader : public Reader {
+public:
+    FileReader(FILE *file) : file(file) {}
+    s64 read(void *buffer, u32 size);
+private:
+    FILE *file;
+};
+
+class FileWriter : public Writer {
+public:
+    FileWriter(FILE *file) : file(file) {}
+    bool write(const void *buffer, u32 size);
+private:
+    FILE *file;
+};
+
+#define SPAN_GAP 0x200  // spans at most this far apart in the image share one read
+
+typedef struct {
+    u64 offset;
+    u64 size;
+} copy_span;
+
+// Reads a list of image ranges back to back, as one stream. Ranges that follow each other
+// closely are fetched with a single read of the whole span, with the gaps squeezed out.
+class SpanReader : public Reader {
+public:
+    SpanReader() : image(NULL), spans(NULL), next(0), offset(0) {}
+    void reset(ImageSource *image, const std::vector<copy_span> *spans);
+    s64 read(void *buffer, u32 size);
+    bool mapped() { return image && image->map(0, 0); }
+    s64 borrow(const void **data, u32 size);
+private:
+    ImageSource *image;
+    const std::vector<copy_span> *spans;
+    size_t next;
+    u64 offset;
+};
+
+// Reads [offset, offset + size) of an image front to back.
+class ImageReader : public Reader {
+public:
+    ImageReader(ImageSource *image, u64 offset, u64 size) : image(image), offset(offset), end(offset + size) {}
+    s64 read(void *buffer, u32 size);
+    bool mapped() { return image->map(0, 0); }
+    s64 borrow(const void **data, u32 size);
+private:
+    ImageSource *image;
+    u64 offset;
+    u64 end;
+};
+
+#define COPY_ALIGN 0x1000
+#define COPY_DEFAULT_CHUNK 0x50000
+#define COPY_SMALL_FILE 0x10000     // streams up to this size are copied in one go, without the ring
+#define COPY_POOL_LIMIT 0x800000    // idle buffer memory kept by the pool
+#define COPY_TUNE_READS 4           // chunks read with each candidate size while calibrating
+#define WRITE_QUEUE_THREADS 2
+#define WRITE_QUEUE_LIMIT 0x400000  // bytes of file data waiting in a WriteQueue
+
+// Aligned transfer buffers, kept between copies so each file doesn't malloc and free its own.
+// acquire() hands out the smallest idle buffer of at least size bytes and reports its real size.
+class BufferPool {
+public:
+    BufferPool(size_t limit = COPY_POOL_LIMIT) : limit(limit), idleBytes(0) {}
+    ~BufferPool() { trim(); }
+    char *acquire(u32 size, u32 *capacity);
+    void release(char *buffer, u32 capacity);
+    void trim();
+    size_t memoryUsage();
+private:
+    typedef struct {
+        char *buffer;
+        u32 capacity;
+    } pool_slot;
+    std::vector<pool_slot> idle;
+    size_t limit;
+    size_t idleBytes;
+    Mutex mutex;
+};
+
+BufferPool &bufferPool();
+
+// Best chunk size per route ("<source>><destination>", e.g. "title-card>sd"), measured by the
+// first large enough transfer over that route and remembered in a "route = size" file.
+class ChunkTuner {
+public:
+    ChunkTuner() : dirty(false) {}
+    u32 lookup(const std::string &route);
+    void store(const std::string &route, u32 chunkSize);
+    bool load(const char *path);
+    bool save(const char *path);
+private:
+    std::map<std::string, u32> sizes;
+    bool dirty;
+    Mutex mutex;
+};
+
+ChunkTuner &chunkTuner();
+
+// Candidate chunk sizes tried during calibration, smallest first.
+extern const u32 tuneSizes[];
+extern const u32 tuneCount;
+
+// Writes whole files on background threads, so opening and closing many small files overlaps
+// with reading the next ones. push() copies the data and blocks while the queue is full; it
+// fails once any queued write has failed. flush() waits until everything queued is written
+// and reports (and clears) failures.
+class WriteQueue {
+public:
+    WriteQueue() : queued(0), active(0), stopping(false), started(false), failed(false), written(0) {}
+    ~WriteQueue();
+    bool push(const std::string &path, const void *data, u32 size);
+    bool flush();
+    u32 getWritten() const { return written; }
+private:
+    typedef struct {
+        std::string path;
+        std::vector<u8> data;
+    } write_job;
+    static void workThread(void *arg);
+
+    std::deque<write_job> jobs;
+    size_t queued;
+    u32 active;
+    bool stopping;
+    bool started;
+    std::atomic<bool> failed;
+    std::atomic<u32> written;
+    Mutex mutex;
+    Condition changed;
+    Worker workers[WRITE_QUEUE_THREADS];
+};
+
+enum {
+    COPY_IDLE,
+    COPY_RUNNING,
+    COPY_DONE,
+    COPY_READ_ERROR,
+    COPY_WRITE_ERROR,
+    COPY_CANCELLED
+};
+
+// Copies a stream with one thread reading and one thread writing, passing a ring of buffers
+// between them so that both sides of the transfer overlap. Progress is a plain atomic that the
+// UI can sample once per frame. A bufferSize of 0 takes the chunk size from the tuner for the
+// route given to setRoute(), calibrating it during the transfer if the route is new. Mapped
+// readers bypass the ring: the writer is handed spans of the image directly, on one thread.
+class CopyEngine {
+public:
+    CopyEngine(u32 bufferSize = 0, u32 depth = 4);
+    ~CopyEngine();
+
+    // Route and stream size (0 if unknown) for the next start().
+    void setRoute(const std::string &route, u64 size);
+    bool start(Reader *reader, Writer *writer);
+    void cancel();
+    int wait();
+    // Holds reads before the next chunk until unpaused; stays set across start() calls.
+    void pause(bool paused);
+
+    bool isRunning() const { return status == COPY_RUNNING; }
+    int getStatus() const { return status; }
+    u64 getProgress() const { return progress; }
+
+private:
+    static void readThread(void *arg);
+    static void writeThread(void *arg);
+    void finish(int result);
+    int copySmall();
+    int copyMapped();
+    static void mappedThread(void *arg);
+    bool holdWhilePaused();
+    bool allocate(u32 chunk);
+    void releaseBuffers();
+    u32 chunkFor(u32 reads) const;
+    void endCalibration();
+
+    u32 bufferSize;
+    u32 depth;
+    std::string route;
+    u64 streamSize;
+    u32 chunkSize;      // read size of the current transfer
+    bool calibrating;
+    u32 reads;
+    std::vector<u64> readTicks;     // per candidate size while calibrating
+    std::vector<u64> writeTicks;
+    std::vector<char*> buffers;
+    std::vector<u32> capacities;
+    std::vector<u32> lengths;
+    std::vector<u32> phases;        // candidate each filled buffer was read with
+    u32 filled;     // buffers handed to the writer and not yet written
+    u32 readSlot;
+    u32 writeSlot;
+    bool eof;
+
+    Reader *reader;
+    Writer *writer;
+    Mutex mutex;
+    Condition changed;
+    Worker readWorker;
+    Worker writeWorker;
+    std::atomic<int> status;
+    std::atomic<u64> progress;
+    std::atomic<bool> cancelled;
+    std::atomic<bool> paused;
+};
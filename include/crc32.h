@@ -0,0 +1,6 @@
+#pragma once
+
+#include "types.h"
+
+// Standard (zlib) CRC-32. Pass the previous result to continue a running checksum; start with 0.
+u32 crc32(u32 crc, const void *data, size_t size);
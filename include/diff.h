@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "types.h"
+#include "copy.h"
+#include "romfs.h"
+#include "sha256.h"
+#include "thread.h"
+
+#define DIFF_HEADER "# romfs-explorer diff v1"
+
+enum {
+    DIFF_ADDED,
+    DIFF_REMOVED,
+    DIFF_MODIFIED
+};
+
+typedef struct {
+    std::string path;   // from the romfs root; directories end with '/'
+    u32 oldIndex;       // ROMFS_NONE for added entries
+    u32 newIndex;       // ROMFS_NONE for removed entries
+    int change;
+} diff_entry;
+
+// Compares two romfs images: both metadata trees are walked together, matching entries by path
+// with one hash lookup each, and files are compared by size. Only files whose sizes match get
+// their contents read, in one offset ordered pass over each image that takes the SHA-256 of every
+// file, so a match can be trusted to leave a file out of an exported patch.
+// Everything below an added or removed directory is listed as added or removed too.
+class Differ {
+public:
+    Differ();
+    ~Differ();
+
+    bool start(const RomFS *older, const RomFS *newer);
+    void cancel();
+    int wait();
+
+    bool isRunning() const { return status == COPY_RUNNING; }
+    u64 getProgress() const { return base + (engine ? engine->getProgress() : 0); }
+    u64 getSize() const { return total; }
+    // Sorted by path, once wait() returned COPY_DONE.
+    const std::vector<diff_entry> &getResults() const { return results; }
+    u32 count(int change) const;
+
+private:
+    typedef struct {
+        u8 bytes[SHA256_HASH_SIZE];
+    } digest;
+    class HashWriter : public Writer {
+    public:
+        bool write(const void *buffer, u32 size);
+        const std::vector<copy_span> *spans;
+        std::vector<digest> *digests;
+        size_t next;
+        u64 remaining;
+        sha256_ctx ctx;
+    };
+    static void run(void *arg);
+    void walk();
+    void addTree(const RomFS *romfs, u32 index, int change);
+    int hash(const RomFS *romfs, bool older, std::vector<digest> *digests);
+
+    const RomFS *older;
+    const RomFS *newer;
+    std::vector<diff_entry> results;
+    std::vector<u32> candidates;    // pairs of old and new file indices with equal sizes
+    std::vector<copy_span> spans;
+    std::atomic<u64> total;
+    std::atomic<u64> base;
+    std::atomic<int> status;
+    std::atomic<bool> cancelled;
+    CopyEngine *engine;
+    Worker driver;
+};
+
+// Text report, one "<A|D|M>\t<path>" line per entry after DIFF_HEADER.
+bool writeDiff(FILE *out, const std::vector<diff_entry> &entries);
+bool saveDiff(const std::string &path, const std::vector<diff_entry> &entries);
+// Reads the paths to export from a saveDiff() report, skipping removed entries, or from a plain
+// list with one romfs path per line.
+bool loadPathList(const std::string &path, std::vector<std::string> *dest);
+// Resolves paths to the files they name; a directory stands for every file below it. Returns how
+// many paths weren't found.
+u32 selectFiles(const RomFS *romfs, const std::vector<std::string> &paths, std::vector<u32> *files);
+// The added and modified files of a comparison, as indices into the newer image.
+void changedFiles(const std::vector<diff_entry> &entries, std::vector<u32> *files);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "types.h"
+#include "copy.h"
+#include "image.h"
+#include "sha256.h"
+
+// Size of the placeholder IVFC header written in front of the level 3 data.
+#define DUMP_HEADER_SIZE 0x1000
+
+typedef struct {
+    u32 chunkSize;           // bytes per FS read, 0 to use the calibrated size for route
+    u32 depth;               // chunks in flight between the read and write stages
+    u32 checkpointInterval;  // bytes written between two checkpoints
+    std::string route;       // see ChunkTuner
+} dump_options;
+
+// Writes an image to a file through the copy engine, hashing the output as it goes and
+// keeping a "<path>.ckpt" checkpoint so an interrupted dump picks up where it stopped.
+// The final hash is stored next to the dump as "<path>.sha256".
+class Dumper {
+public:
+    Dumper();
+    static bool hasCheckpoint(const std::string &path);
+
+    // With resume set, continue from the checkpoint if it matches the image, else start over.
+    bool start(ImageSource *image, const std::string &path, const dump_options &options, bool resume);
+    void cancel() { if (engine) engine->cancel(); }
+    int wait();
+    void pause(bool paused) { if (engine) engine->pause(paused); }
+
+    bool isRunning() const { return engine && engine->isRunning(); }
+    u64 getProgress() const { return engine ? resumed + engine->getProgress() : written; }
+    u64 getSize() const { return total; }
+    u64 getResumed() const { return resumed; }
+    const std::string &getHash() const { return hash; }
+
+private:
+    class HashWriter : public Writer {
+    public:
+        bool write(const void *buffer, u32 size);
+        Dumper *owner;
+    };
+    bool loadCheckpoint(ImageSource *image);
+    bool saveCheckpoint();
+    void close();
+
+    std::string path;
+    FILE *file;
+    u64 total;
+    u64 resumed;
+    u64 written;
+    u64 lastCheckpoint;
+    u32 interval;
+    sha256_ctx ctx;
+    std::vector<u8> tail;   // last bytes written, to verify the checkpoint on resume
+    std::string hash;
+    ImageReader *reader;
+    HashWriter writer;
+    CopyEngine *engine;
+};
+
+const dump_options &defaultDumpOptions();
+
+// Overrides options from "key=value" lines (chunk_size, depth, checkpoint_interval), if the file exists.
+bool loadDumpOptions(const char *path, dump_options *options);
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "types.h"
+#include "copy.h"
+#include "romfs.h"
+#include "thread.h"
+
+#define MANIFEST_NAME ".romfs-manifest"
+#define BATCH_FILE_MAX 0x10000  // files up to this size are written through the write queue
+
+typedef struct {
+    u32 chunkSize;      // 0 to use the calibrated size for route
+    u32 depth;
+    bool incremental;   // skip files the previous extraction's manifest shows as unchanged
+    bool trustOffsets;  // with incremental: same size and data offset counts as unchanged without hashing
+    bool removeStale;   // with incremental: delete files listed in the manifest but gone from the image
+    std::string route;  // see ChunkTuner
+} extract_options;
+
+// One line of the manifest written next to an extracted tree.
+typedef struct {
+    u64 size;
+    u64 offset;         // offset in the romfs file data area
+    u32 crc;
+} manifest_entry;
+
+typedef std::unordered_map<std::string, manifest_entry> manifest;
+
+bool loadManifest(const std::string &path, manifest *dest);
+bool saveManifest(const std::string &path, const manifest &src);
+
+// Extracts a romfs subtree straight from the index: every output directory is created first,
+// then file contents are streamed through the copy engine in data offset order, so the image
+// is read front to back. A manifest (path, size, offset, CRC-32) is written into the extracted
+// directory; incremental runs use it to only rewrite files that changed. Runs of small files
+// are read from the image in one go (see SpanReader) and written out by a WriteQueue.
+class Extractor {
+public:
+    Extractor();
+    ~Extractor();
+
+    // Extracts entry root (a file or a directory) into the directory dest, which must exist.
+    bool start(const RomFS *romfs, u32 root, std::string dest, const extract_options &options);
+    // Extracts only the given files, at their full romfs paths below dest, creating dest and the
+    // directories leading to each file. Meant for patch directories, so no manifest is kept.
+    bool start(const RomFS *romfs, const std::vector<u32> &files, std::string dest, const extract_options &options);
+    void cancel();
+    int wait();
+    void pause(bool paused) { if (engine) engine->pause(paused); }
+
+    bool isRunning() const { return status == COPY_RUNNING; }
+    u64 getProgress() const { return base + (engine ? engine->getProgress() : 0); }
+    u64 getSize() const { return total; }
+    u32 getFileCount() const { return fileCount; }
+    u32 getFilesDone() const { return done; }
+    u32 getSkipped() const { return skipped; }
+    u32 getRemoved() const { return removed; }
+
+    // Collects the files and directories below root; directories in index order (parents first).
+    static void collect(const RomFS *romfs, u32 root, std::vector<u32> *dirs, std::vector<u32> *files);
+
+private:
+    class SplitWriter : public Writer {
+    public:
+        bool write(const void *buffer, u32 size);
+        Extractor *owner;
+        u32 next;
+        u64 remaining;
+        u32 crc;
+        FILE *file;
+        bool discard;   // only checksum the data
+    };
+    static void run(void *arg);
+    bool begin(const std::vector<u32> &dirs, const std::vector<u32> &files);
+    int stream(std::vector<u32> *list, bool write);
+    std::string outputPath(u32 index) const;
+    std::string relativePath(u32 index) const;
+    manifest_entry describe(u32 index) const;
+    void close();
+
+    const RomFS *romfs;
+    u32 root;
+    std::string dest;
+    std::string rootPath;
+    bool keepManifest;
+    extract_options options;
+    manifest previous;
+    manifest current;
+    std::vector<u32> checks;   // same size as in the manifest, content to be compared
+    std::vector<u32> copies;   // to be written, by data offset
+    std::vector<u32> *list;    // list being streamed
+    std::unordered_map<u32, u32> crcs;
+    std::atomic<u64> total;
+    std::atomic<u64> base;
+    std::atomic<u32> fileCount;
+    std::atomic<u32> done;
+    std::atomic<u32> skipped;
+    std::atomic<u32> removed;
+    std::atomic<int> status;
+    std::atomic<bool> cancelled;
+    std::vector<copy_span> spans;   // image ranges of list
+    SpanReader reader;
+    SplitWriter writer;
+    CopyEngine *engine;
+    WriteQueue queue;
+    Worker driver;
+};
+
+const extract_options &defaultExtractOptions();
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "types.h"
+#include "romfs.h"
+
+typedef struct {
+    std::string name;
+    std::string path;
+    bool isDir;
+    u64 size;
+} filedata;
+
+// Compact listing entry: the name lives in the list's arena and the full path is only
+// rebuilt (directory + name) when the entry is materialized as filedata.
+typedef struct {
+    u32 name;       // offset of the NUL terminated name in the arena
+    u32 parent;     // directory id, see FileList::getDirectory
+    u64 size : 63;
+    u64 isDir : 1;
+} fileentry;
+
+// A directory listing that is sorted incrementally: only the rows that have been asked for
+// are guaranteed to be in their final place, and rows are turned into filedata on demand.
+class FileList {
+public:
+    FileList();
+    void clear();
+    void swap(FileList &other);
+
+    // Lists a directory in a single pass, taking type and size from the directory entries
+    // themselves instead of probing every entry with opendir/fopen.
+    bool scan(std::string directory);
+    bool assign(const RomFS *romfs, std::string directory);
+    // Appends romfs entries from anywhere in the image (e.g. search results) under their own
+    // directories, prefix being the mount root without the trailing '/'. Rows keep the given order.
+    void addEntries(const RomFS *romfs, const std::string &prefix, const u32 *items, u32 count);
+
+    // Build a listing by hand; add() appends to the directory given to the last addDirectory().
+    u32 addDirectory(std::string directory);
+    void add(const char *name, bool isDir, u64 size);
+
+    u32 size() const { return order.size(); }
+    std::string getDirectory(u32 id = 0) const { return &arena[dirs[id]]; }
+    size_t memoryUsage() const;
+
+    // Make rows [first, first + count) final. Cheap once those rows are sorted.
+    void prepare(u32 first, u32 count);
+    filedata get(u32 row);
+
+private:
+    struct Order {
+        const FileList *list;
+        bool operator() (u32 a, u32 b) const;
+    };
+    const char *itemName(u32 item) const;
+    bool itemIsDir(u32 item) const;
+    u32 intern(const char *str, size_t len);
+
+    const RomFS *romfs;
+    std::vector<char> arena;
+    std::vector<u32> dirs;        // arena offsets of the listed directories' paths
+    std::vector<fileentry> entries;
+    std::vector<u32> order;       // items in display order; [0, head) and [tail, size) are final
+    u32 head;
+    u32 tail;
+};
+
+// Recently left directory listings, kept with the cursor position they were left at, so going
+// back up a level doesn't rescan anything. Least recently stored listings are dropped first.
+class ListingCache {
+public:
+    ListingCache(u32 capacity = 16);
+
+    // Moves list into the cache as the listing of directory; list is left empty.
+    void store(const std::string &directory, FileList *list, u32 cursor, u32 scroll);
+    // Moves a cached listing of directory into list; false if it isn't cached.
+    bool restore(const std::string &directory, FileList *list, u32 *cursor, u32 *scroll);
+    void invalidate(const std::string &directory);
+    void clear();
+
+private:
+    struct Slot {
+        std::string directory;
+        FileList list;
+        u32 cursor;
+        u32 scroll;
+        u32 lastUse;
+    };
+    std::vector<Slot> slots;
+    u32 capacity;
+    u32 clock;
+};
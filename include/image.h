@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdio.h>
+#include "types.h"
+#include "thread.h"
+
+enum {
+    IMAGE_AUTO,     // the fastest backend available: mmap on the host, the FS service on the 3DS
+    IMAGE_STDIO,
+    IMAGE_PREAD,
+    IMAGE_MMAP,
+    IMAGE_FS
+};
+
+// Random-access view of a romfs image (a dumped .romfs file, or the title's romfs handle).
+// read() may be called from several threads at once. Backends that keep the image in memory
+// also hand out spans of it through map(), which callers prefer over read() to skip a copy.
+class ImageSource {
+public:
+    virtual ~ImageSource() {}
+    virtual bool read(u64 offset, void *buffer, u32 size) = 0;
+    virtual u64 size() = 0;
+    // [offset, offset + size) in place, valid while the image is open; NULL if this backend
+    // can't do that, or the range is out of bounds.
+    virtual const u8 *map(u64 offset, u64 size) { (void)offset; (void)size; return NULL; }
+    virtual const char *backend() const = 0;
+};
+
+// Opens an image file with the given backend; NULL if it can't be opened.
+ImageSource *openImage(const char *path, int backend = IMAGE_AUTO);
+int imageBackend(const char *name);
+
+class StdioImage : public ImageSource {
+public:
+    StdioImage();
+    ~StdioImage();
+    bool open(const char *path);
+    void close();
+    bool read(u64 offset, void *buffer, u32 size);
+    u64 size();
+    const char *backend() const { return "stdio"; }
+private:
+    FILE *file;
+    u64 length;
+    Mutex mutex;
+};
+
+#ifndef _3DS
+// Positional reads, so threads don't serialize on a shared file position.
+class PreadImage : public ImageSource {
+public:
+    PreadImage();
+    ~PreadImage();
+    bool open(const char *path);
+    void close();
+    bool read(u64 offset, void *buffer, u32 size);
+    u64 size() { return length; }
+    const char *backend() const { return "pread"; }
+private:
+    int fd;
+    u64 length;
+};
+
+// The whole file mapped read-only; reads are a memcpy and map() is free.
+class MmapImage : public ImageSource {
+public:
+    MmapImage();
+    ~MmapImage();
+    bool open(const char *path);
+    void close();
+    bool read(u64 offset, void *buffer, u32 size);
+    u64 size() { return length; }
+    const u8 *map(u64 offset, u64 size);
+    const char *backend() const { return "mmap"; }
+private:
+    const u8 *data;
+    u64 length;
+};
+#endif
+
+#ifdef _3DS
+#include <3ds.h>
+
+class FSImage : public ImageSource {
+public:
+    // If owned is false the handle is left open on destruction (e.g. when ctrulib's romfs also uses it).
+    FSImage(Handle handle, bool owned);
+    ~FSImage();
+    bool read(u64 offset, void *buffer, u32 size);
+    u64 size();
+    const char *backend() const { return "fs"; }
+private:
+    Handle handle;
+    bool owned;
+};
+#endif
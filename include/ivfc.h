@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include "types.h"
+#include "image.h"
+#include "thread.h"
+
+#define IVFC_MAGIC 0x43465649 // "IVFC"
+#define IVFC_ROMFS_ID 0x10000
+#define IVFC_HEADER_SIZE 0x60
+#define IVFC_LEVELS 3
+
+typedef struct {
+    u64 logicalOffset;
+    u64 hashDataSize;
+    u32 blockSize;      // log2
+    u32 reserved;
+} ivfc_level;
+
+typedef struct {
+    u32 magic;
+    u32 id;
+    u32 masterHashSize;
+    ivfc_level levels[IVFC_LEVELS];
+    u32 reserved;
+    u32 optionalInfoSize;
+} __attribute__((packed)) ivfc_header;
+
+// Byte range of a level (1 to 3) whose blocks don't match the hashes one level up.
+typedef struct {
+    u32 level;
+    u64 offset;
+    u64 size;
+} ivfc_badrange;
+
+// Level 3 (the romfs data) follows the header and master hash, levels 1 and 2 come after it.
+class IVFCImage {
+public:
+    IVFCImage() : image(NULL), progress(0), cancelled(false), paused(false) {}
+    bool open(ImageSource *image);
+    const ivfc_header &getHeader() const { return header; }
+    u64 levelOffset(u32 level) const { return offsets[level - 1]; }
+    u64 levelSize(u32 level) const { return header.levels[level - 1].hashDataSize; }
+    u32 blockSize(u32 level) const { return 1 << header.levels[level - 1].blockSize; }
+
+    // Checks every level against the one above it, hashing level 3 on the given number of threads.
+    // Blocks until done; progress counts level 3 bytes and may be polled from another thread.
+    bool verify(u32 threads);
+    void cancel();
+    // Holds the hashing threads before their next batch until unpaused.
+    void pause(bool paused);
+    u64 getProgress() const { return progress; }
+    const std::vector<ivfc_badrange> &getBadRanges() const { return bad; }
+
+private:
+    struct Job {
+        IVFCImage *self;
+        std::atomic<u32> *next;
+        u32 level;
+        u32 count;
+        u32 batch;
+        const u8 *hashes;
+        std::vector<u32> failed;
+        bool error;
+    };
+    static void verifyThread(void *arg);
+    bool verifyLevel(u32 level, const std::vector<u8> &hashes, u32 threads);
+    bool readLevel(u32 level, std::vector<u8> *dest);
+    bool holdWhilePaused();
+
+    ImageSource *image;
+    ivfc_header header;
+    u64 offsets[IVFC_LEVELS];
+    std::vector<ivfc_badrange> bad;
+    std::atomic<u64> progress;
+    std::atomic<bool> cancelled;
+    std::atomic<bool> paused;
+    Mutex mutex;
+    Condition changed;
+};
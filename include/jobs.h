@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "types.h"
+#include "build.h"
+#include "dump.h"
+#include "extract.h"
+#include "image.h"
+#include "thread.h"
+
+#define JOB_POLL_MS 100         // how often the running job's progress is sampled
+
+enum {
+    JOB_DUMP,
+    JOB_EXTRACT,
+    JOB_VERIFY,
+    JOB_BUILD
+};
+
+enum {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_PAUSED,     // held before its next chunk, or skipped by the queue if it hasn't started
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELLED
+};
+
+// Written by the queue thread, read by the UI every frame without taking a lock.
+typedef struct {
+    std::atomic<int> state;
+    std::atomic<u64> done;
+    std::atomic<u64> total;
+    std::atomic<u32> rate;      // bytes per second, pauses left out
+    std::atomic<u32> eta;       // seconds left, 0 until known
+    std::atomic<int> result;    // COPY_* once finished
+} job_status;
+
+typedef struct {
+    s32 priority;       // of the queue thread, relative to the thread starting it; positive runs behind
+    u32 verifyThreads;
+} queue_options;
+
+// One queued operation. Only status changes once it's queued, and note once it has finished.
+typedef struct {
+    u32 id;
+    int type;
+    std::string label;
+    std::string note;       // why it failed, or what it found
+    ImageSource *image;     // dump, extract: the source, owned by the job until it ends
+    u64 base;               // extract: level 3 offset in image
+    std::string source;     // extract: romfs path; verify: image file; build: folder
+    std::string dest;       // dump: output file; extract: output directory; build: output image
+    bool resume;            // dump: continue from the checkpoint
+    dump_options dump;
+    extract_options extract;
+    build_options build;
+    bool started;
+    std::atomic<bool> pauseRequested;
+    std::atomic<bool> cancelRequested;
+    job_status status;
+} job;
+
+// Runs dumps, extractions, verifications and builds one at a time on a thread of its own, so
+// the UI stays free while they work; each job gets its own image handle and index. Jobs run in
+// queue order and jobs that haven't started can be moved. Pausing holds a running job before
+// its next chunk (the engines keep their place), or keeps a waiting one from starting. Only
+// the thread that owns the queue adds, moves, pauses or removes jobs.
+class JobQueue {
+public:
+    JobQueue();
+    ~JobQueue();
+
+    bool start(const queue_options &options);
+    // Cancels every job and waits for the running one to stop.
+    void stop();
+
+    // Jobs take ownership of image. Return the job id.
+    u32 addDump(ImageSource *image, const std::string &path, const dump_options &options, bool resume);
+    // Extracts the entry at path inside the romfs into the directory dest.
+    u32 addExtract(ImageSource *image, u64 base, const std::string &path, const std::string &dest, const extract_options &options);
+    u32 addVerify(const std::string &path);
+    u32 addBuild(const std::string &folder, const std::string &path, const build_options &options);
+
+    void pause(u32 id, bool paused);
+    void cancel(u32 id);
+    // Moves a job that hasn't started step places towards the back (or the front if negative).
+    bool move(u32 id, int step);
+    void clearFinished();
+
+    u32 count() const { return jobs.size(); }
+    const job &get(u32 index) const { return *jobs[index]; }
+    int find(u32 id) const;
+    u32 getRunning() const { return running; }  // id of the job being run, 0 if none
+    u32 getPending() const;                     // queued, running or paused
+    u32 getCompleted() const { return completed; }  // jobs finished since start, for noticing new output
+
+private:
+    u32 add(job *item);
+    static void run(void *arg);
+    int execute(job *item);
+    template <class T> int follow(job *item, T *op);
+
+    std::vector<job*> jobs;
+    queue_options options;
+    u32 nextId;
+    bool stopping;
+    std::atomic<u32> running;
+    std::atomic<u32> completed;
+    Mutex mutex;
+    Condition changed;
+    Worker worker;
+};
+
+const queue_options &defaultQueueOptions();
+bool loadQueueOptions(const char *path, queue_options *options);
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "types.h"
+#include "cache.h"
+#include "image.h"
+#include "romfs.h"
+#include "search.h"
+
+#define MOUNT_MAX 8
+#define MOUNT_DEFAULT_BUDGET 0x800000
+
+// Identifies an image in the on-SD index cache: a title by its program ID, the versions of it and
+// its update and their installed size, an image file by its size, modification time and a hash of
+// its first 0x1000 bytes (IVFC header and master hash).
+typedef struct {
+    u64 titleId;
+    u64 size;
+    u64 mtime;
+    u64 version;        // title: update version << 16 | base version
+    u8 hash[32];
+} mount_key;
+
+void titleKey(u64 titleId, u64 version, u64 size, mount_key *key);
+bool fileKey(const std::string &path, ImageSource *image, mount_key *key);
+
+typedef struct {
+    std::string name;   // path prefix, "<name>:/"
+    std::string label;  // where the image came from, for display
+    ImageSource *image;
+    CachedImage *blocks;    // image itself when reads go through a block cache, else NULL
+    u64 base;
+    RomFS *index;       // parsed metadata, NULL while evicted
+    SearchIndex *search;    // built on first search, evicted along with the metadata
+    u32 users;
+    u32 lastUse;
+    std::string cache;  // index file, empty if not cached
+    mount_key key;
+} mount_entry;
+
+// Keeps several romfs images open at once, each under its own mount name. The parsed metadata
+// of every mount is cached so switching between them costs nothing; when the cached tables go
+// over the memory budget, the least recently used mounts nobody holds are evicted and parsed
+// again on their next use. With a cache directory set, parsed tables are also kept on the SD card
+// and loaded from there in one read. Images that can't be mapped are read through a block cache.
+// Only meant to be used from the main thread.
+class MountManager {
+public:
+    MountManager(size_t budget = MOUNT_DEFAULT_BUDGET);
+    ~MountManager();
+
+    // Takes ownership of image. Returns the mount id, or -1 if the image isn't a valid romfs
+    // or all mount slots are taken. key enables the index cache for this image.
+    int mount(const std::string &name, const std::string &label, ImageSource *image, u64 base, const mount_key *key = NULL);
+    // Fails while the mount is acquired.
+    bool unmount(int id);
+    void clear();
+
+    int count() const { return mounts.size(); }
+    int find(const std::string &name) const;
+    int findLabel(const std::string &label) const;
+    // Splits "<name>:/a/b" into a mount id and the path inside it ("/a/b"); -1 if no mount matches.
+    int resolve(const std::string &path, std::string *inner) const;
+    const std::string &name(int id) const { return mounts[id].name; }
+    const std::string &label(int id) const { return mounts[id].label; }
+    u64 base(int id) const { return mounts[id].base; }
+    std::string root(int id) const { return mounts[id].name + ":/"; }
+    bool isLoaded(int id) const { return mounts[id].index != NULL; }
+
+    // Returns the metadata of a mount, parsing it again if it was evicted. The tables stay valid
+    // until the matching release().
+    const RomFS *acquire(int id);
+    void release(int id);
+    // Name index of an acquired mount, built the first time it is asked for.
+    const SearchIndex *searchIndex(int id);
+
+    // Block cache counters of one mount, or of all of them with id -1.
+    cache_stats cacheStats(int id = -1);
+    void resetCacheStats();
+
+    void setBudget(size_t bytes);
+    void setCacheDir(const std::string &dir) { cacheDir = dir; }
+    size_t memoryUsage() const;
+
+private:
+    void evict(size_t budget);
+    void unload(mount_entry *ent);
+    RomFS *parse(mount_entry *ent);
+
+    std::vector<mount_entry> mounts;
+    size_t budget;
+    u32 clock;
+    std::string cacheDir;
+};
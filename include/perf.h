@@ -0,0 +1,63 @@
+#pragma once
+
+#include "types.h"
+
+// Scoped timers and counters for the hot paths, read from the system tick counter. Everything
+// here compiles to nothing unless PERF is defined (make PERF=1).
+
+enum {
+    PERF_LIST,      // getFileList: directory scans and index listings
+    PERF_SORT,      // FileList sorting
+    PERF_READ,      // file reads in copies
+    PERF_WRITE,     // file writes in copies, dumps and extractions
+    PERF_IMAGE,     // romfs image reads
+    PERF_CACHE,     // block cache reads (hits and misses) in front of the image
+    PERF_RENDER,    // screen model flushes
+    PERF_VBLANK,    // waiting for vblank
+    PERF_COUNTERS
+};
+
+#ifdef PERF
+
+typedef struct {
+    const char *name;
+    u64 calls;
+    u64 ticks;
+    u64 maxTicks;
+    u64 bytes;
+} perf_counter;
+
+u64 perfTicks();
+double perfMs(u64 ticks);
+void perfAdd(int id, u64 start, u64 bytes);
+perf_counter perfGet(int id);
+void perfReset();
+
+// Session trace: one CSV line per timed call. Lines are buffered in memory; perfTraceFlush()
+// writes them out once enough have piled up and should be called from the UI thread.
+bool perfTraceOpen(const char *path);
+void perfTraceFlush();
+void perfTraceClose();
+
+class PerfScope {
+public:
+    PerfScope(int id, u64 bytes = 0) : id(id), bytes(bytes), start(perfTicks()) {}
+    ~PerfScope() { perfAdd(id, start, bytes); }
+    void setBytes(u64 count) { bytes = count; }
+private:
+    int id;
+    u64 bytes;
+    u64 start;
+};
+
+#define PERF_CONCAT2(a, b) a##b
+#define PERF_CONCAT(a, b) PERF_CONCAT2(a, b)
+#define PERF_SCOPE(id) PerfScope PERF_CONCAT(perfScope, __LINE__)(id)
+#define PERF_SCOPE_BYTES(id, bytes) PerfScope PERF_CONCAT(perfScope, __LINE__)(id, bytes)
+
+#else
+
+#define PERF_SCOPE(id) do {} while (0)
+#define PERF_SCOPE_BYTES(id, bytes) do {} while (0)
+
+#endif
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "types.h"
+#include "image.h"
+
+enum {
+    PREVIEW_HEX,
+    PREVIEW_TEXT,
+    PREVIEW_SMDH,
+    PREVIEW_MODES
+};
+
+// Pages through a file straight from its image: every render() reads only the bytes that fit
+// the window at the current position into a small reused buffer (or looks at them in place
+// if the image is mapped), so the size of the file doesn't matter. The mode is guessed from the first bytes and can be switched.
+class Preview {
+public:
+    Preview();
+    void open(ImageSource *image, u64 offset, u64 size);
+    void close();
+    bool isOpen() const { return image != NULL; }
+
+    int getMode() const { return mode; }
+    bool setMode(int mode);     // false if the file can't be shown that way (SMDH)
+    void nextMode(int step);
+    static const char *modeName(int mode);
+    const char *encoding() const { return utf16 ? "UTF-16" : "UTF-8"; }
+
+    // Fills lines with at most rows strings of at most cols characters.
+    bool render(u32 rows, u32 cols, std::vector<std::string> *lines);
+    void pageDown();
+    void pageUp();
+    void home();
+    void end();
+    u64 getPosition() const { return position; }
+    u64 getSize() const { return size; }
+
+    // 48x48 RGB565 icon, row-major, when the file is an SMDH.
+    bool readIcon(u16 *pixels);
+
+private:
+    bool read(u64 from, u32 len);
+    bool isSmdh();
+    void detect();
+    void renderHex(u32 rows, u32 cols, std::vector<std::string> *lines);
+    void renderText(u32 rows, u32 cols, std::vector<std::string> *lines);
+    void renderSmdh(u32 cols, std::vector<std::string> *lines);
+
+    ImageSource *image;
+    u64 offset;
+    u64 size;
+    int mode;
+    bool utf16;
+    u64 position;
+    u64 windowEnd;              // first byte after the last rendered window
+    u32 page;                   // bytes in the last rendered window
+    u32 rowBytes;               // hex bytes per row
+    std::vector<u64> history;   // text positions paged down from, for paging back up
+    std::vector<u8> window;
+    const u8 *view;             // the bytes read last: in window, or in the mapped image
+};
+
+// Big SMDH icon pixels come in 8x8 tiles with Morton order inside each tile; this unswizzles
+// them into row-major order.
+void smdhUntileIcon(const u16 *tiled, u16 *pixels);
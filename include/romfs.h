@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "types.h"
+#include "image.h"
+
+#define ROMFS_NONE 0xFFFFFFFF
+
+// IVFC level 3 header, as found at the start of the romfs data.
+typedef struct {
+    u32 headerSize;
+    u32 dirHashOff;
+    u32 dirHashSize;
+    u32 dirMetaOff;
+    u32 dirMetaSize;
+    u32 fileHashOff;
+    u32 fileHashSize;
+    u32 fileMetaOff;
+    u32 fileMetaSize;
+    u32 fileDataOff;
+} romfs_header;
+
+// One directory or file of the index. Children of a directory are stored contiguously
+// (subdirectories first, then files), so listing a directory is a linear walk.
+typedef struct {
+    u64 offset;     // absolute offset of the file data in the image (0 for directories)
+    u64 size;       // file size in bytes (0 for directories)
+    u32 parent;
+    u32 sibling;    // next entry in the same directory, or ROMFS_NONE
+    u32 child;      // first child, or ROMFS_NONE
+    u32 name;       // offset of the NUL terminated UTF-8 name in the name pool
+    u32 nextHash;   // next entry in the same hash bucket, or ROMFS_NONE
+    u16 nameLen;
+    bool isDir;
+} romfs_entry;
+
+class RomFS {
+public:
+    RomFS();
+
+    // Parse the level 3 header and metadata tables found at base in the image.
+    bool open(ImageSource *image, u64 base);
+    // Index files: a header carrying the caller's key, then the entry, name and bucket arrays
+    // exactly as they are in memory, so loading is one read. load() fails (and the file should be
+    // rewritten) if the key, the layout or the image's level 3 header don't match.
+    bool save(const std::string &path, const void *key, u32 keySize) const;
+    bool load(ImageSource *image, u64 base, const std::string &path, const void *key, u32 keySize);
+    void close();
+    bool isOpen() const { return image != NULL; }
+
+    ImageSource *source() const { return image; }
+    const romfs_header &getHeader() const { return header; }
+    u64 getBase() const { return base; }
+
+    u32 root() const { return 0; }
+    u32 count() const { return entries.size(); }
+    const romfs_entry &entry(u32 index) const { return entries[index]; }
+    const char *name(u32 index) const { return &names[entries[index].name]; }
+    std::string path(u32 index) const;
+
+    // Resolve a '/' separated path relative to the romfs root; returns ROMFS_NONE if not found.
+    // Each component is a single hash bucket lookup, independent of the directory's size.
+    u32 find(const std::string &path) const;
+    u32 findChild(u32 dir, const char *name, u32 len) const;
+    bool list(u32 dir, std::vector<u32> *dest) const;
+    size_t memoryUsage() const { return entries.capacity() * sizeof(romfs_entry) + names.capacity() + buckets.capacity() * sizeof(u32); }
+
+private:
+    ImageSource *image;
+    u64 base;
+    romfs_header header;
+    std::vector<romfs_entry> entries;
+    std::vector<char> names;
+    std::vector<u32> buckets;   // first entry of every hash bucket
+};
+
+std::string utf16to8(const u16 *src, u32 len);
+std::vector<u16> utf8to16(const std::string &src);
+// Hash table size for a number of entries, as used by the metadata tables.
+u32 bucketCount(u32 entries);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "types.h"
+
+// Text model of one console screen. Drawing only updates the model; flush() compares it with
+// what was written last time and emits cursor moves and text for the changed cells only.
+class TextScreen {
+public:
+    TextScreen(u32 rows, u32 cols);
+
+    u32 rows() const { return height; }
+    u32 cols() const { return width; }
+
+    // Blanks the model; nothing is written until flush().
+    void clear();
+    void clearRow(u32 row);
+    // Writes text at (row, col), cut at the screen edge; with width set, pads or cuts to exactly
+    // width cells. color is an ANSI foreground code (30-37) or 0 for the default.
+    void print(u32 row, u32 col, const std::string &text, u8 color = 0, u32 width = 0);
+    void printf(u32 row, u32 col, const char *format, ...) __attribute__((format(printf, 4, 5)));
+    // Prints '\n' separated lines from column 0 of row on; returns the row after the last one.
+    u32 printLines(u32 row, const std::string &text);
+    // The console was written behind the model's back (e.g. by a prompt): rewrite every cell.
+    void invalidate();
+
+    // Returns true if anything was written.
+    bool flush(FILE *out);
+
+private:
+    u32 height;
+    u32 width;
+    std::vector<char> cells;
+    std::vector<u8> colors;
+    std::vector<char> shown;
+    std::vector<u8> shownColors;
+    bool dirty;
+    std::string buffer;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "types.h"
+#include "romfs.h"
+
+typedef struct {
+    std::string pattern;    // case insensitive; a glob if it contains '*' or '?', else a substring
+    std::string extension;  // without the dot; empty matches anything
+    u64 minSize;
+    u64 maxSize;
+    bool filesOnly;
+} search_query;
+
+// Parses "name *.bcstm .bclim ext:bin >10k <2m"-style input: ".ext"/"ext:x" set the extension,
+// ">N"/"<N" (with optional k/m suffix) the size range, anything else is the name pattern.
+bool parseQuery(const std::string &text, search_query *query);
+
+// Lower-cased copy of every name in a romfs, packed into one NUL separated buffer in index order,
+// so a substring query is a single memmem() sweep over the whole image's names.
+class SearchIndex {
+public:
+    SearchIndex();
+    void build(const RomFS *romfs);
+    void clear();
+
+    // Scans the names of at most budget entries starting at *position, appending matching entry
+    // indices to results and advancing *position. Returns true once the whole index was scanned.
+    bool search(const search_query &query, u32 *position, u32 budget, std::vector<u32> *results) const;
+    u32 count() const { return starts.empty() ? 0 : starts.size() - 1; }
+    size_t memoryUsage() const { return pool.capacity() + starts.capacity() * sizeof(u32); }
+
+private:
+    bool filter(const search_query &query, u32 index) const;
+
+    const RomFS *romfs;
+    std::vector<char> pool;
+    std::vector<u32> starts;   // offset of every entry's name in pool, plus the end of the pool
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include "types.h"
+
+#define SHA256_HASH_SIZE 0x20
+#define SHA256_BLOCK_SIZE 0x40
+
+// Streaming SHA-256. The context is plain data, so it can be saved and restored to resume hashing.
+typedef struct {
+    u32 state[8];
+    u64 length;
+    u8 buffer[SHA256_BLOCK_SIZE];
+} sha256_ctx;
+
+void sha256Init(sha256_ctx *ctx);
+void sha256Update(sha256_ctx *ctx, const void *data, size_t size);
+void sha256Final(sha256_ctx *ctx, u8 *hash);
+void sha256(const void *data, size_t size, u8 *hash);
+
+// Name of the block function picked for this CPU ("generic", or a hardware accelerated one).
+const char *sha256Backend();
+
+std::string hashToString(const u8 *hash, size_t size);
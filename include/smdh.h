@@ -0,0 +1,51 @@
+#pragma once
+
+#include "types.h"
+
+// Title metadata and icons, as found in a title's exefs "icon" and in icon.bin/*.smdh files.
+
+#define SMDH_MAGIC 0x48444D53 // "SMDH"
+#define SMDH_ICON_SIZE 48
+
+enum {
+    SMDH_REGION_JAPAN = 0x01,
+    SMDH_REGION_AMERICA = 0x02,
+    SMDH_REGION_EUROPE = 0x04,
+    SMDH_REGION_AUSTRALIA = 0x08,
+    SMDH_REGION_CHINA = 0x10,
+    SMDH_REGION_KOREA = 0x20,
+    SMDH_REGION_TAIWAN = 0x40,
+    SMDH_REGION_FREE = 0x7FFFFFFF
+};
+
+typedef struct {
+	u32 magic;
+	u16 version;
+	u16 reserved;
+} smdhHeader_s;
+
+typedef struct {
+	u16 shortDescription[0x40];
+	u16 longDescription[0x80];
+	u16 publisher[0x40];
+} smdhTitle_s;
+
+typedef struct {
+	u8 gameRatings[0x10];
+	u32 regionLock;
+	u8 matchMakerId[0xC];
+	u32 flags;
+	u16 eulaVersion;
+	u16 reserved;
+	u32 defaultFrame;
+	u32 cecId;
+} smdhSettings_s;
+
+typedef struct {
+	smdhHeader_s header;
+	smdhTitle_s titles[16];
+	smdhSettings_s settings;
+	u8 reserved[0x8];
+	u16 smallIconData[0x240];
+	u16 bigIconData[0x900];
+} smdh_s;
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "types.h"
+
+#ifdef _3DS
+#include <3ds.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+// Thin wrappers so worker code builds against libctru threads on the 3DS and std::thread on the host.
+
+class Mutex {
+public:
+#ifdef _3DS
+    Mutex() { LightLock_Init(&handle); }
+    void lock() { LightLock_Lock(&handle); }
+    void unlock() { LightLock_Unlock(&handle); }
+#else
+    void lock() { handle.lock(); }
+    void unlock() { handle.unlock(); }
+#endif
+private:
+    friend class Condition;
+#ifdef _3DS
+    LightLock handle;
+#else
+    std::mutex handle;
+#endif
+};
+
+class ScopedLock {
+public:
+    ScopedLock(Mutex &mutex) : mutex(mutex) { mutex.lock(); }
+    ~ScopedLock() { mutex.unlock(); }
+private:
+    Mutex &mutex;
+};
+
+class Condition {
+public:
+#ifdef _3DS
+    Condition() { CondVar_Init(&handle); }
+    void wait(Mutex &mutex) { CondVar_Wait(&handle, &mutex.handle); }
+    void signal() { CondVar_Signal(&handle); }
+    void broadcast() { CondVar_Broadcast(&handle); }
+#else
+    void wait(Mutex &mutex) {
+        std::unique_lock<std::mutex> lock(mutex.handle, std::adopt_lock);
+        handle.wait(lock);
+        lock.release();
+    }
+    void signal() { handle.notify_one(); }
+    void broadcast() { handle.notify_all(); }
+#endif
+private:
+#ifdef _3DS
+    CondVar handle;
+#else
+    std::condition_variable handle;
+#endif
+};
+
+inline void sleepMs(u32 ms) {
+#ifdef _3DS
+    svcSleepThread((s64)ms * 1000000);
+#else
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+#endif
+}
+
+// Priority is relative to the calling thread: positive values run behind it. Ignored on the host.
+class Worker {
+public:
+    Worker() : running(false) {}
+    ~Worker() { join(); }
+    bool start(void (*func)(void*), void *arg, int priority = 1) {
+        join();
+#ifdef _3DS
+        s32 prio = 0x30;
+        svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+        prio += priority;
+        if (prio < 0x18) prio = 0x18;
+        if (prio > 0x3F) prio = 0x3F;
+        handle = threadCreate(func, arg, 0x8000, prio, -2, false);
+        running = (handle != NULL);
+#else
+        (void)priority;
+        handle = std::thread(func, arg);
+        running = true;
+#endif
+        return running;
+    }
+    void join() {
+        if (!running) return;
+#ifdef _3DS
+        threadJoin(handle, U64_MAX);
+        threadFree(handle);
+#else
+        handle.join();
+#endif
+        running = false;
+    }
+private:
+    bool running;
+#ifdef _3DS
+    Thread handle;
+#else
+    std::thread handle;
+#endif
+};
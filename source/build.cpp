@@ -0,0 +1,405 @@
+#include <dirent.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "build.h"
+#include "ivfc.h"
+#include "romfs.h"
+#include "sha256.h"
+
+#define DIR_META_SIZE 0x18
+#define FILE_META_SIZE 0x20
+
+static inline u64 alignUp(u64 value, u64 align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static inline void put32(u8 *p, u32 value) {
+    for (int i = 0; i < 4; i++) p[i] = value >> (i * 8);
+}
+
+static inline void put64(u8 *p, u64 value) {
+    put32(p, value);
+    put32(p + 4, value >> 32);
+}
+
+// Same hash as the metadata tables use: over the parent's metadata offset and the UTF-16 name.
+static u32 hashEntry(u32 parent, const std::vector<u16> &name) {
+    u32 hash = parent ^ 123456789;
+    for (size_t i = 0; i < name.size(); i++) {
+        hash = (hash >> 5) | (hash << 27);
+        hash ^= name[i];
+    }
+    return hash;
+}
+
+// Hashes every blockSize block of data, the last one padded with zeroes.
+static std::vector<u8> hashLevel(const std::vector<u8> &data, u32 blockSize) {
+    u64 blocks = (data.size() + blockSize - 1) / blockSize;
+    std::vector<u8> hashes(blocks * SHA256_HASH_SIZE);
+    std::vector<u8> block(blockSize);
+    for (u64 i = 0; i < blocks; i++) {
+        u64 len = std::min((u64)blockSize, data.size() - i * blockSize);
+        memcpy(block.data(), &data[i * blockSize], len);
+        memset(block.data() + len, 0, blockSize - len);
+        sha256(block.data(), blockSize, &hashes[i * SHA256_HASH_SIZE]);
+    }
+    return hashes;
+}
+
+const build_options &defaultBuildOptions() {
+    static const build_options options = {true, 2, 0, ""};
+    return options;
+}
+
+RomFSBuilder::RomFSBuilder() : output(NULL), levelOffset(0), levelSize(0), blockSize(1 << BUILD_BLOCK_LOG), dataOffset(0),
+    hasherCount(0), jobData(NULL), jobFirst(0), jobCount(0), jobNext(0), jobActive(0), stopping(false),
+    status(COPY_IDLE), cancelled(false), engine(NULL) {
+    reader.owner = this;
+    reader.file = NULL;
+    writer.owner = this;
+}
+
+RomFSBuilder::~RomFSBuilder() {
+    cancel();
+    wait();
+}
+
+// Breadth-first, so the subdirectories and the files of every directory end up contiguous.
+// Entries are sorted by name to make the output reproducible.
+bool RomFSBuilder::scan(const std::string &source) {
+    dirs.clear();
+    files.clear();
+    build_entry top = {source, std::vector<u16>(), 0, ROMFS_NONE, ROMFS_NONE, ROMFS_NONE, 0, ROMFS_NONE, 0, 0};
+    dirs.push_back(top);
+    for (u32 d = 0; d < dirs.size(); d++) {
+        std::string dirPath = dirs[d].path + "/";
+        DIR *dir = opendir(dirPath.c_str());
+        if (!dir) return false;
+        std::vector<std::string> subdirs;
+        std::vector<std::pair<std::string, u64> > children;
+        dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+            struct stat st;
+            bool isDir = (ent->d_type == DT_DIR);
+            u64 size = 0;
+            if (ent->d_type == DT_UNKNOWN || !isDir) {
+                if (stat((dirPath + ent->d_name).c_str(), &st) != 0) { closedir(dir); return false; }
+                isDir = S_ISDIR(st.st_mode);
+                size = st.st_size;
+            }
+            if (isDir) subdirs.push_back(ent->d_name);
+            else children.push_back(std::make_pair(std::string(ent->d_name), size));
+        }
+        closedir(dir);
+        std::sort(subdirs.begin(), subdirs.end());
+        std::sort(children.begin(), children.end());
+        for (size_t i = 0; i < subdirs.size(); i++) {
+            build_entry entry = {dirPath + subdirs[i], utf8to16(subdirs[i]), d, ROMFS_NONE, ROMFS_NONE, ROMFS_NONE, 0, ROMFS_NONE, 0, 0};
+            if (i == 0) dirs[d].dirs = dirs.size();
+            else dirs.back().sibling = dirs.size();
+            dirs.push_back(entry);
+        }
+        for (size_t i = 0; i < children.size(); i++) {
+            build_entry entry = {dirPath + children[i].first, utf8to16(children[i].first), d, ROMFS_NONE, ROMFS_NONE, ROMFS_NONE, 0, ROMFS_NONE, 0, children[i].second};
+            if (i == 0) dirs[d].files = files.size();
+            else files.back().sibling = files.size();
+            files.push_back(entry);
+        }
+    }
+    return true;
+}
+
+// Level 3: header, directory hash table and metadata, file hash table and metadata, then the
+// file data, each file aligned to BUILD_DATA_ALIGN. With IVFC, level 3 starts on the first block
+// boundary after the IVFC header and master hash. That is 0x1000 while the master hash fits next
+// to the header: 125 hashes, each covering 128 * 128 level 3 blocks, or about 7.8 GiB.
+void RomFSBuilder::layout() {
+    u32 offset = 0;
+    for (size_t i = 0; i < dirs.size(); i++) {
+        dirs[i].metaOffset = offset;
+        offset += DIR_META_SIZE + alignUp(dirs[i].name.size() * 2, 4);
+    }
+    offset = 0;
+    u64 data = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        files[i].metaOffset = offset;
+        offset += FILE_META_SIZE + alignUp(files[i].name.size() * 2, 4);
+        data = alignUp(data, BUILD_DATA_ALIGN);
+        files[i].dataOffset = data;
+        data += files[i].size;
+    }
+    u32 dirBuckets = bucketCount(dirs.size());
+    u32 fileBuckets = bucketCount(files.size());
+    u32 dirMetaSize = dirs.back().metaOffset + DIR_META_SIZE + alignUp(dirs.back().name.size() * 2, 4);
+    u32 fileMetaSize = offset;
+    romfs_header header;
+    header.headerSize = sizeof(romfs_header);
+    header.dirHashOff = sizeof(romfs_header);
+    header.dirHashSize = dirBuckets * 4;
+    header.dirMetaOff = header.dirHashOff + header.dirHashSize;
+    header.dirMetaSize = dirMetaSize;
+    header.fileHashOff = header.dirMetaOff + dirMetaSize;
+    header.fileHashSize = fileBuckets * 4;
+    header.fileMetaOff = header.fileHashOff + header.fileHashSize;
+    header.fileMetaSize = fileMetaSize;
+    header.fileDataOff = alignUp(header.fileMetaOff + fileMetaSize, BUILD_DATA_ALIGN);
+    dataOffset = header.fileDataOff;
+    levelSize = dataOffset + data;
+
+    metadata.assign(dataOffset, 0);
+    const u32 *fields = (const u32*)&header;
+    for (u32 i = 0; i < sizeof(romfs_header) / 4; i++) put32(&metadata[i * 4], fields[i]);
+    std::vector<u32> dirHeads(dirBuckets, ROMFS_NONE), fileHeads(fileBuckets, ROMFS_NONE);
+    for (size_t i = 0; i < dirs.size(); i++) {
+        u32 &head = dirHeads[hashEntry(dirs[dirs[i].parent].metaOffset, dirs[i].name) % dirBuckets];
+        dirs[i].nextHash = head;
+        head = dirs[i].metaOffset;
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+        u32 &head = fileHeads[hashEntry(dirs[files[i].parent].metaOffset, files[i].name) % fileBuckets];
+        files[i].nextHash = head;
+        head = files[i].metaOffset;
+    }
+    for (u32 i = 0; i < dirBuckets; i++) put32(&metadata[header.dirHashOff + i * 4], dirHeads[i]);
+    for (u32 i = 0; i < fileBuckets; i++) put32(&metadata[header.fileHashOff + i * 4], fileHeads[i]);
+    for (size_t i = 0; i < dirs.size(); i++) {
+        const build_entry &dir = dirs[i];
+        u8 *p = &metadata[header.dirMetaOff + dir.metaOffset];
+        put32(p, dirs[dir.parent].metaOffset);
+        put32(p + 0x4, (dir.sibling != ROMFS_NONE) ? dirs[dir.sibling].metaOffset : ROMFS_NONE);
+        put32(p + 0x8, (dir.dirs != ROMFS_NONE) ? dirs[dir.dirs].metaOffset : ROMFS_NONE);
+        put32(p + 0xC, (dir.files != ROMFS_NONE) ? files[dir.files].metaOffset : ROMFS_NONE);
+        put32(p + 0x10, dir.nextHash);
+        put32(p + 0x14, dir.name.size() * 2);
+        for (size_t c = 0; c < dir.name.size(); c++) { p[DIR_META_SIZE + c * 2] = dir.name[c]; p[DIR_META_SIZE + c * 2 + 1] = dir.name[c] >> 8; }
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+        const build_entry &file = files[i];
+        u8 *p = &metadata[header.fileMetaOff + file.metaOffset];
+        put32(p, dirs[file.parent].metaOffset);
+        put32(p + 0x4, (file.sibling != ROMFS_NONE) ? files[file.sibling].metaOffset : ROMFS_NONE);
+        put64(p + 0x8, file.dataOffset);
+        put64(p + 0x10, file.size);
+        put32(p + 0x18, file.nextHash);
+        put32(p + 0x1C, file.name.size() * 2);
+        for (size_t c = 0; c < file.name.size(); c++) { p[FILE_META_SIZE + c * 2] = file.name[c]; p[FILE_META_SIZE + c * 2 + 1] = file.name[c] >> 8; }
+    }
+
+    levelOffset = 0;
+    level2.clear();
+    if (options.ivfc) {
+        u64 blocks = (levelSize + blockSize - 1) / blockSize;
+        u64 level1Size = (blocks * SHA256_HASH_SIZE + blockSize - 1) / blockSize * SHA256_HASH_SIZE;
+        u64 masterSize = (level1Size + blockSize - 1) / blockSize * SHA256_HASH_SIZE;
+        levelOffset = alignUp(IVFC_HEADER_SIZE + masterSize, blockSize);
+        level2.resize(blocks * SHA256_HASH_SIZE);
+    }
+}
+
+bool RomFSBuilder::start(const std::string &source, const std::string &dest, const build_options &opts) {
+    if (isRunning()) return false;
+    close();
+    options = opts;
+    path = dest;
+    cancelled = false;
+    std::string root = source;
+    while (root.size() > 1 && root[root.size() - 1] == '/') root.erase(root.size() - 1);
+    if (!scan(root)) return false;
+    layout();
+    output = fopen(path.c_str(), "wb");
+    if (!output) return false;
+    std::vector<u8> header(levelOffset, 0);
+    if (levelOffset && fwrite(header.data(), 1, header.size(), output) != header.size()) { close(); remove(path.c_str()); return false; }
+    reader.position = 0;
+    reader.next = 0;
+    writer.blocks = 0;
+    writer.carried = 0;
+    writer.carry.assign(options.ivfc ? blockSize : 0, 0);
+    engine = new CopyEngine(options.chunkSize, 4);
+    engine->setRoute(options.route, levelSize);
+    status = COPY_RUNNING;
+    if (!driver.start(run, this)) { status = COPY_IDLE; close(); remove(path.c_str()); return false; }
+    return true;
+}
+
+void RomFSBuilder::run(void *arg) {
+    RomFSBuilder *self = (RomFSBuilder*)arg;
+    self->stopping = false;
+    self->jobCount = self->jobNext = self->jobActive = 0;
+    self->hasherCount = self->options.ivfc ? std::min(std::max(self->options.threads, 1u), (u32)BUILD_MAX_THREADS) - 1 : 0;
+    for (u32 i = 0; i < self->hasherCount; i++) self->hashers[i].start(hashThread, self);
+    int result = self->engine->start(&self->reader, &self->writer) ? self->engine->wait() : COPY_READ_ERROR;
+    {
+        ScopedLock lock(self->mutex);
+        self->stopping = true;
+    }
+    self->changed.broadcast();
+    for (u32 i = 0; i < self->hasherCount; i++) self->hashers[i].join();
+    if (self->reader.file) fclose(self->reader.file);
+    self->reader.file = NULL;
+    if (result == COPY_DONE && self->cancelled) result = COPY_CANCELLED;
+    if (result == COPY_DONE && self->reader.position != self->levelSize) result = COPY_READ_ERROR;
+    if (result == COPY_DONE && !self->finish()) result = COPY_WRITE_ERROR;
+    if (fclose(self->output) != 0 && result == COPY_DONE) result = COPY_WRITE_ERROR;
+    self->output = NULL;
+    if (result != COPY_DONE) remove(self->path.c_str());
+    self->status = result;
+}
+
+// Levels 1 and 2 go after level 3, each on a block boundary; the header and master hash fill
+// the space left in front of level 3.
+bool RomFSBuilder::finish() {
+    if (!options.ivfc) return true;
+    if (writer.carried) {
+        memset(writer.carry.data() + writer.carried, 0, blockSize - writer.carried);
+        sha256(writer.carry.data(), blockSize, &level2[writer.blocks++ * SHA256_HASH_SIZE]);
+    }
+    if (writer.blocks * SHA256_HASH_SIZE != level2.size()) return false;
+    std::vector<u8> level1 = hashLevel(level2, blockSize);
+    std::vector<u8> master = hashLevel(level1, blockSize);
+    u64 level1Offset = alignUp(levelOffset + levelSize, blockSize);
+    u64 level2Offset = alignUp(level1Offset + level1.size(), blockSize);
+    std::vector<u8> zero(blockSize, 0);
+    u64 pad1 = level1Offset - levelOffset - levelSize, pad2 = level2Offset - level1Offset - level1.size();
+    if (fwrite(zero.data(), 1, pad1, output) != pad1 || fwrite(level1.data(), 1, level1.size(), output) != level1.size()) return false;
+    if (fwrite(zero.data(), 1, pad2, output) != pad2 || fwrite(level2.data(), 1, level2.size(), output) != level2.size()) return false;
+
+    ivfc_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = IVFC_MAGIC;
+    header.id = IVFC_ROMFS_ID;
+    header.masterHashSize = master.size();
+    u64 logical = 0;
+    u64 sizes[IVFC_LEVELS] = {level1.size(), level2.size(), levelSize};
+    for (u32 i = 0; i < IVFC_LEVELS; i++) {
+        header.levels[i].logicalOffset = logical;
+        header.levels[i].hashDataSize = sizes[i];
+        header.levels[i].blockSize = BUILD_BLOCK_LOG;
+        logical = alignUp(logical + sizes[i], blockSize);
+    }
+    header.optionalInfoSize = sizeof(ivfc_header);
+    return fseek(output, 0, SEEK_SET) == 0 && fwrite(&header, 1, sizeof(header), output) == sizeof(header) &&
+        fwrite(zero.data(), 1, IVFC_HEADER_SIZE - sizeof(header), output) == IVFC_HEADER_SIZE - sizeof(header) &&
+        fwrite(master.data(), 1, master.size(), output) == master.size();
+}
+
+void RomFSBuilder::cancel() {
+    cancelled = true;
+    if (engine) engine->cancel();
+}
+
+int RomFSBuilder::wait() {
+    driver.join();
+    int result = status;
+    close();
+    return result;
+}
+
+void RomFSBuilder::close() {
+    driver.join();
+    delete engine;
+    engine = NULL;
+    if (reader.file) fclose(reader.file);
+    reader.file = NULL;
+    if (output) fclose(output);
+    output = NULL;
+}
+
+s64 RomFSBuilder::LayoutReader::read(void *buffer, u32 size) {
+    RomFSBuilder *self = owner;
+    u8 *dst = (u8*)buffer;
+    u32 filled = 0;
+    while (filled < size) {
+        u32 len = size - filled;
+        if (position < self->metadata.size()) {
+            len = std::min((u64)len, self->metadata.size() - position);
+            memcpy(dst + filled, &self->metadata[position], len);
+        } else if (next >= self->files.size()) break;
+        else {
+            const build_entry &entry = self->files[next];
+            u64 start = self->dataOffset + entry.dataOffset;
+            if (position < start) {
+                len = std::min((u64)len, start - position);
+                memset(dst + filled, 0, len);
+            } else {
+                len = std::min((u64)len, start + entry.size - position);
+                if (len && !file && !(file = fopen(entry.path.c_str(), "rb"))) return -1;
+                if (len && fread(dst + filled, 1, len, file) != len) return -1;
+                if (position + len == start + entry.size) {
+                    if (file) fclose(file);
+                    file = NULL;
+                    next++;
+                }
+            }
+        }
+        position += len;
+        filled += len;
+    }
+    return filled;
+}
+
+// Called with the mutex held; hashes batches of the current job until all are handed out.
+void RomFSBuilder::hashBatches() {
+    while (jobNext < jobCount) {
+        u32 batch = jobNext;
+        u32 len = std::min((u32)BUILD_HASH_BATCH, jobCount - batch);
+        jobNext += len;
+        jobActive++;
+        mutex.unlock();
+        for (u32 i = batch; i < batch + len; i++) sha256(jobData + (u64)i * blockSize, blockSize, &level2[(jobFirst + i) * SHA256_HASH_SIZE]);
+        mutex.lock();
+        jobActive--;
+    }
+    changed.broadcast();
+}
+
+void RomFSBuilder::hashThread(void *arg) {
+    RomFSBuilder *self = (RomFSBuilder*)arg;
+    ScopedLock lock(self->mutex);
+    while (!self->stopping) {
+        if (self->jobNext < self->jobCount) self->hashBatches();
+        else self->changed.wait(self->mutex);
+    }
+}
+
+// Whole blocks are handed to the hashing threads while this thread writes the chunk, then it
+// helps with what's left. A block split across chunks is carried over and hashed here.
+bool RomFSBuilder::HashWriter::write(const void *buffer, u32 size) {
+    RomFSBuilder *self = owner;
+    const u8 *src = (const u8*)buffer;
+    u32 skip = 0;
+    if (self->options.ivfc && carried) {
+        skip = std::min(self->blockSize - carried, size);
+        memcpy(carry.data() + carried, src, skip);
+        carried += skip;
+        if (carried == self->blockSize) {
+            sha256(carry.data(), self->blockSize, &self->level2[blocks++ * SHA256_HASH_SIZE]);
+            carried = 0;
+        }
+    }
+    u32 count = self->options.ivfc ? (size - skip) / self->blockSize : 0;
+    if (count) {
+        ScopedLock lock(self->mutex);
+        self->jobData = src + skip;
+        self->jobFirst = blocks;
+        self->jobCount = count;
+        self->jobNext = 0;
+        self->changed.broadcast();
+    }
+    bool ok = fwrite(buffer, 1, size, self->output) == size;
+    if (count) {
+        ScopedLock lock(self->mutex);
+        self->hashBatches();
+        while (self->jobActive) self->changed.wait(self->mutex);
+        self->jobCount = self->jobNext = 0;
+        blocks += count;
+    }
+    u32 tail = self->options.ivfc ? (size - skip) % self->blockSize : 0;
+    if (tail) {
+        memcpy(carry.data(), src + size - tail, tail);
+        carried = tail;
+    }
+    return ok;
+}
@@ -0,0 +1,163 @@
+#include <string.h>
+#include "cache.h"
+#include "perf.h"
+
+CachedImage::CachedImage(ImageSource *image, bool owned, u32 capacity, u32 blockSize) :
+    image(image), owned(owned), length(image->size()), blockSize(blockSize), clock(0), lastBlock(CACHE_NONE), streak(0),
+    aheadNext(0), aheadEnd(0), aheadStarted(false), stopping(false) {
+    blockCount = (length + blockSize - 1) / blockSize;
+    u32 count = capacity / blockSize;
+    if (count < 2) count = 2;
+    data.resize((size_t)count * blockSize);
+    cache_slot empty = {CACHE_NONE, 0, false, false};
+    slots.assign(count, empty);
+    resetStats();
+}
+
+CachedImage::~CachedImage() {
+    mutex.lock();
+    stopping = true;
+    changed.broadcast();
+    mutex.unlock();
+    worker.join();
+    if (owned) delete image;
+}
+
+cache_stats CachedImage::getStats() {
+    ScopedLock lock(mutex);
+    return stats;
+}
+
+void CachedImage::resetStats() {
+    ScopedLock lock(mutex);
+    memset(&stats, 0, sizeof(stats));
+}
+
+bool CachedImage::read(u64 offset, void *buffer, u32 size) {
+    if (offset + size > length) return false;
+    if (size >= CACHE_BYPASS_SIZE) {
+        mutex.lock();
+        stats.bypassed++;
+        mutex.unlock();
+        return image->read(offset, buffer, size);
+    }
+    u8 *out = (u8*)buffer;
+    while (size > 0) {
+        u32 start = offset % blockSize;
+        u32 len = (size < blockSize - start) ? size : blockSize - start;
+        if (!readBlock(offset / blockSize, start, out, len)) return false;
+        offset += len;
+        out += len;
+        size -= len;
+    }
+    return true;
+}
+
+// Copies [start, start + len) of a block out of the cache, loading it first if needed. Falls back
+// to reading the image directly when every slot is busy loading.
+bool CachedImage::readBlock(u64 block, u32 start, u8 *out, u32 len) {
+    PERF_SCOPE_BYTES(PERF_CACHE, len);
+    mutex.lock();
+    if (block == lastBlock + 1) streak++;
+    else if (block != lastBlock) streak = 0;
+    lastBlock = block;
+    if (streak >= CACHE_SEQUENTIAL) readAhead(block + 1);
+    int slot;
+    std::unordered_map<u64, u32>::iterator it = lookup.find(block);
+    if (it != lookup.end()) {
+        slot = it->second;
+        stats.hits++;
+        if (slots[slot].prefetched) stats.prefetchHits++;
+        slots[slot].prefetched = false;
+        while (slots[slot].loading) changed.wait(mutex);
+    } else {
+        stats.misses++;
+        slot = claim(block);
+        if (slot >= 0) {
+            mutex.unlock();
+            bool ok = fill(slot);
+            mutex.lock();
+            loaded(slot, ok);
+        }
+    }
+    bool cached = slot >= 0 && slots[slot].block == block;
+    if (cached) {
+        slots[slot].lastUse = ++clock;
+        memcpy(out, &data[(size_t)slot * blockSize + start], len);
+    }
+    mutex.unlock();
+    return cached || image->read(block * blockSize + start, out, len);
+}
+
+// Takes the least recently used slot that isn't loading for block and marks it loading; -1 if
+// there is none. Called with the mutex held.
+int CachedImage::claim(u64 block) {
+    int slot = -1;
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i].loading) continue;
+        if (slots[i].block == CACHE_NONE) { slot = i; break; }
+        if (slot < 0 || slots[i].lastUse < slots[slot].lastUse) slot = i;
+    }
+    if (slot < 0) return -1;
+    if (slots[slot].block != CACHE_NONE) lookup.erase(slots[slot].block);
+    slots[slot].block = block;
+    slots[slot].lastUse = ++clock;
+    slots[slot].loading = true;
+    slots[slot].prefetched = false;
+    lookup[block] = slot;
+    return slot;
+}
+
+// Reads the slot's block from the image, without the mutex. A loading slot is never claimed
+// again, so its block and buffer can't change underneath.
+bool CachedImage::fill(int slot) {
+    u64 offset = slots[slot].block * blockSize;
+    u32 len = (length - offset < blockSize) ? length - offset : blockSize;
+    return image->read(offset, &data[(size_t)slot * blockSize], len);
+}
+
+void CachedImage::loaded(int slot, bool ok) {
+    slots[slot].loading = false;
+    if (!ok) {
+        lookup.erase(slots[slot].block);
+        slots[slot].block = CACHE_NONE;
+        slots[slot].prefetched = false;
+    }
+    changed.broadcast();
+}
+
+// Keeps the read-ahead window CACHE_READAHEAD blocks from block on, topping it up once the reader
+// is halfway through it. Called with the mutex held.
+void CachedImage::readAhead(u64 block) {
+    if (block >= blockCount) return;
+    if (block <= aheadEnd && block + CACHE_READAHEAD / 2 < aheadEnd) return;
+    if (aheadNext < block || aheadNext > block + CACHE_READAHEAD) aheadNext = block;
+    aheadEnd = (block + CACHE_READAHEAD < blockCount) ? block + CACHE_READAHEAD : blockCount;
+    if (!aheadStarted) aheadStarted = worker.start(aheadThread, this);
+    changed.broadcast();
+}
+
+void CachedImage::aheadThread(void *arg) {
+    CachedImage *self = (CachedImage*)arg;
+    self->mutex.lock();
+    while (!self->stopping) {
+        if (self->aheadNext >= self->aheadEnd) {
+            self->changed.wait(self->mutex);
+            continue;
+        }
+        u64 block = self->aheadNext++;
+        if (self->lookup.count(block)) continue;
+        int slot = self->claim(block);
+        if (slot < 0) {
+            self->aheadNext = self->aheadEnd;
+            continue;
+        }
+        self->slots[slot].prefetched = true;
+        self->mutex.unlock();
+        bool ok = self->fill(slot);
+        self->mutex.lock();
+        self->loaded(slot, ok);
+        if (ok) self->stats.prefetched++;
+    }
+    self->mutex.unlock();
+}
@@ -0,0 +1,489 @@
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include "copy.h"
+#include "perf.h"
+
+#ifndef _3DS
+#include <time.h>
+#endif
+
+s64 FileReader::read(void *buffer, u32 size) {
+    PERF_SCOPE_BYTES(PERF_READ, size);
+    size_t rsize = fread(buffer, 1, size, file);
+    if (rsize == 0 && ferror(file)) return -1;
+    return rsize;
+}
+
+bool FileWriter::write(const void *buffer, u32 size) {
+    PERF_SCOPE_BYTES(PERF_WRITE, size);
+    return fwrite(buffer, 1, size, file) == size;
+}
+
+void SpanReader::reset(ImageSource *src, const std::vector<copy_span> *list) {
+    image = src;
+    spans = list;
+    next = 0;
+    offset = 0;
+}
+
+s64 SpanReader::read(void *buffer, u32 size) {
+    u8 *out = (u8*)buffer;
+    u32 filled = 0;
+    while (filled < size && next < spans->size()) {
+        const copy_span &span = (*spans)[next];
+        u64 start = span.offset + offset;
+        u64 end = span.offset + span.size;
+        size_t last = next;
+        while (end - start <= size - filled && last + 1 < spans->size()) {
+            const copy_span &following = (*spans)[last + 1];
+            if (following.offset < end || following.offset - end > SPAN_GAP) break;
+            if (following.offset + following.size - start > size - filled) break;
+            end = following.offset + following.size;
+            last++;
+        }
+        if (last == next) {
+            u64 left = span.size - offset;
+            u32 len = (left < size - filled) ? left : size - filled;
+            if (!image->read(start, out + filled, len)) return -1;
+            filled += len;
+            offset += len;
+            if (offset == span.size) { next++; offset = 0; }
+            continue;
+        }
+        if (!image->read(start, out + filled, end - start)) return -1;
+        u32 pos = filled + (span.size - offset);
+        for (size_t i = next + 1; i <= last; i++) {
+            const copy_span &part = (*spans)[i];
+            memmove(out + pos, out + filled + (part.offset - start), part.size);
+            pos += part.size;
+        }
+        filled = pos;
+        next = last + 1;
+        offset = 0;
+    }
+    return filled;
+}
+
+s64 SpanReader::borrow(const void **data, u32 size) {
+    while (next < spans->size() && (*spans)[next].size == 0) next++;
+    if (next >= spans->size()) return 0;
+    const copy_span &span = (*spans)[next];
+    u64 left = span.size - offset;
+    u32 len = (left < size) ? left : size;
+    if (!(*data = image->map(span.offset + offset, len))) return -1;
+    offset += len;
+    if (offset == span.size) { next++; offset = 0; }
+    return len;
+}
+
+s64 ImageReader::borrow(const void **data, u32 size) {
+    if (offset >= end) return 0;
+    if (size > end - offset) size = end - offset;
+    if (!(*data = image->map(offset, size))) return -1;
+    offset += size;
+    return size;
+}
+
+s64 ImageReader::read(void *buffer, u32 size) {
+    if (offset >= end) return 0;
+    if (size > end - offset) size = end - offset;
+    if (!image->read(offset, buffer, size)) return -1;
+    offset += size;
+    return size;
+}
+
+const u32 tuneSizes[] = {0x10000, 0x20000, 0x40000, 0x80000, 0x100000};
+const u32 tuneCount = sizeof(tuneSizes) / sizeof(tuneSizes[0]);
+
+// Only ever compared with each other, so the unit doesn't matter.
+static u64 clockTicks() {
+#ifdef _3DS
+    return svcGetSystemTick();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static u32 alignUp(u64 size) {
+    return (size + COPY_ALIGN - 1) & ~(u64)(COPY_ALIGN - 1);
+}
+
+char *BufferPool::acquire(u32 size, u32 *capacity) {
+    size = alignUp(size ? size : 1);
+    {
+        ScopedLock lock(mutex);
+        size_t best = idle.size();
+        for (size_t i = 0; i < idle.size(); i++) {
+            if (idle[i].capacity >= size && (best == idle.size() || idle[i].capacity < idle[best].capacity)) best = i;
+        }
+        if (best < idle.size()) {
+            char *buffer = idle[best].buffer;
+            *capacity = idle[best].capacity;
+            idleBytes -= *capacity;
+            idle.erase(idle.begin() + best);
+            return buffer;
+        }
+    }
+    *capacity = size;
+    return (char*)memalign(COPY_ALIGN, size);
+}
+
+// Buffers beyond the limit are freed, oldest first.
+void BufferPool::release(char *buffer, u32 capacity) {
+    if (!buffer) return;
+    ScopedLock lock(mutex);
+    pool_slot slot = {buffer, capacity};
+    idle.push_back(slot);
+    idleBytes += capacity;
+    while (idleBytes > limit && !idle.empty()) {
+        idleBytes -= idle[0].capacity;
+        free(idle[0].buffer);
+        idle.erase(idle.begin());
+    }
+}
+
+void BufferPool::trim() {
+    ScopedLock lock(mutex);
+    for (size_t i = 0; i < idle.size(); i++) free(idle[i].buffer);
+    idle.clear();
+    idleBytes = 0;
+}
+
+size_t BufferPool::memoryUsage() {
+    ScopedLock lock(mutex);
+    return idleBytes;
+}
+
+BufferPool &bufferPool() {
+    static BufferPool pool;
+    return pool;
+}
+
+u32 ChunkTuner::lookup(const std::string &route) {
+    ScopedLock lock(mutex);
+    std::map<std::string, u32>::const_iterator it = sizes.find(route);
+    return (it == sizes.end()) ? 0 : it->second;
+}
+
+void ChunkTuner::store(const std::string &route, u32 chunkSize) {
+    ScopedLock lock(mutex);
+    if (sizes[route] != chunkSize) dirty = true;
+    sizes[route] = chunkSize;
+}
+
+bool ChunkTuner::load(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (!in) return false;
+    char line[128];
+    ScopedLock lock(mutex);
+    while (fgets(line, sizeof(line), in)) {
+        char route[64];
+        long value;
+        if (sscanf(line, " %63[^= ] = %li", route, &value) != 2 || value < COPY_ALIGN || value > 0x800000) continue;
+        sizes[route] = value & ~(long)(COPY_ALIGN - 1);
+    }
+    fclose(in);
+    dirty = false;
+    return true;
+}
+
+// Only writes when a calibration changed something.
+bool ChunkTuner::save(const char *path) {
+    ScopedLock lock(mutex);
+    if (!dirty) return true;
+    FILE *out = fopen(path, "w");
+    if (!out) return false;
+    for (std::map<std::string, u32>::const_iterator it = sizes.begin(); it != sizes.end(); ++it) {
+        fprintf(out, "%s = 0x%lx\n", it->first.c_str(), (unsigned long)it->second);
+    }
+    dirty = false;
+    return fclose(out) == 0;
+}
+
+ChunkTuner &chunkTuner() {
+    static ChunkTuner tuner;
+    return tuner;
+}
+
+WriteQueue::~WriteQueue() {
+    {
+        ScopedLock lock(mutex);
+        stopping = true;
+        changed.broadcast();
+    }
+    for (u32 i = 0; i < WRITE_QUEUE_THREADS; i++) workers[i].join();
+}
+
+bool WriteQueue::push(const std::string &path, const void *data, u32 size) {
+    if (!started) {
+        started = true;
+        for (u32 i = 0; i < WRITE_QUEUE_THREADS; i++) workers[i].start(workThread, this);
+    }
+    ScopedLock lock(mutex);
+    while (queued > 0 && queued + size > WRITE_QUEUE_LIMIT && !failed) changed.wait(mutex);
+    if (failed) return false;
+    jobs.push_back(write_job());
+    jobs.back().path = path;
+    jobs.back().data.assign((const u8*)data, (const u8*)data + size);
+    queued += size;
+    changed.broadcast();
+    return true;
+}
+
+bool WriteQueue::flush() {
+    ScopedLock lock(mutex);
+    while (!jobs.empty() || active > 0) changed.wait(mutex);
+    bool ok = !failed;
+    failed = false;
+    return ok;
+}
+
+void WriteQueue::workThread(void *arg) {
+    WriteQueue *self = (WriteQueue*)arg;
+    while (true) {
+        self->mutex.lock();
+        while (self->jobs.empty() && !self->stopping) self->changed.wait(self->mutex);
+        if (self->jobs.empty()) { self->mutex.unlock(); break; }
+        write_job job;
+        job.path.swap(self->jobs.front().path);
+        job.data.swap(self->jobs.front().data);
+        self->jobs.pop_front();
+        self->active++;
+        self->mutex.unlock();
+
+        PERF_SCOPE_BYTES(PERF_WRITE, job.data.size());
+        FILE *file = fopen(job.path.c_str(), "wb");
+        bool ok = file && fwrite(job.data.data(), 1, job.data.size(), file) == job.data.size();
+        ok = (file && fclose(file) == 0) && ok;
+        if (ok) self->written++;
+        else self->failed = true;
+
+        ScopedLock lock(self->mutex);
+        self->active--;
+        self->queued -= job.data.size();
+        self->changed.broadcast();
+    }
+}
+
+CopyEngine::CopyEngine(u32 bufferSize, u32 depth) : bufferSize(bufferSize), depth(depth < 2 ? 2 : depth), streamSize(0),
+    chunkSize(0), calibrating(false), reads(0), filled(0), readSlot(0), writeSlot(0), eof(false), reader(NULL), writer(NULL),
+    status(COPY_IDLE), progress(0), cancelled(false), paused(false) {}
+
+CopyEngine::~CopyEngine() {
+    cancel();
+    wait();
+}
+
+void CopyEngine::setRoute(const std::string &name, u64 size) {
+    route = name;
+    streamSize = size;
+}
+
+bool CopyEngine::allocate(u32 chunk) {
+    for (u32 i = 0; i < depth; i++) {
+        u32 capacity = 0;
+        char *buffer = bufferPool().acquire(chunk, &capacity);
+        if (!buffer) break;
+        buffers.push_back(buffer);
+        capacities.push_back(capacity);
+    }
+    lengths.resize(buffers.size());
+    phases.resize(buffers.size());
+    return buffers.size() >= 2;
+}
+
+void CopyEngine::releaseBuffers() {
+    for (size_t i = 0; i < buffers.size(); i++) bufferPool().release(buffers[i], capacities[i]);
+    buffers.clear();
+    capacities.clear();
+}
+
+// Small streams go through one pooled buffer on the calling thread; spinning up the ring and
+// two threads costs more than the copy itself.
+int CopyEngine::copySmall() {
+    u32 capacity = 0;
+    char *buffer = bufferPool().acquire(streamSize + 1, &capacity);
+    if (!buffer) return COPY_READ_ERROR;
+    int result = COPY_DONE;
+    while (holdWhilePaused()) {
+        s64 rsize = reader->read(buffer, capacity);
+        if (rsize < 0) { result = COPY_READ_ERROR; break; }
+        if (rsize == 0) break;
+        if (!writer->write(buffer, rsize)) { result = COPY_WRITE_ERROR; break; }
+        progress += rsize;
+    }
+    bufferPool().release(buffer, capacity);
+    return cancelled ? COPY_CANCELLED : result;
+}
+
+int CopyEngine::copyMapped() {
+    u32 chunk = bufferSize ? bufferSize : COPY_DEFAULT_CHUNK;
+    while (holdWhilePaused()) {
+        const void *data = NULL;
+        s64 rsize = reader->borrow(&data, chunk);
+        if (rsize < 0) return COPY_READ_ERROR;
+        if (rsize == 0) return COPY_DONE;
+        if (!writer->write(data, rsize)) return COPY_WRITE_ERROR;
+        progress += rsize;
+    }
+    return COPY_CANCELLED;
+}
+
+void CopyEngine::mappedThread(void *arg) {
+    CopyEngine *self = (CopyEngine*)arg;
+    self->finish(self->copyMapped());
+}
+
+bool CopyEngine::start(Reader *src, Writer *dst) {
+    if (isRunning()) return false;
+    wait();
+    reader = src;
+    writer = dst;
+    filled = readSlot = writeSlot = 0;
+    eof = false;
+    progress = 0;
+    cancelled = false;
+    calibrating = false;
+    if (reader->mapped() && streamSize > 0 && streamSize <= COPY_SMALL_FILE) {
+        status = copyMapped();
+        return true;
+    }
+    if (reader->mapped()) {
+        status = COPY_RUNNING;
+        if (!writeWorker.start(mappedThread, this)) { status = COPY_WRITE_ERROR; return false; }
+        return true;
+    }
+    if (streamSize > 0 && streamSize <= COPY_SMALL_FILE) {
+        status = copySmall();
+        return true;
+    }
+    u64 tuneBytes = 0;
+    for (u32 i = 0; i < tuneCount; i++) tuneBytes += (u64)tuneSizes[i] * COPY_TUNE_READS;
+    chunkSize = bufferSize;
+    if (!chunkSize && !route.empty()) chunkSize = chunkTuner().lookup(route);
+    calibrating = (!chunkSize && !route.empty() && streamSize >= tuneBytes);
+    if (calibrating) chunkSize = tuneSizes[tuneCount - 1];
+    if (!chunkSize) chunkSize = COPY_DEFAULT_CHUNK;
+    reads = 0;
+    readTicks.assign(tuneCount, 0);
+    writeTicks.assign(tuneCount, 0);
+    if (!allocate(chunkSize)) { releaseBuffers(); status = COPY_READ_ERROR; return false; }
+    status = COPY_RUNNING;
+    if (!readWorker.start(readThread, this)) { status = COPY_READ_ERROR; releaseBuffers(); return false; }
+    if (!writeWorker.start(writeThread, this)) { cancel(); wait(); status = COPY_WRITE_ERROR; return false; }
+    return true;
+}
+
+void CopyEngine::cancel() {
+    cancelled = true;
+    ScopedLock lock(mutex);
+    changed.broadcast();
+}
+
+void CopyEngine::pause(bool on) {
+    ScopedLock lock(mutex);
+    paused = on;
+    changed.broadcast();
+}
+
+// For the single threaded paths; false once cancelled.
+bool CopyEngine::holdWhilePaused() {
+    ScopedLock lock(mutex);
+    while (paused && !cancelled) changed.wait(mutex);
+    return !cancelled;
+}
+
+int CopyEngine::wait() {
+    readWorker.join();
+    writeWorker.join();
+    if (calibrating && status == COPY_DONE) endCalibration();
+    calibrating = false;
+    releaseBuffers();
+    return status;
+}
+
+// First failure wins; the other thread sees the status change and stops.
+void CopyEngine::finish(int result) {
+    ScopedLock lock(mutex);
+    if (status == COPY_RUNNING) status = result;
+    changed.broadcast();
+}
+
+// While calibrating, each candidate size gets COPY_TUNE_READS reads; the rest of the stream
+// uses the largest one.
+u32 CopyEngine::chunkFor(u32 count) const {
+    if (!calibrating) return chunkSize;
+    u32 phase = count / COPY_TUNE_READS;
+    return tuneSizes[phase < tuneCount ? phase : tuneCount - 1];
+}
+
+// Read and write overlap, so a candidate's throughput is limited by the slower of the two sides.
+void CopyEngine::endCalibration() {
+    u32 best = 0;
+    double bestRate = 0;
+    for (u32 i = 0; i < tuneCount; i++) {
+        u64 ticks = (readTicks[i] > writeTicks[i]) ? readTicks[i] : writeTicks[i];
+        if (!ticks) continue;
+        double rate = (double)tuneSizes[i] * COPY_TUNE_READS / ticks;
+        if (rate > bestRate) { bestRate = rate; best = tuneSizes[i]; }
+    }
+    if (best) chunkTuner().store(route, best);
+}
+
+void CopyEngine::readThread(void *arg) {
+    CopyEngine *self = (CopyEngine*)arg;
+    u32 count = self->buffers.size();
+    while (true) {
+        self->mutex.lock();
+        while ((self->filled == count || self->paused) && self->status == COPY_RUNNING && !self->cancelled) self->changed.wait(self->mutex);
+        bool stop = (self->status != COPY_RUNNING || self->cancelled);
+        self->mutex.unlock();
+        if (stop) break;
+
+        u32 slot = self->readSlot;
+        u32 phase = self->reads / COPY_TUNE_READS;
+        u64 begin = self->calibrating ? clockTicks() : 0;
+        s64 rsize = self->reader->read(self->buffers[slot], self->chunkFor(self->reads++));
+        if (rsize < 0) { self->finish(COPY_READ_ERROR); break; }
+        if (self->calibrating && phase < tuneCount) self->readTicks[phase] += clockTicks() - begin;
+        self->phases[slot] = phase;
+
+        ScopedLock lock(self->mutex);
+        if (rsize == 0) self->eof = true;
+        else {
+            self->lengths[slot] = rsize;
+            self->readSlot = (slot + 1) % count;
+            self->filled++;
+        }
+        self->changed.broadcast();
+        if (self->eof) break;
+    }
+}
+
+void CopyEngine::writeThread(void *arg) {
+    CopyEngine *self = (CopyEngine*)arg;
+    u32 count = self->buffers.size();
+    while (true) {
+        self->mutex.lock();
+        while (self->filled == 0 && !self->eof && self->status == COPY_RUNNING && !self->cancelled) self->changed.wait(self->mutex);
+        bool done = (self->filled == 0 && self->eof);
+        bool stop = (self->status != COPY_RUNNING || self->cancelled);
+        self->mutex.unlock();
+        if (stop) { self->finish(COPY_CANCELLED); break; }
+        if (done) { self->finish(COPY_DONE); break; }
+
+        u32 slot = self->writeSlot;
+        u64 begin = self->calibrating ? clockTicks() : 0;
+        if (!self->writer->write(self->buffers[slot], self->lengths[slot])) { self->finish(COPY_WRITE_ERROR); break; }
+        if (self->calibrating && self->phases[slot] < tuneCount) self->writeTicks[self->phases[slot]] += clockTicks() - begin;
+        self->progress += self->lengths[slot];
+
+        ScopedLock lock(self->mutex);
+        self->writeSlot = (slot + 1) % count;
+        self->filled--;
+        self->changed.broadcast();
+    }
+}
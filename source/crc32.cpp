@@ -0,0 +1,36 @@
+#include "crc32.h"
+
+static u32 table[4][256];
+
+// Four tables let the inner loop consume a word at a time.
+static bool makeTables() {
+    for (u32 i = 0; i < 256; i++) {
+        u32 c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        table[0][i] = c;
+    }
+    for (u32 i = 0; i < 256; i++) {
+        for (int t = 1; t < 4; t++) table[t][i] = (table[t-1][i] >> 8) ^ table[0][table[t-1][i] & 0xFF];
+    }
+    return true;
+}
+
+static const bool tablesReady = makeTables();
+
+u32 crc32(u32 crc, const void *data, size_t size) {
+    (void)tablesReady;
+    const u8 *src = (const u8*)data;
+    crc = ~crc;
+    while (size && ((size_t)src & 3)) {
+        crc = table[0][(crc ^ *src++) & 0xFF] ^ (crc >> 8);
+        size--;
+    }
+    while (size >= 4) {
+        crc ^= src[0] | (src[1] << 8) | (src[2] << 16) | ((u32)src[3] << 24);
+        crc = table[3][crc & 0xFF] ^ table[2][(crc >> 8) & 0xFF] ^ table[1][(crc >> 16) & 0xFF] ^ table[0][crc >> 24];
+        src += 4;
+        size -= 4;
+    }
+    while (size--) crc = table[0][(crc ^ *src++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
@@ -0,0 +1,225 @@
+#include <string.h>
+#include <algorithm>
+#include "diff.h"
+
+static const char changeCodes[] = {'A', 'D', 'M'};
+
+Differ::Differ() : older(NULL), newer(NULL), total(0), base(0), status(COPY_IDLE), cancelled(false), engine(NULL) {}
+
+Differ::~Differ() {
+    cancel();
+    wait();
+}
+
+bool Differ::start(const RomFS *a, const RomFS *b) {
+    if (isRunning() || !a || !b) return false;
+    wait();
+    older = a;
+    newer = b;
+    results.clear();
+    candidates.clear();
+    total = base = 0;
+    cancelled = false;
+    engine = new CopyEngine(0, 4);
+    status = COPY_RUNNING;
+    if (!driver.start(run, this)) { status = COPY_IDLE; delete engine; engine = NULL; return false; }
+    return true;
+}
+
+void Differ::cancel() {
+    cancelled = true;
+    if (engine) engine->cancel();
+}
+
+int Differ::wait() {
+    driver.join();
+    delete engine;
+    engine = NULL;
+    return status;
+}
+
+u32 Differ::count(int change) const {
+    u32 result = 0;
+    for (size_t i = 0; i < results.size(); i++) result += (results[i].change == change);
+    return result;
+}
+
+void Differ::addTree(const RomFS *romfs, u32 index, int change) {
+    std::vector<u32> pending(1, index);
+    while (!pending.empty()) {
+        u32 i = pending.back();
+        pending.pop_back();
+        const romfs_entry &ent = romfs->entry(i);
+        diff_entry result = {romfs->path(i) + (ent.isDir ? "/" : ""), ROMFS_NONE, ROMFS_NONE, change};
+        if (change == DIFF_ADDED) result.newIndex = i;
+        else result.oldIndex = i;
+        results.push_back(result);
+        for (u32 child = ent.child; ent.isDir && child != ROMFS_NONE; child = romfs->entry(child).sibling) pending.push_back(child);
+    }
+}
+
+// Every directory present on both sides is visited once; each child is looked up on the other
+// side by name, so the walk is linear in the number of entries.
+void Differ::walk() {
+    std::vector<std::pair<u32, u32> > pending(1, std::make_pair(older->root(), newer->root()));
+    while (!pending.empty() && !cancelled) {
+        u32 a = pending.back().first;
+        u32 b = pending.back().second;
+        pending.pop_back();
+        for (u32 i = older->entry(a).child; i != ROMFS_NONE; i = older->entry(i).sibling) {
+            const romfs_entry &ent = older->entry(i);
+            u32 j = newer->findChild(b, older->name(i), ent.nameLen);
+            if (j == ROMFS_NONE || newer->entry(j).isDir != ent.isDir) { addTree(older, i, DIFF_REMOVED); continue; }
+            const romfs_entry &match = newer->entry(j);
+            if (ent.isDir) pending.push_back(std::make_pair(i, j));
+            else if (ent.size != match.size) {
+                diff_entry result = {older->path(i), i, j, DIFF_MODIFIED};
+                results.push_back(result);
+            } else if (ent.size) {
+                candidates.push_back(i);
+                candidates.push_back(j);
+                total += ent.size * 2;
+            }
+        }
+        for (u32 j = newer->entry(b).child; j != ROMFS_NONE; j = newer->entry(j).sibling) {
+            const romfs_entry &ent = newer->entry(j);
+            u32 i = older->findChild(a, newer->name(j), ent.nameLen);
+            if (i == ROMFS_NONE || older->entry(i).isDir != ent.isDir) addTree(newer, j, DIFF_ADDED);
+        }
+    }
+}
+
+typedef struct {
+    const RomFS *romfs;
+    const std::vector<u32> *candidates;
+    bool older;
+    bool operator() (u32 a, u32 b) const {
+        return romfs->entry((*candidates)[a * 2 + !older]).offset < romfs->entry((*candidates)[b * 2 + !older]).offset;
+    }
+} CandidateOrder;
+
+// Hashes one side's candidates in image order; digests is indexed like the candidate pairs.
+int Differ::hash(const RomFS *romfs, bool isOlder, std::vector<digest> *digests) {
+    u32 pairs = candidates.size() / 2;
+    std::vector<u32> order(pairs);
+    for (u32 i = 0; i < pairs; i++) order[i] = i;
+    CandidateOrder cmp = {romfs, &candidates, isOlder};
+    std::sort(order.begin(), order.end(), cmp);
+    spans.resize(pairs);
+    for (u32 i = 0; i < pairs; i++) {
+        const romfs_entry &ent = romfs->entry(candidates[order[i] * 2 + !isOlder]);
+        spans[i].offset = ent.offset;
+        spans[i].size = ent.size;
+    }
+    std::vector<digest> sorted(pairs);
+    SpanReader reader;
+    reader.reset(romfs->source(), &spans);
+    HashWriter writer;
+    writer.spans = &spans;
+    writer.digests = &sorted;
+    writer.next = 0;
+    writer.remaining = 0;
+    if (cancelled || !engine->start(&reader, &writer)) return cancelled ? COPY_CANCELLED : COPY_READ_ERROR;
+    int result = engine->wait();
+    base += engine->getProgress();
+    if (result == COPY_DONE && writer.next != pairs) result = COPY_READ_ERROR;
+    digests->resize(pairs);
+    for (u32 i = 0; i < pairs; i++) (*digests)[order[i]] = sorted[i];
+    return result;
+}
+
+static bool byPath(const diff_entry &a, const diff_entry &b) {
+    return a.path < b.path;
+}
+
+void Differ::run(void *arg) {
+    Differ *self = (Differ*)arg;
+    self->walk();
+    std::vector<digest> oldHashes, newHashes;
+    int result = self->cancelled ? COPY_CANCELLED : COPY_DONE;
+    if (result == COPY_DONE && !self->candidates.empty()) result = self->hash(self->older, true, &oldHashes);
+    if (result == COPY_DONE && !self->candidates.empty()) result = self->hash(self->newer, false, &newHashes);
+    if (result == COPY_DONE) {
+        for (size_t i = 0; i < oldHashes.size(); i++) {
+            if (!memcmp(oldHashes[i].bytes, newHashes[i].bytes, SHA256_HASH_SIZE)) continue;
+            u32 a = self->candidates[i * 2];
+            diff_entry entry = {self->older->path(a), a, self->candidates[i * 2 + 1], DIFF_MODIFIED};
+            self->results.push_back(entry);
+        }
+        std::sort(self->results.begin(), self->results.end(), byPath);
+    }
+    self->status = result;
+}
+
+bool Differ::HashWriter::write(const void *buffer, u32 size) {
+    const u8 *src = (const u8*)buffer;
+    while (size > 0) {
+        if (remaining == 0) {
+            if (next >= spans->size()) return false;
+            remaining = (*spans)[next].size;
+            sha256Init(&ctx);
+        }
+        u32 len = (remaining < size) ? remaining : size;
+        sha256Update(&ctx, src, len);
+        src += len;
+        size -= len;
+        remaining -= len;
+        if (remaining == 0) sha256Final(&ctx, (*digests)[next++].bytes);
+    }
+    return true;
+}
+
+bool writeDiff(FILE *out, const std::vector<diff_entry> &entries) {
+    bool ok = fprintf(out, "%s\n", DIFF_HEADER) > 0;
+    for (size_t i = 0; ok && i < entries.size(); i++) ok = fprintf(out, "%c\t%s\n", changeCodes[entries[i].change], entries[i].path.c_str()) > 0;
+    return ok;
+}
+
+bool saveDiff(const std::string &path, const std::vector<diff_entry> &entries) {
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out) return false;
+    bool ok = writeDiff(out, entries);
+    return (fclose(out) == 0) && ok;
+}
+
+bool loadPathList(const std::string &path, std::vector<std::string> *dest) {
+    dest->clear();
+    FILE *in = fopen(path.c_str(), "r");
+    if (!in) return false;
+    char line[0x400];
+    while (fgets(line, sizeof(line), in)) {
+        std::string entry(line);
+        while (!entry.empty() && (entry[entry.size() - 1] == '\n' || entry[entry.size() - 1] == '\r')) entry.erase(entry.size() - 1);
+        if (entry.empty() || entry[0] == '#') continue;
+        if (entry.size() > 2 && entry[1] == '\t') {
+            if (entry[0] == changeCodes[DIFF_REMOVED]) continue;
+            entry.erase(0, 2);
+        }
+        dest->push_back(entry);
+    }
+    fclose(in);
+    return true;
+}
+
+u32 selectFiles(const RomFS *romfs, const std::vector<std::string> &paths, std::vector<u32> *files) {
+    u32 missing = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        u32 index = romfs->find(paths[i]);
+        if (index == ROMFS_NONE) { missing++; continue; }
+        std::vector<u32> pending(1, index);
+        while (!pending.empty()) {
+            const romfs_entry &ent = romfs->entry(pending.back());
+            if (!ent.isDir) files->push_back(pending.back());
+            pending.pop_back();
+            for (u32 child = ent.child; ent.isDir && child != ROMFS_NONE; child = romfs->entry(child).sibling) pending.push_back(child);
+        }
+    }
+    return missing;
+}
+
+void changedFiles(const std::vector<diff_entry> &entries, std::vector<u32> *files) {
+    for (size_t i = 0; i < entries.size(); i++) {
+        const diff_entry &entry = entries[i];
+        if (entry.newIndex != ROMFS_NONE && entry.path[entry.path.size() - 1] != '/') files->push_back(entry.newIndex);
+    }
+}
@@ -0,0 +1,166 @@
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "dump.h"
+#include "perf.h"
+
+#define CHECKPOINT_MAGIC 0x504B4344 // "DCKP"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_TAIL 0x1000
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u64 imageSize;
+    u64 offset;         // bytes of the image already in the dump and synced
+    u8 tail[SHA256_HASH_SIZE]; // hash of the last chunk before offset, checked on resume
+    u32 tailSize;
+    u32 reserved;
+    sha256_ctx ctx;     // output hash state at offset
+} dump_checkpoint;
+
+const dump_options &defaultDumpOptions() {
+    static const dump_options options = {0, 4, 0x800000, ""};
+    return options;
+}
+
+bool loadDumpOptions(const char *path, dump_options *options) {
+    FILE *in = fopen(path, "r");
+    if (!in) return false;
+    char line[128];
+    while (fgets(line, sizeof(line), in)) {
+        char key[64];
+        long value;
+        if (sscanf(line, " %63[a-z_] = %li", key, &value) != 2 || value <= 0) continue;
+        if (!strcmp(key, "chunk_size") && value >= 0x1000 && value <= 0x800000) options->chunkSize = value & ~0xFFFl;
+        else if (!strcmp(key, "depth") && value <= 16) options->depth = value;
+        else if (!strcmp(key, "checkpoint_interval")) options->checkpointInterval = value;
+    }
+    fclose(in);
+    return true;
+}
+
+Dumper::Dumper() : file(NULL), total(0), resumed(0), written(0), lastCheckpoint(0), interval(0), reader(NULL), engine(NULL) {
+    writer.owner = this;
+}
+
+bool Dumper::hasCheckpoint(const std::string &path) {
+    return access((path + ".ckpt").c_str(), F_OK) == 0;
+}
+
+bool Dumper::HashWriter::write(const void *buffer, u32 size) {
+    PERF_SCOPE_BYTES(PERF_WRITE, size);
+    Dumper *self = owner;
+    if (fwrite(buffer, 1, size, self->file) != size) return false;
+    sha256Update(&self->ctx, buffer, size);
+    self->written += size;
+    u32 keep = (size < CHECKPOINT_TAIL) ? size : CHECKPOINT_TAIL;
+    self->tail.assign((const u8*)buffer + size - keep, (const u8*)buffer + size);
+    if (self->written - self->lastCheckpoint >= self->interval) return self->saveCheckpoint();
+    return true;
+}
+
+// Only called with every byte up to 'written' handed to the file; flush and sync first, so the
+// checkpoint never claims data that didn't make it to the card.
+bool Dumper::saveCheckpoint() {
+    if (!file || fflush(file) != 0 || fsync(fileno(file)) != 0) return false;
+    dump_checkpoint ckpt;
+    memset(&ckpt, 0, sizeof(ckpt));
+    ckpt.magic = CHECKPOINT_MAGIC;
+    ckpt.version = CHECKPOINT_VERSION;
+    ckpt.imageSize = total;
+    ckpt.offset = written;
+    ckpt.ctx = ctx;
+    ckpt.tailSize = tail.size();
+    sha256(tail.data(), tail.size(), ckpt.tail);
+    FILE *out = fopen((path + ".ckpt").c_str(), "wb");
+    if (!out) return false;
+    bool ok = (fwrite(&ckpt, 1, sizeof(ckpt), out) == sizeof(ckpt));
+    fclose(out);
+    lastCheckpoint = written;
+    return ok;
+}
+
+// A checkpoint is trusted when it was made for an image of the same size, the dump is at least
+// that long, and the last chunk it covers still matches the image.
+bool Dumper::loadCheckpoint(ImageSource *image) {
+    dump_checkpoint ckpt;
+    FILE *in = fopen((path + ".ckpt").c_str(), "rb");
+    if (!in) return false;
+    bool ok = (fread(&ckpt, 1, sizeof(ckpt), in) == sizeof(ckpt));
+    fclose(in);
+    if (!ok || ckpt.magic != CHECKPOINT_MAGIC || ckpt.version != CHECKPOINT_VERSION) return false;
+    if (ckpt.imageSize != total || ckpt.offset > total || ckpt.tailSize > ckpt.offset || ckpt.tailSize > CHECKPOINT_TAIL) return false;
+    std::vector<u8> tail(ckpt.tailSize);
+    std::vector<u8> source(ckpt.tailSize);
+    in = fopen(path.c_str(), "rb");
+    ok = in && (fseeko(in, DUMP_HEADER_SIZE + ckpt.offset - ckpt.tailSize, SEEK_SET) == 0) && (fread(tail.data(), 1, tail.size(), in) == tail.size());
+    if (in) fclose(in);
+    if (!ok || !image->read(ckpt.offset - ckpt.tailSize, source.data(), source.size()) || tail != source) return false;
+    u8 check[SHA256_HASH_SIZE];
+    sha256(tail.data(), tail.size(), check);
+    if (memcmp(check, ckpt.tail, sizeof(check))) return false;
+    resumed = written = lastCheckpoint = ckpt.offset;
+    ctx = ckpt.ctx;
+    this->tail.swap(tail);
+    return true;
+}
+
+bool Dumper::start(ImageSource *image, const std::string &fpath, const dump_options &options, bool resume) {
+    if (isRunning()) return false;
+    close();
+    path = fpath;
+    total = image->size();
+    resumed = written = lastCheckpoint = 0;
+    tail.clear();
+    interval = options.checkpointInterval;
+    hash.clear();
+    if (resume && loadCheckpoint(image)) {
+        file = fopen(path.c_str(), "r+b");
+        if (!file || ftruncate(fileno(file), DUMP_HEADER_SIZE + resumed) != 0 || fseeko(file, 0, SEEK_END) != 0) { close(); return false; }
+    } else {
+        resumed = written = 0;
+        file = fopen(path.c_str(), "wb");
+        if (!file) return false;
+        char header[DUMP_HEADER_SIZE] = "IVFC";
+        memset(header + 4, 0, DUMP_HEADER_SIZE - 4);
+        sha256Init(&ctx);
+        sha256Update(&ctx, header, DUMP_HEADER_SIZE);
+        if (fwrite(header, 1, DUMP_HEADER_SIZE, file) != DUMP_HEADER_SIZE) { close(); return false; }
+    }
+    reader = new ImageReader(image, resumed, total - resumed);
+    engine = new CopyEngine(options.chunkSize, options.depth);
+    engine->setRoute(options.route, total - resumed);
+    if (!engine->start(reader, &writer)) { close(); return false; }
+    return true;
+}
+
+int Dumper::wait() {
+    if (!engine) return COPY_IDLE;
+    int status = engine->wait();
+    if (status == COPY_DONE && written == total) {
+        u8 digest[SHA256_HASH_SIZE];
+        sha256Final(&ctx, digest);
+        hash = hashToString(digest, sizeof(digest));
+        fclose(file);
+        file = NULL;
+        FILE *out = fopen((path + ".sha256").c_str(), "w");
+        if (out) {
+            fprintf(out, "%s  %s\n", hash.c_str(), path.substr(path.rfind('/') + 1).c_str());
+            fclose(out);
+        }
+        remove((path + ".ckpt").c_str());
+    } else if (status == COPY_DONE) status = COPY_READ_ERROR;
+    else if (status == COPY_CANCELLED) saveCheckpoint();
+    close();
+    return status;
+}
+
+void Dumper::close() {
+    delete engine;
+    delete reader;
+    engine = NULL;
+    reader = NULL;
+    if (file) fclose(file);
+    file = NULL;
+}
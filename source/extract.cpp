@@ -0,0 +1,316 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "crc32.h"
+#include "extract.h"
+#include "perf.h"
+
+#define MANIFEST_HEADER "# romfs-explorer manifest v1"
+
+struct ByOffset {
+    const RomFS *romfs;
+    bool operator() (u32 a, u32 b) const { return romfs->entry(a).offset < romfs->entry(b).offset; }
+};
+
+const extract_options &defaultExtractOptions() {
+    static const extract_options options = {0, 4, true, false, false, ""};
+    return options;
+}
+
+// Text manifest, one "crc<TAB>size<TAB>offset<TAB>path" line per file; paths are relative
+// to the extracted directory.
+bool loadManifest(const std::string &path, manifest *dest) {
+    dest->clear();
+    FILE *in = fopen(path.c_str(), "r");
+    if (!in) return false;
+    char line[0x400];
+    bool ok = fgets(line, sizeof(line), in) && !strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER));
+    while (ok && fgets(line, sizeof(line), in)) {
+        manifest_entry ent;
+        int pos = 0;
+        if (sscanf(line, "%" SCNx32 "\t%" SCNu64 "\t%" SCNu64 "\t%n", &ent.crc, &ent.size, &ent.offset, &pos) != 3 || !pos) continue;
+        std::string name(line + pos);
+        if (!name.empty() && name[name.size() - 1] == '\n') name.erase(name.size() - 1);
+        (*dest)[name] = ent;
+    }
+    fclose(in);
+    return ok;
+}
+
+bool saveManifest(const std::string &path, const manifest &src) {
+    std::string tmp = path + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "w");
+    if (!out) return false;
+    bool ok = fprintf(out, "%s\n", MANIFEST_HEADER) > 0;
+    for (manifest::const_iterator it = src.begin(); ok && it != src.end(); ++it) {
+        ok = fprintf(out, "%08" PRIx32 "\t%" PRIu64 "\t%" PRIu64 "\t%s\n", it->second.crc, it->second.size, it->second.offset, it->first.c_str()) > 0;
+    }
+    ok = (fclose(out) == 0) && ok;
+    remove(path.c_str());
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+Extractor::Extractor() : romfs(NULL), root(0), keepManifest(false), list(NULL), total(0), base(0), fileCount(0), done(0), skipped(0), removed(0),
+    status(COPY_IDLE), cancelled(false), engine(NULL) {
+    writer.owner = this;
+    writer.file = NULL;
+}
+
+Extractor::~Extractor() {
+    cancel();
+    wait();
+}
+
+void Extractor::collect(const RomFS *romfs, u32 root, std::vector<u32> *dirs, std::vector<u32> *files) {
+    std::vector<u32> pending(1, root);
+    while (!pending.empty()) {
+        u32 index = pending.back();
+        pending.pop_back();
+        const romfs_entry &ent = romfs->entry(index);
+        if (!ent.isDir) { files->push_back(index); continue; }
+        dirs->push_back(index);
+        for (u32 i = ent.child; i != ROMFS_NONE; i = romfs->entry(i).sibling) pending.push_back(i);
+    }
+    std::sort(dirs->begin(), dirs->end());
+}
+
+// Output paths are rebuilt from the index on demand instead of being kept for every file.
+std::string Extractor::relativePath(u32 index) const {
+    std::string path = romfs->path(index).substr(rootPath.size());
+    if (!path.empty() && path[0] == '/') path.erase(0, 1);
+    return path;
+}
+
+std::string Extractor::outputPath(u32 index) const {
+    std::string path = romfs->path(index);
+    return dest + std::string(romfs->name(root)) + path.substr(rootPath.size());
+}
+
+manifest_entry Extractor::describe(u32 index) const {
+    const romfs_entry &ent = romfs->entry(index);
+    manifest_entry result = {ent.size, ent.size ? ent.offset - romfs->getBase() - romfs->getHeader().fileDataOff : 0, 0};
+    return result;
+}
+
+bool Extractor::start(const RomFS *fs, u32 index, std::string dir, const extract_options &opts) {
+    if (isRunning()) return false;
+    close();
+    romfs = fs;
+    root = index;
+    dest = dir;
+    options = opts;
+    keepManifest = romfs->entry(root).isDir;
+    rootPath = romfs->path(root);
+    if (rootPath == "/") rootPath = "";
+    std::vector<u32> dirs;
+    std::vector<u32> all;
+    collect(romfs, root, &dirs, &all);
+    return begin(dirs, all);
+}
+
+bool Extractor::start(const RomFS *fs, const std::vector<u32> &files, std::string dir, const extract_options &opts) {
+    if (isRunning()) return false;
+    close();
+    romfs = fs;
+    root = fs->root();
+    while (dir.size() > 1 && dir[dir.size() - 1] == '/') dir.erase(dir.size() - 1);
+    dest = dir;
+    options = opts;
+    options.incremental = false;
+    keepManifest = false;
+    rootPath = "";
+    for (size_t pos = dir.find('/', 1); pos != std::string::npos; pos = dir.find('/', pos + 1)) mkdir(dir.substr(0, pos).c_str(), 0777);
+    std::vector<bool> seen(romfs->count(), false);
+    std::vector<u32> dirs;
+    std::vector<u32> all;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (seen[files[i]] || romfs->entry(files[i]).isDir) continue;
+        seen[files[i]] = true;
+        all.push_back(files[i]);
+        for (u32 parent = romfs->entry(files[i]).parent; !seen[parent]; parent = romfs->entry(parent).parent) {
+            seen[parent] = true;
+            dirs.push_back(parent);
+            if (parent == root) break;
+        }
+    }
+    std::sort(dirs.begin(), dirs.end());
+    return begin(dirs, all);
+}
+
+bool Extractor::begin(const std::vector<u32> &dirs, const std::vector<u32> &all) {
+    total = base = 0;
+    done = skipped = removed = 0;
+    cancelled = false;
+    previous.clear();
+    current.clear();
+    checks.clear();
+    copies.clear();
+    crcs.clear();
+
+    std::string manifestPath = outputPath(root) + "/" + MANIFEST_NAME;
+    if (keepManifest && options.incremental) loadManifest(manifestPath, &previous);
+
+    for (size_t i = 0; i < dirs.size(); i++) {
+        std::string path = outputPath(dirs[i]);
+        if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST) return false;
+    }
+    for (size_t i = 0; i < all.size(); i++) {
+        manifest_entry ent = describe(all[i]);
+        std::string rel = relativePath(all[i]);
+        manifest::iterator old = previous.find(rel);
+        bool known = (old != previous.end() && old->second.size == ent.size);
+        if (known && (ent.size == 0 || (options.trustOffsets && old->second.offset == ent.offset))) {
+            ent.crc = old->second.crc;
+            skipped++;
+        } else if (known) {
+            ent.crc = old->second.crc;
+            checks.push_back(all[i]);
+        } else if (ent.size) {
+            copies.push_back(all[i]);
+        } else {
+            FILE *empty = fopen(outputPath(all[i]).c_str(), "wb");
+            if (!empty) return false;
+            fclose(empty);
+        }
+        if (keepManifest) current[rel] = ent;
+        if (old != previous.end()) previous.erase(old);
+    }
+    ByOffset order = {romfs};
+    std::sort(checks.begin(), checks.end(), order);
+    std::sort(copies.begin(), copies.end(), order);
+    u64 bytes = 0;
+    for (size_t i = 0; i < checks.size(); i++) bytes += romfs->entry(checks[i]).size;
+    for (size_t i = 0; i < copies.size(); i++) bytes += romfs->entry(copies[i]).size;
+    total = bytes;
+    fileCount = copies.size();
+
+    engine = new CopyEngine(options.chunkSize, options.depth);
+    status = COPY_RUNNING;
+    if (!driver.start(run, this)) { status = COPY_IDLE; close(); return false; }
+    return true;
+}
+
+int Extractor::stream(std::vector<u32> *files, bool write) {
+    if (files->empty()) return COPY_DONE;
+    list = files;
+    spans.resize(files->size());
+    for (size_t i = 0; i < files->size(); i++) {
+        spans[i].offset = romfs->entry((*files)[i]).offset;
+        spans[i].size = romfs->entry((*files)[i]).size;
+    }
+    reader.reset(romfs->source(), &spans);
+    writer.next = 0;
+    writer.remaining = 0;
+    writer.discard = !write;
+    u64 bytes = 0;
+    for (size_t i = 0; i < spans.size(); i++) bytes += spans[i].size;
+    // the checksum pass writes nothing, so its timings would calibrate the route from reads alone
+    engine->setRoute(write ? options.route : std::string(), bytes);
+    if (cancelled || !engine->start(&reader, &writer)) return cancelled ? COPY_CANCELLED : COPY_READ_ERROR;
+    int result = engine->wait();
+    if (write && !queue.flush() && result == COPY_DONE) result = COPY_WRITE_ERROR;
+    base += engine->getProgress();
+    if (writer.file) fclose(writer.file);
+    writer.file = NULL;
+    if (result == COPY_DONE && writer.next != files->size()) result = COPY_READ_ERROR;
+    return result;
+}
+
+// Runs the checksum pass over files that may be unchanged, then writes everything that differs.
+void Extractor::run(void *arg) {
+    Extractor *self = (Extractor*)arg;
+    int result = self->stream(&self->checks, false);
+    if (result == COPY_DONE && !self->checks.empty()) {
+        for (size_t i = 0; i < self->checks.size(); i++) {
+            u32 index = self->checks[i];
+            if (self->current[self->relativePath(index)].crc == self->crcs[index]) self->skipped++;
+            else {
+                self->copies.push_back(index);
+                self->total += self->romfs->entry(index).size;
+            }
+        }
+        ByOffset order = {self->romfs};
+        std::sort(self->copies.begin(), self->copies.end(), order);
+        self->fileCount = self->copies.size();
+    }
+    if (result == COPY_DONE) result = self->stream(&self->copies, true);
+    if (result == COPY_DONE && self->keepManifest) {
+        for (std::unordered_map<u32, u32>::iterator it = self->crcs.begin(); it != self->crcs.end(); ++it) {
+            self->current[self->relativePath(it->first)].crc = it->second;
+        }
+        std::string outdir = self->outputPath(self->root) + "/";
+        if (self->options.incremental && self->options.removeStale) {
+            for (manifest::iterator it = self->previous.begin(); it != self->previous.end(); ++it) {
+                if (remove((outdir + it->first).c_str()) == 0) self->removed++;
+            }
+        }
+        if (!saveManifest(outdir + MANIFEST_NAME, self->current)) result = COPY_WRITE_ERROR;
+    }
+    self->status = result;
+}
+
+void Extractor::cancel() {
+    cancelled = true;
+    if (engine) engine->cancel();
+}
+
+int Extractor::wait() {
+    driver.join();
+    int result = status;
+    close();
+    return result;
+}
+
+void Extractor::close() {
+    driver.join();
+    delete engine;
+    engine = NULL;
+    if (writer.file) fclose(writer.file);
+    writer.file = NULL;
+}
+
+bool Extractor::SplitWriter::write(const void *buffer, u32 size) {
+    PERF_SCOPE_BYTES(PERF_WRITE, size);
+    Extractor *self = owner;
+    const std::vector<u32> &files = *self->list;
+    const u8 *src = (const u8*)buffer;
+    while (size > 0) {
+        if (remaining == 0) {
+            if (next >= files.size()) return false;
+            u64 fsize = self->romfs->entry(files[next]).size;
+            if (!discard && fsize <= BATCH_FILE_MAX && fsize <= size) {
+                u32 fcrc = crc32(0, src, fsize);
+                if (!self->queue.push(self->outputPath(files[next]), src, fsize)) return false;
+                self->crcs[files[next]] = fcrc;
+                next++;
+                self->done++;
+                src += fsize;
+                size -= fsize;
+                continue;
+            }
+            if (!discard) {
+                file = fopen(self->outputPath(files[next]).c_str(), "wb");
+                if (!file) return false;
+            }
+            remaining = self->romfs->entry(files[next]).size;
+            crc = 0;
+        }
+        u32 len = (remaining < size) ? remaining : size;
+        crc = crc32(crc, src, len);
+        if (file && fwrite(src, 1, len, file) != len) return false;
+        src += len;
+        size -= len;
+        remaining -= len;
+        if (remaining == 0) {
+            bool ok = !file || (fclose(file) == 0);
+            file = NULL;
+            self->crcs[files[next]] = crc;
+            next++;
+            if (!discard) self->done++;
+            if (!ok) return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,255 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstring>
+#include "filelist.h"
+#include "perf.h"
+
+#ifdef _3DS
+#include <3ds.h>
+#endif
+
+// Rows are sorted in growing batches, so paging through a whole listing still costs O(n log n).
+#define SORT_BATCH 64
+
+FileList::FileList() : romfs(NULL), head(0), tail(0) {}
+
+void FileList::clear() {
+    romfs = NULL;
+    std::vector<char>().swap(arena);
+    std::vector<u32>().swap(dirs);
+    std::vector<fileentry>().swap(entries);
+    std::vector<u32>().swap(order);
+    head = tail = 0;
+}
+
+void FileList::swap(FileList &other) {
+    std::swap(romfs, other.romfs);
+    arena.swap(other.arena);
+    dirs.swap(other.dirs);
+    entries.swap(other.entries);
+    order.swap(other.order);
+    std::swap(head, other.head);
+    std::swap(tail, other.tail);
+}
+
+u32 FileList::intern(const char *str, size_t len) {
+    u32 offset = arena.size();
+    arena.insert(arena.end(), str, str + len);
+    arena.push_back('\0');
+    return offset;
+}
+
+u32 FileList::addDirectory(std::string directory) {
+    dirs.push_back(intern(directory.c_str(), directory.size()));
+    return dirs.size() - 1;
+}
+
+void FileList::add(const char *name, bool isDir, u64 size) {
+    fileentry ent;
+    ent.name = intern(name, strlen(name));
+    ent.parent = dirs.size() - 1;
+    ent.size = isDir ? 0 : size;
+    ent.isDir = isDir;
+    order.push_back(entries.size());
+    entries.push_back(ent);
+    tail = order.size();
+}
+
+#ifdef _3DS
+// FSDIR_Read hands back name, attributes and size for a whole batch of entries per IPC request.
+static bool scanArchive(FileList *dest, std::string directory) {
+    FS_Archive sdmc;
+    if (FSUSER_OpenArchive(&sdmc, ARCHIVE_SDMC, fsMakePath(PATH_EMPTY, "")) != 0) return false;
+    std::vector<u16> wpath(directory.size() + 1, 0);
+    ssize_t wlen = utf8_to_utf16(wpath.data(), (const u8*)directory.c_str(), directory.size());
+    Handle dir;
+    if (wlen < 0 || FSUSER_OpenDirectory(&dir, sdmc, (FS_Path){PATH_UTF16, (u32)(wlen + 1) * 2, wpath.data()}) != 0) {
+        FSUSER_CloseArchive(sdmc);
+        return false;
+    }
+    dest->clear();
+    dest->addDirectory(directory);
+    FS_DirectoryEntry entries[32];
+    u8 name[0x106 * 3 + 1];
+    u32 read = 0;
+    do {
+        if (FSDIR_Read(dir, &read, 32, entries) != 0) break;
+        for (u32 i = 0; i < read; i++) {
+            ssize_t len = utf16_to_utf8(name, entries[i].name, sizeof(name) - 1);
+            if (len < 0) continue;
+            name[len] = '\0';
+            dest->add((char*)name, entries[i].attributes & FS_ATTRIBUTE_DIRECTORY, entries[i].fileSize);
+        }
+    } while (read > 0);
+    FSDIR_Close(dir);
+    FSUSER_CloseArchive(sdmc);
+    return true;
+}
+#endif
+
+bool FileList::scan(std::string directory) {
+#ifdef _3DS
+    if (directory.compare(0, 1, "/")==0 && scanArchive(this, directory)) return true;
+#endif
+    DIR* dir = opendir(directory.c_str());
+    if(dir == NULL) return false;
+    clear();
+    addDirectory(directory);
+#ifndef _3DS
+    int fd = dirfd(dir);
+#endif
+    dirent* ent = NULL;
+    while ((ent = readdir(dir)) != NULL) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+        bool isDir = (ent->d_type == DT_DIR);
+        u64 size = 0;
+        // Only fall back to stat when the backend doesn't report the type, or to fetch a file's size.
+        if (ent->d_type == DT_UNKNOWN || !isDir) {
+            struct stat st;
+#ifdef _3DS
+            if (stat((directory + ent->d_name).c_str(), &st) == 0) {
+#else
+            if (fstatat(fd, ent->d_name, &st, 0) == 0) {
+#endif
+                isDir = S_ISDIR(st.st_mode);
+                if (!isDir) size = st.st_size;
+            }
+        }
+        add(ent->d_name, isDir, size);
+    }
+    closedir(dir);
+    return true;
+}
+
+// Listing comes straight from the index; only entry ids are kept, names stay in the name pool.
+bool FileList::assign(const RomFS *fs, std::string directory) {
+    u32 index = fs->find(directory.substr(directory.find('/')));
+    std::vector<u32> children;
+    if (!fs->list(index, &children)) return false;
+    clear();
+    addDirectory(directory);
+    romfs = fs;
+    order.swap(children);
+    tail = order.size();
+    return true;
+}
+
+void FileList::addEntries(const RomFS *fs, const std::string &prefix, const u32 *items, u32 count) {
+    u32 parent = ROMFS_NONE;
+    for (u32 i = 0; i < count; i++) {
+        const romfs_entry &ent = fs->entry(items[i]);
+        if (ent.parent != parent || dirs.empty()) {
+            parent = ent.parent;
+            std::string path = fs->path(parent);
+            addDirectory(prefix + path + (path == "/" ? "" : "/"));
+        }
+        add(fs->name(items[i]), ent.isDir, ent.size);
+    }
+    head = tail = size();
+}
+
+size_t FileList::memoryUsage() const {
+    return arena.capacity() + dirs.capacity() * sizeof(u32) + entries.capacity() * sizeof(fileentry) + order.capacity() * sizeof(u32);
+}
+
+const char *FileList::itemName(u32 item) const {
+    return romfs ? romfs->name(item) : &arena[entries[item].name];
+}
+
+bool FileList::itemIsDir(u32 item) const {
+    return romfs ? romfs->entry(item).isDir : entries[item].isDir;
+}
+
+bool FileList::Order::operator() (u32 a, u32 b) const {
+    bool da = list->itemIsDir(a);
+    if (da == list->itemIsDir(b)) return strcasecmp(list->itemName(a), list->itemName(b)) < 0;
+    return da;
+}
+
+void FileList::prepare(u32 first, u32 count) {
+    u32 last = std::min(first + count, size());
+    if (first >= last || head >= tail || last <= head || first >= tail) return;
+    PERF_SCOPE(PERF_SORT);
+    Order cmp = {this};
+    if (first <= head) {
+        // Extend the sorted prefix: the smallest remaining items, in order.
+        u32 end = std::min(std::max(std::max(last, head * 2), head + SORT_BATCH), tail);
+        std::partial_sort(order.begin() + head, order.begin() + end, order.begin() + tail, cmp);
+        head = end;
+    } else if (last >= tail) {
+        // Extend the sorted suffix, for jumps to the end of the listing.
+        u32 len = size() - tail;
+        u32 begin = std::max(std::min(first, tail - std::min(tail, std::max(len, (u32)SORT_BATCH))), head);
+        std::nth_element(order.begin() + head, order.begin() + begin, order.begin() + tail, cmp);
+        std::sort(order.begin() + begin, order.begin() + tail, cmp);
+        tail = begin;
+    } else {
+        std::sort(order.begin() + head, order.begin() + tail, cmp);
+        head = tail;
+    }
+    if (head >= tail) head = tail = size();
+}
+
+filedata FileList::get(u32 row) {
+    prepare(row, 1);
+    u32 item = order[row];
+    filedata result;
+    result.name = itemName(item);
+    if (romfs) {
+        result.path = getDirectory() + result.name;
+        result.isDir = romfs->entry(item).isDir;
+        result.size = romfs->entry(item).size;
+    } else {
+        result.path = getDirectory(entries[item].parent) + result.name;
+        result.isDir = entries[item].isDir;
+        result.size = entries[item].size;
+    }
+    return result;
+}
+
+ListingCache::ListingCache(u32 capacity) : capacity(capacity), clock(0) {}
+
+void ListingCache::store(const std::string &directory, FileList *list, u32 cursor, u32 scroll) {
+    invalidate(directory);
+    if (capacity == 0) { list->clear(); return; }
+    if (slots.size() >= capacity) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < slots.size(); i++) {
+            if (slots[i].lastUse < slots[oldest].lastUse) oldest = i;
+        }
+        slots.erase(slots.begin() + oldest);
+    }
+    slots.push_back(Slot());
+    Slot &slot = slots.back();
+    slot.directory = directory;
+    slot.list.swap(*list);
+    slot.cursor = cursor;
+    slot.scroll = scroll;
+    slot.lastUse = ++clock;
+    list->clear();
+}
+
+bool ListingCache::restore(const std::string &directory, FileList *list, u32 *cursor, u32 *scroll) {
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i].directory != directory) continue;
+        list->swap(slots[i].list);
+        *cursor = slots[i].cursor;
+        *scroll = slots[i].scroll;
+        slots.erase(slots.begin() + i);
+        return true;
+    }
+    return false;
+}
+
+void ListingCache::invalidate(const std::string &directory) {
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i].directory == directory) { slots.erase(slots.begin() + i); return; }
+    }
+}
+
+void ListingCache::clear() {
+    slots.clear();
+}
@@ -0,0 +1,175 @@
+#include <string.h>
+#include "image.h"
+#include "perf.h"
+
+#ifndef _3DS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char *backendNames[] = {"auto", "stdio", "pread", "mmap", "fs"};
+
+int imageBackend(const char *name) {
+    for (int i = 0; i < (int)(sizeof(backendNames) / sizeof(backendNames[0])); i++) {
+        if (name && !strcmp(name, backendNames[i])) return i;
+    }
+    return IMAGE_AUTO;
+}
+
+template <class T> static ImageSource *tryOpen(const char *path) {
+    T *image = new T();
+    if (image->open(path)) return image;
+    delete image;
+    return NULL;
+}
+
+ImageSource *openImage(const char *path, int backend) {
+#ifdef _3DS
+    if (backend == IMAGE_AUTO || backend == IMAGE_FS) {
+        Handle handle;
+        const char *name = strncmp(path, "sdmc:", 5) ? path : path + 5;
+        if (FSUSER_OpenFileDirectly(&handle, ARCHIVE_SDMC, (FS_Path){PATH_EMPTY, 1, (u8*)""}, fsMakePath(PATH_ASCII, name), FS_OPEN_READ, 0)) return NULL;
+        return new FSImage(handle, true);
+    }
+#else
+    ImageSource *image = NULL;
+    if (backend == IMAGE_AUTO || backend == IMAGE_MMAP) image = tryOpen<MmapImage>(path);
+    if (!image && (backend == IMAGE_AUTO || backend == IMAGE_PREAD)) image = tryOpen<PreadImage>(path);
+    if (image || backend == IMAGE_MMAP || backend == IMAGE_PREAD) return image;
+#endif
+    return (backend == IMAGE_AUTO || backend == IMAGE_STDIO) ? tryOpen<StdioImage>(path) : NULL;
+}
+
+StdioImage::StdioImage() : file(NULL), length(0) {}
+
+StdioImage::~StdioImage() {
+    close();
+}
+
+bool StdioImage::open(const char *path) {
+    close();
+    file = fopen(path, "rb");
+    if (!file) return false;
+    if (fseeko(file, 0, SEEK_END) != 0) { close(); return false; }
+    length = ftello(file);
+    return true;
+}
+
+void StdioImage::close() {
+    if (file) fclose(file);
+    file = NULL;
+    length = 0;
+}
+
+bool StdioImage::read(u64 offset, void *buffer, u32 size) {
+    PERF_SCOPE_BYTES(PERF_IMAGE, size);
+    if (!file || offset + size > length) return false;
+    ScopedLock lock(mutex);
+    if (fseeko(file, offset, SEEK_SET) != 0) return false;
+    return fread(buffer, 1, size, file) == size;
+}
+
+u64 StdioImage::size() {
+    return length;
+}
+
+#ifndef _3DS
+PreadImage::PreadImage() : fd(-1), length(0) {}
+
+PreadImage::~PreadImage() {
+    close();
+}
+
+bool PreadImage::open(const char *path) {
+    close();
+    fd = ::open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) { close(); return false; }
+    length = st.st_size;
+    return true;
+}
+
+void PreadImage::close() {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    length = 0;
+}
+
+bool PreadImage::read(u64 offset, void *buffer, u32 size) {
+    PERF_SCOPE_BYTES(PERF_IMAGE, size);
+    if (fd < 0 || offset + size > length) return false;
+    u8 *out = (u8*)buffer;
+    while (size > 0) {
+        ssize_t len = pread(fd, out, size, offset);
+        if (len <= 0) return false;
+        out += len;
+        offset += len;
+        size -= len;
+    }
+    return true;
+}
+
+MmapImage::MmapImage() : data(NULL), length(0) {}
+
+MmapImage::~MmapImage() {
+    close();
+}
+
+// Empty files can't be mapped; they're left to the other backends.
+bool MmapImage::open(const char *path) {
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mem != MAP_FAILED) {
+            data = (const u8*)mem;
+            length = st.st_size;
+        }
+    }
+    ::close(fd);
+    return data != NULL;
+}
+
+void MmapImage::close() {
+    if (data) munmap((void*)data, length);
+    data = NULL;
+    length = 0;
+}
+
+bool MmapImage::read(u64 offset, void *buffer, u32 size) {
+    PERF_SCOPE_BYTES(PERF_IMAGE, size);
+    if (!data || offset + size > length) return false;
+    memcpy(buffer, data + offset, size);
+    return true;
+}
+
+const u8 *MmapImage::map(u64 offset, u64 size) {
+    if (!data || offset + size > length) return NULL;
+    return data + offset;
+}
+#endif
+
+#ifdef _3DS
+FSImage::FSImage(Handle handle, bool owned) : handle(handle), owned(owned) {}
+
+FSImage::~FSImage() {
+    if (owned) FSFILE_Close(handle);
+}
+
+bool FSImage::read(u64 offset, void *buffer, u32 size) {
+    PERF_SCOPE_BYTES(PERF_IMAGE, size);
+    u32 rsize = 0;
+    Result ret = FSFILE_Read(handle, &rsize, offset, buffer, size);
+    return (ret == 0 && rsize == size);
+}
+
+u64 FSImage::size() {
+    u64 fsize = 0;
+    if (FSFILE_GetSize(handle, &fsize) != 0) return 0;
+    return fsize;
+}
+#endif
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cstring>
+#include "ivfc.h"
+#include "sha256.h"
+#include "thread.h"
+
+// Bytes each worker reads from the image at once.
+#define VERIFY_READ_SIZE 0x40000
+#define MAX_VERIFY_THREADS 8
+
+static inline u64 alignUp(u64 value, u64 align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+bool IVFCImage::open(ImageSource *src) {
+    image = NULL;
+    bad.clear();
+    if (!src->read(0, &header, sizeof(header))) return false;
+    if (header.magic != IVFC_MAGIC || header.id != IVFC_ROMFS_ID) return false;
+    if (header.masterHashSize == 0 || header.masterHashSize % SHA256_HASH_SIZE) return false;
+    for (u32 i = 0; i < IVFC_LEVELS; i++) {
+        if (header.levels[i].blockSize < 6 || header.levels[i].blockSize > 24) return false;
+    }
+    offsets[2] = alignUp(IVFC_HEADER_SIZE + header.masterHashSize, blockSize(3));
+    offsets[0] = alignUp(offsets[2] + levelSize(3), blockSize(1));
+    offsets[1] = alignUp(offsets[0] + levelSize(1), blockSize(2));
+    if (offsets[1] + levelSize(2) > src->size()) return false;
+    image = src;
+    return true;
+}
+
+bool IVFCImage::readLevel(u32 level, std::vector<u8> *dest) {
+    dest->resize(levelSize(level));
+    return image->read(levelOffset(level), dest->data(), dest->size());
+}
+
+void IVFCImage::cancel() {
+    cancelled = true;
+    ScopedLock lock(mutex);
+    changed.broadcast();
+}
+
+void IVFCImage::pause(bool on) {
+    ScopedLock lock(mutex);
+    paused = on;
+    changed.broadcast();
+}
+
+// False once cancelled.
+bool IVFCImage::holdWhilePaused() {
+    ScopedLock lock(mutex);
+    while (paused && !cancelled) changed.wait(mutex);
+    return !cancelled;
+}
+
+// Workers pull batches of blocks from a shared counter; a short final block is hashed as if
+// padded with zeroes up to the block size.
+void IVFCImage::verifyThread(void *arg) {
+    Job *job = (Job*)arg;
+    IVFCImage *self = job->self;
+    u32 bsize = self->blockSize(job->level);
+    u64 size = self->levelSize(job->level);
+    std::vector<u8> buffer;
+    while (self->holdWhilePaused()) {
+        u32 first = job->next->fetch_add(job->batch);
+        if (first >= job->count) break;
+        u32 count = std::min(job->batch, job->count - first);
+        u64 offset = (u64)first * bsize;
+        u64 length = std::min((u64)count * bsize, size - offset);
+        // Whole blocks are hashed in place when the image is mapped.
+        const u8 *data = (length == (u64)count * bsize) ? self->image->map(self->levelOffset(job->level) + offset, length) : NULL;
+        if (!data) {
+            buffer.resize((size_t)job->batch * bsize);
+            if (!self->image->read(self->levelOffset(job->level) + offset, buffer.data(), length)) { job->error = true; break; }
+            memset(buffer.data() + length, 0, (size_t)count * bsize - length);
+            data = buffer.data();
+        }
+        for (u32 i = 0; i < count; i++) {
+            u8 hash[SHA256_HASH_SIZE];
+            sha256(data + (size_t)i * bsize, bsize, hash);
+            if (memcmp(hash, job->hashes + (size_t)(first + i) * SHA256_HASH_SIZE, SHA256_HASH_SIZE)) job->failed.push_back(first + i);
+        }
+        if (job->level == 3) self->progress += length;
+    }
+}
+
+bool IVFCImage::verifyLevel(u32 level, const std::vector<u8> &hashes, u32 threads) {
+    u32 bsize = blockSize(level);
+    u32 count = (levelSize(level) + bsize - 1) / bsize;
+    if ((u64)count * SHA256_HASH_SIZE > hashes.size()) return false;
+    std::atomic<u32> next(0);
+    threads = std::max(1u, std::min(threads, (u32)MAX_VERIFY_THREADS));
+    std::vector<Job> jobs(threads);
+    std::vector<Worker> workers(threads);
+    for (u32 i = 0; i < threads; i++) {
+        jobs[i].self = this;
+        jobs[i].next = &next;
+        jobs[i].level = level;
+        jobs[i].count = count;
+        jobs[i].batch = std::max(1u, (u32)(VERIFY_READ_SIZE / bsize));
+        jobs[i].hashes = hashes.data();
+        jobs[i].error = false;
+        if (i > 0) workers[i].start(verifyThread, &jobs[i]);
+    }
+    verifyThread(&jobs[0]);
+    std::vector<u32> failed;
+    bool ok = true;
+    for (u32 i = 0; i < threads; i++) {
+        workers[i].join();
+        failed.insert(failed.end(), jobs[i].failed.begin(), jobs[i].failed.end());
+        ok = ok && !jobs[i].error;
+    }
+    std::sort(failed.begin(), failed.end());
+    for (size_t i = 0; i < failed.size(); i++) {
+        u64 offset = (u64)failed[i] * bsize;
+        u64 size = std::min((u64)bsize, levelSize(level) - offset);
+        if (!bad.empty() && bad.back().level == level && bad.back().offset + bad.back().size == offset) bad.back().size += size;
+        else {
+            ivfc_badrange range = {level, offset, size};
+            bad.push_back(range);
+        }
+    }
+    return ok;
+}
+
+bool IVFCImage::verify(u32 threads) {
+    if (!image) return false;
+    bad.clear();
+    progress = 0;
+    cancelled = false;
+    std::vector<u8> master(header.masterHashSize);
+    std::vector<u8> level1;
+    std::vector<u8> level2;
+    if (!image->read(IVFC_HEADER_SIZE, master.data(), master.size())) return false;
+    if (!readLevel(1, &level1) || !readLevel(2, &level2)) return false;
+    if (!verifyLevel(1, master, 1) || !verifyLevel(2, level1, threads)) return false;
+    std::vector<u8>().swap(level1);
+    return verifyLevel(3, level2, threads) && !cancelled;
+}
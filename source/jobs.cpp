@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+#ifndef _3DS
+#include <chrono>
+#endif
+#include "ivfc.h"
+#include "jobs.h"
+#include "romfs.h"
+
+const queue_options &defaultQueueOptions() {
+    static const queue_options options = {2, 2};
+    return options;
+}
+
+bool loadQueueOptions(const char *path, queue_options *options) {
+    FILE *in = fopen(path, "r");
+    if (!in) return false;
+    char line[128];
+    while (fgets(line, sizeof(line), in)) {
+        char key[64];
+        long value;
+        if (sscanf(line, " %63[a-z_] = %li", key, &value) != 2 || value <= 0) continue;
+        if (!strcmp(key, "priority") && value <= 0x10) options->priority = value;
+        else if (!strcmp(key, "verify_threads") && value <= 4) options->verifyThreads = value;
+    }
+    fclose(in);
+    return true;
+}
+
+static u64 clockMs() {
+#ifdef _3DS
+    return osGetTime();
+#else
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static std::string baseName(const std::string &path) {
+    size_t end = path.find_last_not_of('/');
+    if (end == std::string::npos) return path;
+    size_t slash = path.rfind('/', end);
+    return path.substr(slash == std::string::npos ? 0 : slash + 1, end - (slash == std::string::npos ? 0 : slash + 1) + 1);
+}
+
+// IVFCImage::verify() blocks; this runs it on a thread so it can be followed like the engines.
+class VerifyRun {
+public:
+    VerifyRun(IVFCImage *ivfc, u32 threads) : ivfc(ivfc), threads(threads), ok(false), running(false), cancelled(false) {}
+    bool start() {
+        running = true;
+        if (!worker.start(thread, this)) running = false;
+        return running;
+    }
+    void cancel() {
+        cancelled = true;
+        ivfc->cancel();
+    }
+    void pause(bool paused) { ivfc->pause(paused); }
+    int wait() {
+        worker.join();
+        if (ok) return COPY_DONE;
+        return cancelled ? COPY_CANCELLED : COPY_READ_ERROR;
+    }
+    bool isRunning() const { return running; }
+    u64 getProgress() const { return ivfc->getProgress(); }
+    u64 getSize() const { return ivfc->levelSize(3); }
+private:
+    static void thread(void *arg) {
+        VerifyRun *self = (VerifyRun*)arg;
+        self->ok = self->ivfc->verify(self->threads);
+        self->running = false;
+    }
+    IVFCImage *ivfc;
+    u32 threads;
+    bool ok;
+    std::atomic<bool> running;
+    std::atomic<bool> cancelled;
+    Worker worker;
+};
+
+JobQueue::JobQueue() : options(defaultQueueOptions()), nextId(1), stopping(false), running(0), completed(0) {
+}
+
+JobQueue::~JobQueue() {
+    stop();
+    for (size_t i = 0; i < jobs.size(); i++) {
+        delete jobs[i]->image;
+        delete jobs[i];
+    }
+}
+
+bool JobQueue::start(const queue_options &opts) {
+    options = opts;
+    stopping = false;
+    return worker.start(run, this, options.priority);
+}
+
+void JobQueue::stop() {
+    mutex.lock();
+    stopping = true;
+    for (size_t i = 0; i < jobs.size(); i++) jobs[i]->cancelRequested = true;
+    changed.broadcast();
+    mutex.unlock();
+    worker.join();
+}
+
+u32 JobQueue::add(job *item) {
+    item->started = false;
+    item->pauseRequested = false;
+    item->cancelRequested = false;
+    item->status.state = JOB_QUEUED;
+    item->status.done = 0;
+    item->status.total = 0;
+    item->status.rate = 0;
+    item->status.eta = 0;
+    item->status.result = COPY_IDLE;
+    ScopedLock lock(mutex);
+    item->id = nextId++;
+    jobs.push_back(item);
+    changed.broadcast();
+    return item->id;
+}
+
+u32 JobQueue::addDump(ImageSource *image, const std::string &path, const dump_options &options, bool resume) {
+    job *item = new job();
+    item->type = JOB_DUMP;
+    item->label = "Dump " + baseName(path);
+    item->image = image;
+    item->base = 0;
+    item->dest = path;
+    item->resume = resume;
+    item->dump = options;
+    return add(item);
+}
+
+u32 JobQueue::addExtract(ImageSource *image, u64 base, const std::string &path, const std::string &dest, const extract_options &options) {
+    job *item = new job();
+    item->type = JOB_EXTRACT;
+    item->label = "Extract " + (path == "/" ? path : baseName(path)) + " to " + dest;
+    item->image = image;
+    item->base = base;
+    item->source = path;
+    item->dest = dest;
+    item->resume = false;
+    item->extract = options;
+    return add(item);
+}
+
+u32 JobQueue::addVerify(const std::string &path) {
+    job *item = new job();
+    item->type = JOB_VERIFY;
+    item->label = "Verify " + baseName(path);
+    item->image = NULL;
+    item->base = 0;
+    item->source = path;
+    item->resume = false;
+    return add(item);
+}
+
+u32 JobQueue::addBuild(const std::string &folder, const std::string &path, const build_options &options) {
+    job *item = new job();
+    item->type = JOB_BUILD;
+    item->label = "Build " + baseName(path);
+    item->image = NULL;
+    item->base = 0;
+    item->source = folder;
+    item->dest = path;
+    item->resume = false;
+    item->build = options;
+    return add(item);
+}
+
+int JobQueue::find(u32 id) const {
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (jobs[i]->id == id) return i;
+    }
+    return -1;
+}
+
+u32 JobQueue::getPending() const {
+    u32 count = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (jobs[i]->status.state <= JOB_PAUSED) count++;
+    }
+    return count;
+}
+
+// A running job is paused by the queue thread on its next poll; a waiting one right away.
+void JobQueue::pause(u32 id, bool paused) {
+    ScopedLock lock(mutex);
+    int index = find(id);
+    if (index < 0 || jobs[index]->status.state > JOB_PAUSED) return;
+    job *item = jobs[index];
+    item->pauseRequested = paused;
+    if (!item->started) item->status.state = paused ? JOB_PAUSED : JOB_QUEUED;
+    changed.broadcast();
+}
+
+void JobQueue::cancel(u32 id) {
+    ScopedLock lock(mutex);
+    int index = find(id);
+    if (index < 0 || jobs[index]->status.state > JOB_PAUSED) return;
+    job *item = jobs[index];
+    item->cancelRequested = true;
+    if (item->started) return;
+    delete item->image;
+    item->image = NULL;
+    item->status.result = COPY_CANCELLED;
+    item->status.state = JOB_CANCELLED;
+}
+
+bool JobQueue::move(u32 id, int step) {
+    ScopedLock lock(mutex);
+    int index = find(id);
+    int to = index + step;
+    if (index < 0 || jobs[index]->started || to < 0 || to >= (int)jobs.size() || jobs[to]->started) return false;
+    job *item = jobs[index];
+    jobs.erase(jobs.begin() + index);
+    jobs.insert(jobs.begin() + to, item);
+    return true;
+}
+
+void JobQueue::clearFinished() {
+    ScopedLock lock(mutex);
+    for (size_t i = jobs.size(); i-- > 0;) {
+        if (jobs[i]->status.state <= JOB_PAUSED) continue;
+        delete jobs[i]->image;
+        delete jobs[i];
+        jobs.erase(jobs.begin() + i);
+    }
+}
+
+void JobQueue::run(void *arg) {
+    JobQueue *self = (JobQueue*)arg;
+    self->mutex.lock();
+    while (!self->stopping) {
+        job *item = NULL;
+        for (size_t i = 0; i < self->jobs.size() && !item; i++) {
+            if (self->jobs[i]->status.state == JOB_QUEUED) item = self->jobs[i];
+        }
+        if (!item) {
+            self->changed.wait(self->mutex);
+            continue;
+        }
+        item->started = true;
+        item->status.state = JOB_RUNNING;
+        self->running = item->id;
+        self->mutex.unlock();
+        int result = item->cancelRequested ? COPY_CANCELLED : self->execute(item);
+        delete item->image;
+        item->image = NULL;
+        self->mutex.lock();
+        item->status.result = result;
+        item->status.state = (result == COPY_DONE) ? JOB_DONE : (result == COPY_CANCELLED) ? JOB_CANCELLED : JOB_FAILED;
+        self->running = 0;
+        self->completed++;
+    }
+    self->mutex.unlock();
+}
+
+// Samples progress until op is done, passing pause and cancel requests on to it.
+template <class T> int JobQueue::follow(job *item, T *op) {
+    job_status &status = item->status;
+    bool paused = false;
+    u64 first = op->getProgress();   // resumed dumps start past zero
+    u64 active = 0;
+    u64 last = clockMs();
+    while (op->isRunning()) {
+        if (item->cancelRequested) op->cancel();
+        if (item->pauseRequested != paused) {
+            paused = !paused;
+            op->pause(paused);
+            status.state = paused ? JOB_PAUSED : JOB_RUNNING;
+        }
+        status.done = op->getProgress();
+        status.total = op->getSize();
+        sleepMs(JOB_POLL_MS);
+        u64 now = clockMs();
+        if (!paused) active += now - last;
+        last = now;
+        u64 done = op->getProgress();
+        u64 total = op->getSize();
+        if (active >= 1000 && done > first) {
+            u64 rate = (done - first) * 1000 / active;
+            status.rate = rate;
+            status.eta = (total > done && rate) ? (total - done) / rate : 0;
+        }
+    }
+    int result = op->wait();
+    status.total = op->getSize();
+    status.done = (result == COPY_DONE) ? op->getSize() : op->getProgress();
+    return result;
+}
+
+int JobQueue::execute(job *item) {
+    char note[64];
+    switch (item->type) {
+    case JOB_DUMP: {
+        Dumper dumper;
+        if (!dumper.start(item->image, item->dest, item->dump, item->resume)) { item->note = "Failed to open output file."; return COPY_WRITE_ERROR; }
+        int result = follow(item, &dumper);
+        if (result == COPY_CANCELLED) item->note = "Can be resumed.";
+        return result;
+    }
+    case JOB_EXTRACT: {
+        RomFS romfs;
+        u32 index = romfs.open(item->image, item->base) ? romfs.find(item->source) : ROMFS_NONE;
+        if (index == ROMFS_NONE) { item->note = "Not found in the romfs."; return COPY_READ_ERROR; }
+        Extractor extractor;
+        if (!extractor.start(&romfs, index, item->dest, item->extract)) { item->note = "Failed to create output files."; return COPY_WRITE_ERROR; }
+        int result = follow(item, &extractor);
+        snprintf(note, sizeof(note), "%lu files, %lu unchanged", (unsigned long)extractor.getFilesDone(), (unsigned long)extractor.getSkipped());
+        item->note = note;
+        return result;
+    }
+    case JOB_VERIFY: {
+        std::unique_ptr<ImageSource> image(openImage(item->source.c_str()));
+        IVFCImage ivfc;
+        if (!image || !ivfc.open(image.get())) { item->note = "No IVFC hash tree in this file."; return COPY_READ_ERROR; }
+        VerifyRun verify(&ivfc, options.verifyThreads);
+        if (!verify.start()) { item->note = "Failed to start verification."; return COPY_READ_ERROR; }
+        int result = follow(item, &verify);
+        const std::vector<ivfc_badrange> &bad = ivfc.getBadRanges();
+        if (result == COPY_READ_ERROR) item->note = "Failed to read image.";
+        if (result != COPY_DONE) return result;
+        if (bad.empty()) {
+            item->note = "Image OK.";
+            return COPY_DONE;
+        }
+        snprintf(note, sizeof(note), "CORRUPT: %u bad range(s), first L%lu %010llx", (unsigned)bad.size(), (unsigned long)bad[0].level,
+            (unsigned long long)bad[0].offset);
+        item->note = note;
+        return COPY_READ_ERROR;
+    }
+    case JOB_BUILD: {
+        RomFSBuilder builder;
+        if (!builder.start(item->source, item->dest, item->build)) { item->note = "Failed to read folder or create image."; return COPY_WRITE_ERROR; }
+        int result = follow(item, &builder);
+        snprintf(note, sizeof(note), "%lu folders, %lu files", (unsigned long)builder.getDirCount(), (unsigned long)builder.getFileCount());
+        item->note = note;
+        return result;
+    }
+    }
+    return COPY_READ_ERROR;
+}
@@ -1,55 +1,59 @@
 #include <dirent.h>
 #include <stdio.h>
+#include <strings.h>
 #include <cstring>
 #include <string>
 #include <vector>
 #include <stack>
 #include <algorithm>
 #include <3ds.h>
+#include "build.h"
+#include "copy.h"
+#include "diff.h"
+#include "dump.h"
+#include "extract.h"
+#include "filelist.h"
+#include "image.h"
+#include "ivfc.h"
+#include "jobs.h"
+#include "mount.h"
+#include "perf.h"
+#include "preview.h"
+#include "romfs.h"
+#include "screen.h"
+#include "search.h"
+#include "smdh.h"
 
 PrintConsole top;
 PrintConsole bot;
+TextScreen topScreen(30, 50);
+TextScreen botScreen(30, 40);
 
-Handle romfs_handle;
+MountManager mounts;
+CopyEngine copier;
+JobQueue jobs;
 
-typedef struct {
-	u32 magic;
-	u16 version;
-	u16 reserved;
-} smdhHeader_s;
+Preview preview;
+int previewMount = -1;
+std::string previewName;
+bool iconPending = false;
 
-typedef struct {
-	u16 shortDescription[0x40];
-	u16 longDescription[0x80];
-	u16 publisher[0x40];
-} smdhTitle_s;
+#define PREVIEW_ROW 2
+#define PREVIEW_ROWS 27
+#define ICON_X (400 - SMDH_ICON_SIZE - 4)
 
-typedef struct {
-	u8 gameRatings[0x10];
-	u32 regionLock;
-	u8 matchMakerId[0xC];
-	u32 flags;
-	u16 eulaVersion;
-	u16 reserved;
-	u32 defaultFrame;
-	u32 cecId;
-} smdhSettings_s;
+#define JOB_ROWS 14     // jobs listed at once in the queue, two rows each
+#define JOB_LINE 29     // top screen row showing the running job while browsing
 
-typedef struct {
-	smdhHeader_s header;
-	smdhTitle_s titles[16];
-	smdhSettings_s settings;
-	u8 reserved[0x8];
-	u16 smallIconData[0x240];
-	u16 bigIconData[0x900];
-} smdh_s;
+#define SEARCH_BUDGET 0x8000
+#define SEARCH_MAX 2000
 
 typedef struct {
-    std::string name;
-    std::string path;
-    bool isDir;
-    u64 size;
-} filedata;
+    int mount;
+    search_query query;
+    u32 position;
+    bool done;
+} search_state;
 
 // Modified from https://github.com/Rinnegatamante/lpp-3ds/blob/master/source/include/utils.cpp#L70-L74
 std::string utf2ascii(u16 *src) {
@@ -99,22 +103,37 @@ Result MYFSUSER_OpenFileDirectly(Handle fsuHandle, Handle *out, FS_ArchiveID arc
     return cmdbuf[1];
 }
 
+// Writes out whatever changed in the screen models. The framebuffers are only flushed when
+// something was drawn, so an idle UI just sleeps in gspWaitForVBlank.
+void render() {
+    PERF_SCOPE(PERF_RENDER);
+    consoleSelect(&top);
+    bool drawn = topScreen.flush(stdout);
+    consoleSelect(&bot);
+    drawn = botScreen.flush(stdout) || drawn;
+    if (drawn) {
+        gfxFlushBuffers();
+        gfxSwapBuffers();
+    }
+}
+
 bool promptConfirm(std::string strg) {
     consoleSelect(&top);
     consoleClear();
     printf("\x1b[14;%uH%s", (25 - (strg.size() / 2)), strg.c_str());
     printf("\x1b[16;14H(A) Confirm / (B) Cancel");
+    gfxFlushBuffers();
+    gfxSwapBuffers();
     u32 kDown = 0;
     while (aptMainLoop()) {
         hidScanInput();
         kDown = hidKeysDown();
         if (kDown) break;
-        gfxFlushBuffers();
-        gfxSwapBuffers();
         gspWaitForVBlank();
     }
     consoleClear();
     consoleSelect(&bot);
+    topScreen.invalidate();
     if (kDown & KEY_A) return true;
     else return false;
 }
@@ -123,108 +142,260 @@ void promptError(std::string strg) {
     consoleSelect(&top);
     consoleClear();
     printf("\x1b[14;%uH%s", (25 - (strg.size() / 2)), strg.c_str());
+    gfxFlushBuffers();
+    gfxSwapBuffers();
     while (aptMainLoop()) {
         hidScanInput();
         u32 kDown = hidKeysDown();
         if (kDown) break;
-        gfxFlushBuffers();
-        gfxSwapBuffers();
         gspWaitForVBlank();
     }
     consoleClear();
     consoleSelect(&bot);
+    topScreen.invalidate();
 }
 
-void printSource(bool is3dsx, std::string fname, bool mounted) {
-    consoleSelect(&top);
-    consoleClear();
-    printf("ROMFS STATUS\n");
-    if (!mounted) printf("Not mounted");
-    else if (fname!="") printf("Mounted from file\n%.50s", fname.c_str());
-    else if (is3dsx) {
-        u64 id = 0;
-        APT_GetProgramID(&id);
-        FS_MediaType mediatype;
-        Handle localFsHandle;
-        srvGetServiceHandleDirect(&localFsHandle, "fs:USER");
-        FSUSER_Initialize(localFsHandle);
-        Result ret = MYFSUSER_GetMediaType(localFsHandle, (u8*)&mediatype);
-        if (ret) return;
-        svcCloseHandle(localFsHandle);
-        Handle fileHandle;
-        smdh_s smdh;
-        u32 archivePath[] = {(u32)(id & 0xFFFFFFFF), (u32)(id >> 32), mediatype, 0x00000000};
-        const u32 filePathData[] = {0x00000000, 0x00000000, 0x00000002, 0x6E6F6369, 0x00000000};
-        const FS_Path filePath = (FS_Path) {PATH_BINARY, 0x14, (u8*) filePathData};
-        ret = FSUSER_OpenFileDirectly(&fileHandle, ARCHIVE_SAVEDATA_AND_CONTENT, (FS_Path){PATH_BINARY, 0x10, (u8*) archivePath}, filePath, FS_OPEN_READ, 0);
-        if (ret) return;
-        u32 bytesRead;
-        ret = FSFILE_Read(fileHandle, &bytesRead, 0x0, &smdh, sizeof(smdh_s));
-        FSFILE_Close(fileHandle);
-        if (ret) return;
-        u8 lang = CFG_LANGUAGE_EN;
-        cfguInit();
-        CFGU_GetSystemLanguage(&lang);
-        cfguExit();
-        std::string shortDesc = utf2ascii(smdh.titles[lang].shortDescription);
-        std::string longDesc = utf2ascii(smdh.titles[lang].longDescription);
-        std::string publisher = utf2ascii(smdh.titles[lang].publisher);
-        printf("Mounted from title\n%s\n%s\n%s", shortDesc.c_str(), longDesc.c_str(), publisher.c_str());
+u32 printTitle(u32 row) {
+    u64 id = 0;
+    APT_GetProgramID(&id);
+    FS_MediaType mediatype;
+    Handle localFsHandle;
+    srvGetServiceHandleDirect(&localFsHandle, "fs:USER");
+    FSUSER_Initialize(localFsHandle);
+    Result ret = MYFSUSER_GetMediaType(localFsHandle, (u8*)&mediatype);
+    if (ret) return row;
+    svcCloseHandle(localFsHandle);
+    Handle fileHandle;
+    smdh_s smdh;
+    u32 archivePath[] = {(u32)(id & 0xFFFFFFFF), (u32)(id >> 32), mediatype, 0x00000000};
+    const u32 filePathData[] = {0x00000000, 0x00000000, 0x00000002, 0x6E6F6369, 0x00000000};
+    const FS_Path filePath = (FS_Path) {PATH_BINARY, 0x14, (u8*) filePathData};
+    ret = FSUSER_OpenFileDirectly(&fileHandle, ARCHIVE_SAVEDATA_AND_CONTENT, (FS_Path){PATH_BINARY, 0x10, (u8*) archivePath}, filePath, FS_OPEN_READ, 0);
+    if (ret) return row;
+    u32 bytesRead;
+    ret = FSFILE_Read(fileHandle, &bytesRead, 0x0, &smdh, sizeof(smdh_s));
+    FSFILE_Close(fileHandle);
+    if (ret) return row;
+    u8 lang = CFG_LANGUAGE_EN;
+    cfguInit();
+    CFGU_GetSystemLanguage(&lang);
+    cfguExit();
+    std::string shortDesc = utf2ascii(smdh.titles[lang].shortDescription);
+    std::string longDesc = utf2ascii(smdh.titles[lang].longDescription);
+    std::string publisher = utf2ascii(smdh.titles[lang].publisher);
+    return topScreen.printLines(row, "Mounted from title\n" + shortDesc + "\n" + longDesc + "\n" + publisher);
+}
+
+void printSource() {
+    topScreen.clear();
+    u32 row = topScreen.printLines(0, "ROMFS STATUS");
+    if (!mounts.count()) topScreen.print(row, 0, "Not mounted");
+    for (int i = 0; i < mounts.count(); i++) {
+        topScreen.print(++row, 0, mounts.root(i) + (mounts.isLoaded(i) ? "" : " (not cached)"));
+        if (mounts.label(i)!="") row = topScreen.printLines(row + 1, "Mounted from file\n" + mounts.label(i));
+        else row = printTitle(row + 1);
     }
-    consoleSelect(&bot);
-    consoleClear();
+    botScreen.clear();
 }
 
-void printHelp(bool selected, bool is3dsx, bool mounted, u8 source) {
-    consoleSelect(&top);
-    consoleClear();
-    if (selected) printf("D-PAD: Navigate\nA: Select\nB: Go back\nL: Show help\nR: Show clipboard\nY: %s", (source==0 ? "Copy files to this folder" : "Copy files to clipboard"));
-    else printf("D-PAD: Navigate\nA: Select\nL: Show help\nSTART: Quit\n%s\n%s", (mounted ? "SELECT: Unmount romfs" : (is3dsx ? "SELECT: Remount romfs from title" : " ")), (is3dsx ? "Y: Dump romfs" : " "));
-    consoleSelect(&bot);
+void printHelp(bool selected, bool is3dsx, bool mounted, u32 source) {
+    topScreen.clear();
+    if (selected) topScreen.printLines(0, std::string("D-PAD: Navigate\nA: Select\nB: Go back\nL: Show help\nR: Show clipboard\nY: ") + (source==0 ? "Copy files to this folder" : "Copy files to clipboard") + "\nTouch path: Go to path\n" + (source==0 ? "SELECT: Verify romfs image\nSELECT on a folder: Build romfs image\nA on a .txt list: Export patch" : "RIGHT: Search romfs\nA on a file: Preview"));
+    else topScreen.printLines(0, std::string("D-PAD: Navigate\nA: Select\nL: Show help\nSTART: Quit\n") + (mounted ? "SELECT: Unmount romfs\nRIGHT: Compare with another romfs" : (is3dsx ? "SELECT: Remount romfs from title" : " ")) + "\n" + (is3dsx ? "Y: Dump romfs from title" : " ") + "\nX: Show job queue");
 }
 
-void sortFileList(std::vector<filedata> *filelist) {
-    struct abc {
-        inline bool operator() (filedata a, filedata b) {
-            if(a.isDir == b.isDir)
-                return strcasecmp(a.name.c_str(), b.name.c_str()) < 0;
-            else return a.isDir;
-        }
-    } alphabetically;
-    std::sort((*filelist).begin(), (*filelist).end(), alphabetically);
-}
-
-bool isDirectory(std::string path) {
-    bool result = false;
-    DIR *dir = opendir(path.c_str());
-    if (dir) result = true;
-    closedir(dir);
-    return result;
-}
-
-bool getFileList(std::vector<filedata> *dest, std::string directory) {
-    std::vector<filedata> result;
-    DIR* dir = opendir(directory.c_str());
-    if(dir == NULL) return false;
-    dirent* ent = NULL;
-    do {
-        ent = readdir(dir);
-        if (ent != NULL) {
-            std::string file(ent->d_name);
-            bool isDir = isDirectory(directory + file + "/");
-            u64 size = 0;
-            if (!isDir) {
-                FILE *tmp = fopen((directory + file).c_str(), "r");
-                fseek(tmp, 0L, SEEK_END);
-                size = ftell(tmp);
-                fclose(tmp);
-            }
-            if ((file!=".") && (file!="..")) result.push_back({file, directory + file, isDir, size});
+#ifdef PERF
+#define PERF_ROW 20
+
+// Counters since the overlay was shown, redrawn every frame over whatever the top screen holds.
+void printPerf() {
+    topScreen.print(PERF_ROW, 0, "counter  calls  avg ms  max ms     bytes", 0, 50);
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        perf_counter counter = perfGet(i);
+        double avg = counter.calls ? perfMs(counter.ticks) / counter.calls : 0;
+        topScreen.printf(PERF_ROW + 1 + i, 0, "%-7s %6llu %7.2f %7.2f %9llu", counter.name, (unsigned long long)counter.calls, avg,
+            perfMs(counter.maxTicks), (unsigned long long)counter.bytes);
+    }
+    cache_stats cache = mounts.cacheStats();
+    topScreen.printf(PERF_ROW + 1 + PERF_COUNTERS, 0, "blocks  hit %llu miss %llu ahead %llu/%llu big %llu", (unsigned long long)cache.hits,
+        (unsigned long long)cache.misses, (unsigned long long)cache.prefetchHits, (unsigned long long)cache.prefetched, (unsigned long long)cache.bypassed);
+}
+
+void clearPerf() {
+    for (int i = PERF_ROW; i <= PERF_ROW + PERF_COUNTERS + 1; i++) topScreen.clearRow(i);
+}
+#endif
+
+// Column that centers len characters on the top screen.
+u32 centered(u32 len) {
+    return (len < 50) ? (50 - len) / 2 : 0;
+}
+
+void printMenu(u32 cursor) {
+    botScreen.clear();
+    botScreen.print(1, 2, "SD");
+    if (!mounts.count()) botScreen.print(2, 2, "ROMFS");
+    for (int i = 0; i < mounts.count(); i++) botScreen.print(2 + i, 2, mounts.root(i));
+    botScreen.print(1 + cursor, 0, ">");
+    botScreen.print(29, 0, "Press L for help");
+}
+
+bool getRomFSHandle(Handle *file_handle);
+
+// The title's romfs is always mounted as romfs:/, images from the SD card as sd1:/ to sd8:/.
+// Chunk sizes are calibrated per route (see ChunkTuner); everything is written to the SD card.
+std::string titleRoute() {
+    FS_MediaType media = MEDIATYPE_SD;
+    FSUSER_GetMediaType(&media);
+    if (media == MEDIATYPE_GAME_CARD) return "title-card>sd";
+    return (media == MEDIATYPE_NAND) ? "title-nand>sd" : "title-sd>sd";
+}
+
+std::string mountRoute(int id) {
+    return (mounts.label(id) == "") ? titleRoute() : "sd>sd";
+}
+
+// An update replaces the title's romfs under the same program ID, so the versions and sizes of
+// both go into the index cache key; 0 for whatever isn't installed.
+void titleVersion(u64 id, u64 *version, u64 *size) {
+    FS_MediaType media = MEDIATYPE_SD;
+    FSUSER_GetMediaType(&media);
+    u64 update = (id & 0xFFFFFFFFULL) | 0x0004000E00000000ULL;
+    AM_TitleEntry info;
+    *version = 0;
+    *size = 0;
+    if (AM_GetTitleInfo(media, 1, &id, &info) == 0) {
+        *version = info.version;
+        *size = info.size;
+    }
+    if (AM_GetTitleInfo(MEDIATYPE_SD, 1, &update, &info) == 0) {
+        *version |= (u64)info.version << 16;
+        *size += info.size;
+    }
+}
+
+bool mountTitle() {
+    Handle handle;
+    if (!getRomFSHandle(&handle)) return false;
+    u64 id = 0;
+    APT_GetProgramID(&id);
+    u64 version, size;
+    titleVersion(id, &version, &size);
+    mount_key key;
+    titleKey(id, version, size, &key);
+    return mounts.mount("romfs", "", new FSImage(handle, true), 0x0, id ? &key : NULL) >= 0;
+}
+
+void mountFile(std::string path) {
+    if (mounts.findLabel(path) >= 0) { promptError("Already mounted as " + mounts.root(mounts.findLabel(path))); return; }
+    if (mounts.count() >= MOUNT_MAX) { promptError("Too many romFS mounts."); return; }
+    u32 magic = 0x0;
+    ImageSource *image = openImage(path.c_str());
+    if (!image) { promptError("Couldn't not open file."); return; }
+    image->read(0x0, &magic, 0x4);
+    // IVFC wrapped images (dumps, built images) have level 3 at 0x1000; bare level 3 starts with its header size.
+    u64 base = (magic == sizeof(romfs_header)) ? 0x0 : 0x1000;
+    if (magic!=0x43465649 && magic!=sizeof(romfs_header)) {
+        delete image;
+        promptError("Not a valid romFS file.");
+        return;
+    }
+    char name[8];
+    for (u32 i = 1; i <= MOUNT_MAX; i++) {
+        sprintf(name, "sd%lu", i);
+        if (mounts.find(name) < 0) break;
+    }
+    mount_key key;
+    bool keyed = fileKey(path, image, &key);
+    if (mounts.mount(name, path, image, base, keyed ? &key : NULL) < 0) promptError("Couldn't not mount romFS from file.");
+}
+
+// Scans the next SEARCH_BUDGET names of the mount's search index, appending matches to list.
+bool searchStep(search_state *search, FileList *list) {
+    const RomFS *fs = mounts.acquire(search->mount);
+    const SearchIndex *index = mounts.searchIndex(search->mount);
+    std::vector<u32> found;
+    if (!fs || !index) search->done = true;
+    else {
+        search->done = index->search(search->query, &search->position, SEARCH_BUDGET, &found);
+        if (list->size() + found.size() >= SEARCH_MAX) {
+            found.resize(SEARCH_MAX - list->size());
+            search->done = true;
         }
-    } while (ent != NULL);
-    closedir(dir);
-    sortFileList(&result);
-    dest->swap(result);
+        std::string root = mounts.root(search->mount);
+        list->addEntries(fs, root.substr(0, root.size() - 1), found.data(), found.size());
+    }
+    mounts.release(search->mount);
+    return search->done;
+}
+
+// Search results are listed as "<mount>:/?<query>"; results are normally streamed in by the
+// main loop, this runs the whole search when such a listing has to be rebuilt.
+bool getFileList(FileList *dest, std::string directory) {
+    PERF_SCOPE(PERF_LIST);
+    int id = mounts.resolve(directory, NULL);
+    size_t query = directory.find('?');
+    if (id >= 0 && query != std::string::npos) {
+        search_state search = {id, search_query(), 0, false};
+        if (!parseQuery(directory.substr(query + 1), &search.query)) return false;
+        dest->clear();
+        while (!searchStep(&search, dest));
+        return true;
+    } else if (id >= 0) {
+        const RomFS *fs = mounts.acquire(id);
+        bool ok = fs && dest->assign(fs, directory);
+        mounts.release(id);
+        return ok;
+    }
+    return dest->scan(directory);
+}
+
+// Switches the listing to directory; the one being left is cached with its cursor position.
+void changeDirectory(ListingCache *cache, FileList *list, std::string *curdir, std::string directory, u32 *cursor, u32 *scroll) {
+    cache->store(*curdir, list, *cursor, *scroll);
+    *curdir = directory;
+    if (!cache->restore(directory, list, cursor, scroll)) {
+        if (!getFileList(list, directory)) promptError("Failed to scan current directory.");
+        *cursor = 0; *scroll = 0;
+    }
+}
+
+bool promptInput(std::string hint, std::string initial, std::string *dest) {
+    SwkbdState swkbd;
+    char input[0x300];
+    swkbdInit(&swkbd, SWKBD_TYPE_NORMAL, 2, sizeof(input) - 1);
+    swkbdSetInitialText(&swkbd, initial.c_str());
+    swkbdSetHintText(&swkbd, hint.c_str());
+    SwkbdButton button = swkbdInputText(&swkbd, input, sizeof(input));
+    // The keyboard applet draws over both screens.
+    topScreen.invalidate();
+    botScreen.invalidate();
+    if (button != SWKBD_BUTTON_CONFIRM) return false;
+    *dest = input;
+    return true;
+}
+
+// Asks for a directory inside rootdir and checks that it exists; paths are relative to rootdir.
+bool promptPath(std::string rootdir, std::string curdir, std::string *dest) {
+    std::string path;
+    if (curdir.find('?') != std::string::npos) curdir = rootdir;
+    if (!promptInput("Go to path", curdir.substr(rootdir.size() - 1), &path)) return false;
+    if (path.empty() || path[0] != '/') path = "/" + path;
+    if (path[path.size() - 1] != '/') path += "/";
+    std::string inner;
+    int id = mounts.resolve(rootdir, &inner);
+    bool found = false;
+    if (id >= 0) {
+        const RomFS *fs = mounts.acquire(id);
+        u32 index = fs ? fs->find(path) : ROMFS_NONE;
+        found = (index != ROMFS_NONE && fs->entry(index).isDir);
+        mounts.release(id);
+    } else {
+        struct stat st;
+        found = (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+    }
+    if (!found) { promptError("Directory not found."); return false; }
+    *dest = rootdir + path.substr(1);
     return true;
 }
 
@@ -235,67 +406,231 @@ bool fileExists(std::string fname) {
     } else return false;
 }
 
-void printFiles(u32 cursor, u32 scroll, u32 count, std::vector<filedata> *files, std::string curdir) {
-    consoleSelect(&top);
-    consoleClear();
-    if (cursor>0) {
-        printf("\x1b[0;0H%.50s", (*files)[cursor+scroll-1].name.c_str());
-        if ((*files)[cursor+scroll-1].isDir) printf("\x1b[1;0HDIR");
+// Path lists for patch exports, comparison reports included.
+bool isListFile(std::string fname) {
+    return fname.size() > 4 && !strcasecmp(fname.c_str() + fname.size() - 4, ".txt");
+}
+
+void printFiles(u32 cursor, u32 scroll, u32 count, FileList *files, std::string curdir) {
+    files->prepare(scroll, 28);
+    if (!preview.isOpen()) topScreen.clear();
+    if (cursor>0 && !preview.isOpen()) {
+        filedata file = files->get(cursor+scroll-1);
+        topScreen.print(0, 0, file.name);
+        if (file.isDir) topScreen.print(1, 0, "DIR");
         else {
-            printf("\x1b[1;0HFILE");
-            printf("\x1b[2;0H%llu bytes", (*files)[cursor+scroll-1].size);
+            topScreen.print(1, 0, "FILE");
+            topScreen.printf(2, 0, "%llu bytes", file.size);
         }
     }
-    consoleSelect(&bot);
-    bool isroot = ((curdir=="/") || (curdir=="romfs:/"));
-    if (curdir.size() <= 40) printf("\x1b[0;0H%-40s", curdir.c_str());
-    else printf("\x1b[0;0H%.37s...", curdir.c_str());
-    printf("\x1b[%lu;0H> ", 1 + cursor);
+    bool isroot = ((curdir=="/") || (curdir.find(":/")==curdir.size()-2));
+    if (curdir.size() <= 40) botScreen.print(0, 0, curdir, 0, 40);
+    else botScreen.print(0, 0, curdir.substr(0, 37) + "...");
+    for (u32 i = 0; i < 29; i++) botScreen.print(1 + i, 0, (i == cursor) ? "> " : "  ");
     u32 i = 0;
     while (i < count) {
         if (i > 27) break;
-        u32 len = (*files)[i+scroll].name.size();
-        if (len > 38) {
-            if ((*files)[i+scroll].isDir) printf("\x1b[%lu;2H\x1b[33m%.35s...\x1b[0m", 2 + i, (*files)[i+scroll].name.c_str());
-            else printf("\x1b[%lu;2H%.35s...", 2 + i, (*files)[i+scroll].name.c_str());
-        } else {
-            if ((*files)[i+scroll].isDir) printf("\x1b[%lu;2H\x1b[33m%-38s\x1b[0m", 2 + i, (*files)[i+scroll].name.c_str());
-            else printf("\x1b[%lu;2H%-38s", 2 + i, (*files)[i+scroll].name.c_str());
-        }
+        filedata file = files->get(i+scroll);
+        if (file.name.size() > 38) file.name = file.name.substr(0, 35) + "...";
+        botScreen.print(2 + i, 2, file.name, file.isDir ? 33 : 0, 38);
         i++;
     }
     while (i < 28) {
-        printf("\x1b[%lu;2H%-38c", 2 + i, ' ');
+        botScreen.print(2 + i, 2, "", 0, 38);
         i++;
     }
-    if (isroot) printf("\x1b[1;2H\x1b[35m%-38s\x1b[0m", "[root]");
-    else printf("\x1b[1;2H\x1b[37m%-38s\x1b[0m", "..");
+    if (isroot) botScreen.print(1, 2, "[root]", 35, 38);
+    else botScreen.print(1, 2, "..", 37, 38);
+}
+
+// Reads go straight to the mount's image, so the mount stays pinned while the preview is open.
+bool openPreview(const filedata &file) {
+    std::string inner;
+    int id = mounts.resolve(file.path, &inner);
+    if (id < 0 || file.isDir) return false;
+    const RomFS *fs = mounts.acquire(id);
+    u32 index = fs ? fs->find(inner) : ROMFS_NONE;
+    if (index == ROMFS_NONE) { mounts.release(id); return false; }
+    preview.open(fs->source(), fs->entry(index).offset, fs->entry(index).size);
+    previewMount = id;
+    previewName = file.name;
+    return true;
+}
+
+void closePreview() {
+    preview.close();
+    mounts.release(previewMount);
+    previewMount = -1;
+    // The icon was drawn under the console, repaint every cell over it.
+    topScreen.invalidate();
+}
+
+void printPreview() {
+    std::vector<std::string> lines;
+    bool smdh = (preview.getMode() == PREVIEW_SMDH);
+    bool ok = preview.render(PREVIEW_ROWS, smdh ? (ICON_X / 8) - 1 : 50, &lines);
+    u64 size = preview.getSize();
+    u64 position = preview.getPosition();
+    topScreen.clear();
+    topScreen.print(0, 0, previewName, 0, 50);
+    topScreen.printf(1, 0, "%s%s%s  %llu / %llu (%llu%%)", Preview::modeName(preview.getMode()), preview.getMode() == PREVIEW_TEXT ? " " : "",
+        preview.getMode() == PREVIEW_TEXT ? preview.encoding() : "", position, size, size ? (position * 100) / size : 100);
+    if (!ok) topScreen.print(PREVIEW_ROW, 0, "Failed to read file.");
+    for (size_t i = 0; i < lines.size(); i++) topScreen.print(PREVIEW_ROW + i, 0, lines[i]);
+    topScreen.print(29, 0, "B:Close  LEFT/RIGHT:Mode  UP/DOWN:Page  L/R:Ends");
+    iconPending = ok && smdh;
+}
+
+// Straight into the top framebuffer, which the console doesn't double buffer; the text model
+// leaves those cells blank while an SMDH is shown.
+void drawIcon() {
+    u16 pixels[SMDH_ICON_SIZE * SMDH_ICON_SIZE];
+    iconPending = false;
+    if (!preview.readIcon(pixels)) return;
+    u16 *fb = (u16*)gfxGetFramebuffer(GFX_TOP, GFX_LEFT, NULL, NULL);
+    for (u32 y = 0; y < SMDH_ICON_SIZE; y++) {
+        for (u32 x = 0; x < SMDH_ICON_SIZE; x++) fb[(ICON_X + x) * 240 + (239 - (PREVIEW_ROW * 8 + y))] = pixels[y * SMDH_ICON_SIZE + x];
+    }
+    gfxFlushBuffers();
+}
+
+// Mount names are reused, so entries of an unmounted romfs would later resolve to another image.
+void dropMount(std::vector<filedata> *clipboard, const std::string &root) {
+    for (size_t i = clipboard->size(); i-- > 0;) {
+        if ((*clipboard)[i].path.compare(0, root.size(), root) == 0) clipboard->erase(clipboard->begin() + i);
+    }
 }
 
 void printClipboard(std::vector<filedata> *clipboard) {
-    consoleSelect(&top);
-    consoleClear();
+    topScreen.clear();
     u32 i = 0;
     while (i < clipboard->size()) {
         if (i > 29) break;
-        printf("\x1b[%lu;0H%.50s", i, (*clipboard)[i].path.c_str());
+        topScreen.print(i, 0, (*clipboard)[i].path);
         i++;
     }
-    consoleSelect(&bot);
 }
 
-bool copyClipboard(std::vector<filedata> *source, std::string dest) {
+// Shows progress until the extractor is done; the ETA is taken from the throughput so far.
+int waitExtractor(Extractor *extractor, std::string title) {
+    topScreen.print(13, centered(title.size()), title.substr(0, 50));
+    u64 started = osGetTime();
+    while (extractor->isRunning()) {
+        hidScanInput();
+        if ((hidKeysHeld() & KEY_B) && promptConfirm("Cancel operation?")) extractor->cancel();
+        u64 size = extractor->getProgress();
+        u64 fsize = extractor->getSize();
+        u64 elapsed = osGetTime() - started;
+        topScreen.printf(14, 15, "%lu / %lu files", extractor->getFilesDone(), extractor->getFileCount());
+        topScreen.printf(15, 12, "%llu b / %llu b (%llu%%)", size, fsize, fsize ? (size * 100) / fsize : 100);
+        if (size && elapsed >= 1000) {
+            u64 left = (fsize - size) * elapsed / size / 1000;
+            topScreen.printf(16, 12, "%llu KB/s, %llu:%02llu left   ", size / elapsed, left / 60, left % 60);
+        }
+        if (extractor->getSkipped()) topScreen.printf(17, 15, "%lu unchanged", extractor->getSkipped());
+        render();
+        gspWaitForVBlank();
+    }
+    int status = extractor->wait();
+    if (status == COPY_READ_ERROR) promptError("Error reading file.");
+    else if (status == COPY_WRITE_ERROR) promptError("Error copying file.");
+    return status;
+}
+
+// Jobs read through a handle of their own, so the mount can be browsed, or even unmounted,
+// while they run.
+ImageSource *openMountImage(int id) {
+    Handle handle;
+    if (mounts.label(id) != "") return openImage(mounts.label(id).c_str());
+    return getRomFSHandle(&handle) ? new FSImage(handle, true) : NULL;
+}
+
+// Writes files of mount id into a directory laid out like the romfs, ready to be used as a
+// LayeredFS patch (copied to /luma/titles/<title id>/romfs). Asks for the directory.
+void exportPatch(int id, const std::vector<u32> &files) {
+    std::string dest;
+    if (files.empty()) { promptError("No files to export."); return; }
+    if (!promptInput("Patch directory", "/3ds/data/romfs_explorer/patch-" + mounts.name(id), &dest) || dest.empty()) return;
+    struct stat st;
+    if (stat(dest.c_str(), &st) == 0 && !promptConfirm("Overwrite files in " + dest + "?")) return;
+    const RomFS *fs = mounts.acquire(id);
+    extract_options options = defaultExtractOptions();
+    options.route = mountRoute(id);
+    Extractor extractor;
+    topScreen.clear();
+    if (!fs || !extractor.start(fs, files, dest, options)) promptError("Failed to create output files.");
+    else if (waitExtractor(&extractor, "Exporting patch from " + mounts.root(id)) == COPY_DONE) promptError("Patch exported.");
+    if (fs) mounts.release(id);
+}
+
+// Exports the files named in a list file (or a comparison report) from a mount.
+void exportList(std::string path) {
+    std::vector<std::string> paths;
+    std::string name;
+    if (!mounts.count()) { promptError("RomFS not mounted."); return; }
+    if (!loadPathList(path, &paths) || paths.empty()) { promptError("No paths in this file."); return; }
+    if (!promptInput("Export listed files from", mounts.name(0), &name)) return;
+    if (name.find(':') != std::string::npos) name.erase(name.find(':'));
+    int id = mounts.find(name);
+    if (id < 0) { promptError("No romfs mounted as " + name + "."); return; }
+    const RomFS *fs = mounts.acquire(id);
+    std::vector<u32> files;
+    u32 missing = fs ? selectFiles(fs, paths, &files) : paths.size();
+    if (fs) mounts.release(id);
+    char prompt[64];
+    snprintf(prompt, sizeof(prompt), "%lu listed path(s) not found. Continue?", (unsigned long)missing);
+    if (!missing || promptConfirm(prompt)) exportPatch(id, files);
+}
+
+// Romfs entries are queued as extraction jobs (see JobQueue) and counted in queued; files from
+// the SD card are copied right away.
+bool copyClipboard(std::vector<filedata> *source, std::string dest, u32 *queued) {
     u32 i = source->size();
     while (source->size() != 0) {
         i--;
         hidScanInput();
         u32 kHeld = hidKeysHeld();
         if ((kHeld & KEY_B) && (promptConfirm("Cancel operation?"))) break;
-        if ((*source)[i].isDir) {
-            std::vector<filedata> contents;
-            if (getFileList(&contents, (*source)[i].path + "/")) {
+        std::string inner;
+        int id = mounts.resolve((*source)[i].path, &inner);
+        if (id >= 0) {
+            const RomFS *fs = mounts.acquire(id);
+            u32 index = fs ? fs->find(inner) : ROMFS_NONE;
+            mounts.release(id);
+            struct stat st;
+            bool exists = (stat((dest + (*source)[i].name).c_str(), &st) == 0);
+            bool incremental = exists && fileExists(dest + (*source)[i].name + "/" + MANIFEST_NAME)
+                && promptConfirm("Only update changed files in " + (*source)[i].name + "?");
+            bool trustOffsets = incremental && promptConfirm("Trust unmoved files without comparing them?");
+            bool removeStale = incremental && promptConfirm("Also delete files no longer in the romfs?");
+            std::string prompt = (*source)[i].isDir ? "Overwrite files in " : "Overwrite file ";
+            int status = COPY_DONE;
+            if (index == ROMFS_NONE) { promptError("Error opening file."); status = COPY_READ_ERROR; }
+            else if (!exists || incremental || promptConfirm(prompt + (*source)[i].name + "?")) {
+                extract_options options = defaultExtractOptions();
+                options.incremental = incremental;
+                options.trustOffsets = trustOffsets;
+                options.removeStale = removeStale;
+                options.route = mountRoute(id);
+                ImageSource *image = openMountImage(id);
+                if (!image) { promptError("Error opening romfs."); status = COPY_READ_ERROR; }
+                else {
+                    jobs.addExtract(image, mounts.base(id), inner, dest, options);
+                    (*queued)++;
+                }
+            }
+            if (status != COPY_DONE) break;
+        } else if ((*source)[i].path.find(":/") != std::string::npos) {
+            promptError("RomFS not mounted.");
+            break;
+        } else if ((*source)[i].isDir) {
+            FileList list;
+            if (getFileList(&list, (*source)[i].path + "/")) {
+                std::vector<filedata> contents;
+                contents.reserve(list.size());
+                for (u32 j = 0; j < list.size(); j++) contents.push_back(list.get(j));
                 mkdir((dest + (*source)[i].name).c_str(), 0777);
-                copyClipboard(&contents, dest + (*source)[i].name + "/");
+                if (!copyClipboard(&contents, dest + (*source)[i].name + "/", queued)) break;
             }
         } else {
             bool exists = fileExists(dest + (*source)[i].name);
@@ -305,28 +640,32 @@ bool copyClipboard(std::vector<filedata> *source, std::string dest) {
             else {
                 FILE *dst = fopen((dest + (*source)[i].name).c_str(), "wb");
                 FILE *src = fopen((*source)[i].path.c_str(), "rb");
+                int status = COPY_IDLE;
                 if (src && dst) {
-                    consoleSelect(&top);
-                    consoleClear();
-                    printf("\x1b[14;%uHCopying %.42s", (25 - ((*source)[i].path.size() / 2)), (*source)[i].path.c_str());
-                    gfxFlushBuffers();
-                    gfxSwapBuffers();
-                    gspWaitForVBlank();
-                    char *buffer = (char*)malloc(0x50000);
-                    while (!feof(src)) {
-                        size_t rsize = fread(buffer, 1, 0x50000, src);
-                        if (rsize==0) { promptError("Error reading file."); break; }
-                        size += fwrite(buffer, 1, rsize, dst);
-                        printf("\x1b[15;12H%zu b / %zu b (%zu%%)", size, fsize, (size * 100) / fsize);
-                        gfxFlushBuffers();
-                        gfxSwapBuffers();
-                        gspWaitForVBlank();
+                    std::string label = "Copying " + (*source)[i].path.substr(0, 42);
+                    topScreen.clear();
+                    topScreen.print(14, centered(label.size()), label);
+                    FileReader reader(src);
+                    FileWriter writer(dst);
+                    copier.setRoute("sd>sd", fsize);
+                    if (copier.start(&reader, &writer)) {
+                        // The engine reads and writes on its own threads; this loop only samples progress.
+                        while (copier.isRunning()) {
+                            hidScanInput();
+                            if ((hidKeysHeld() & KEY_B) && promptConfirm("Cancel operation?")) copier.cancel();
+                            size = copier.getProgress();
+                            topScreen.printf(15, 12, "%zu b / %zu b (%zu%%)", size, fsize, fsize ? (size * 100) / fsize : 100);
+                            render();
+                            gspWaitForVBlank();
+                        }
                     }
-                    if (size < fsize) promptError("Error copying file.");
-                    free(buffer);
+                    status = copier.wait();
+                    if (status == COPY_READ_ERROR) promptError("Error reading file.");
+                    else if (status == COPY_WRITE_ERROR || (status == COPY_DONE && copier.getProgress() < fsize)) promptError("Error copying file.");
                 } else promptError("Error opening file.");
-                fclose(src);
-                fclose(dst);
+                if (src) fclose(src);
+                if (dst) fclose(dst);
+                if (status == COPY_CANCELLED) break;
             }
         }
         source->pop_back();
@@ -353,58 +692,157 @@ bool getRomFSHandle(Handle *file_handle) {
     return true;
 }
 
+// Queues a dump of the title's romfs; an interrupted or cancelled dump can be resumed later.
 bool dumpRomFS() {
-    bool success = false;
-    char arch_path[] = "";
-    char low_path[0xC];
-    memset(low_path, 0, sizeof(low_path));
-    Handle fs_handle;
     Handle file_handle;
-    srvGetServiceHandleDirect(&fs_handle, "fs:USER");
-    FSUSER_Initialize(fs_handle);
-    Result ret = MYFSUSER_OpenFileDirectly(fs_handle, &file_handle, ARCHIVE_ROMFS, (FS_Path){PATH_EMPTY, 1, (u8*)arch_path}, (FS_Path){PATH_BINARY, sizeof(low_path), (u8*)low_path}, FS_OPEN_READ, 0);
-    if (ret!=0) promptError("Failed to open romfs file.");
+    if (!getRomFSHandle(&file_handle)) { promptError("Failed to open romfs file."); return false; }
+    u64 id = 0;
+    APT_GetProgramID(&id);
+    char fname[25];
+    char fpath[51];
+    sprintf(fname, "%016llx.romfs", id);
+    sprintf(fpath, "/3ds/data/romfs_explorer/%s", fname);
+    bool exists = fileExists(std::string(fpath));
+    bool resume = Dumper::hasCheckpoint(fpath) && promptConfirm("Resume interrupted dump?");
+    if (!resume && exists && !promptConfirm("Overwrite file " + std::string(fname) + "?")) {
+        FSFILE_Close(file_handle);
+        return false;
+    }
+    dump_options options = defaultDumpOptions();
+    options.route = titleRoute();
+    loadDumpOptions("/3ds/data/romfs_explorer/dump.cfg", &options);
+    jobs.addDump(new FSImage(file_handle, true), fpath, options, resume);
+    return true;
+}
+
+// The hash tree check runs as a job; its result shows in the job queue.
+void verifyImage(std::string path) {
+    jobs.addVerify(path);
+    promptError("Verification queued.");
+}
+
+// Packs an SD card folder into "<folder>.romfs", an IVFC wrapped image that mounts like a dump.
+bool buildImage(std::string folder) {
+    std::string path = folder + ".romfs";
+    if (fileExists(path) && !promptConfirm("Overwrite " + path.substr(path.rfind('/') + 1) + "?")) return false;
+    build_options options = defaultBuildOptions();
+    options.route = "sd>sd";
+    jobs.addBuild(folder, path, options);
+    return true;
+}
+
+// Two rows per job: the label, then its state with progress, or how it ended.
+void printJob(u32 row, const job &item, bool current) {
+    static const char *states[] = {"Queued", "Running", "Paused", "Done", "Failed", "Cancelled"};
+    int state = item.status.state;
+    u64 done = item.status.done;
+    u64 total = item.status.total;
+    u32 eta = item.status.eta;
+    topScreen.print(row, 0, std::string(current ? "> " : "  ") + item.label, current ? 33 : 0, 50);
+    if (state > JOB_PAUSED) topScreen.print(row + 1, 4, std::string(states[state]) + " " + item.note, 0, 46);
+    else if (!done) topScreen.print(row + 1, 4, states[state], 0, 46);
+    else topScreen.printf(row + 1, 4, "%-8s%3llu%% %6lu KB/s %3lu:%02lu left", states[state], total ? (done * 100) / total : 0,
+        (unsigned long)(item.status.rate / 1024), (unsigned long)(eta / 60), (unsigned long)(eta % 60));
+}
+
+// One line at the bottom of the top screen for the job being run, redrawn every frame.
+void printJobLine() {
+    int index = jobs.find(jobs.getRunning());
+    u32 pending = jobs.getPending();
+    char line[64];
+    if (index < 0) snprintf(line, sizeof(line), "%lu job(s) waiting", (unsigned long)pending);
     else {
-        u64 id = 0;
-        APT_GetProgramID(&id);
-        char fname[25];
-        char fpath[51];
-        sprintf(fname, "%016llx.romfs", id);
-        sprintf(fpath, "/3ds/data/romfs_explorer/%s", fname);
-        bool exists = fileExists(std::string(fpath));
-        u64 fsize = 0;
-        u64 offset = 0;
-        FSFILE_GetSize(file_handle, &fsize);
-        if (!exists || promptConfirm("Overwrite file " + std::string(fname) + "?")) {
-            consoleSelect(&top);
-            consoleClear();
-            printf("\x1b[14;18HDumping romfs");
-            char header[0x1000] = "IVFC";
-            memset(header + 4, 0, 0xFFC);
-            FILE *dst = fopen(fpath, "wb");
-            fwrite(header, 1, 0x1000, dst);
-            char *buffer = (char*)malloc(0x100000);
-            u32 bufsiz = 0x100000;
-            while (offset != fsize) {
-                u32 rsize;
-                ret = FSFILE_Read(file_handle, &rsize, offset, buffer, bufsiz);
-                if (ret != 0 || rsize==0) { promptError("Failed to read from romfs file."); break; }
-                size_t wsize = fwrite(buffer, sizeof(char), rsize, dst);
-                if (wsize < rsize) { promptError("Failed to write to output file."); break; }
-                offset += rsize;
-                printf("\x1b[15;13H%llu b / %llu b (%llu%%)", offset, fsize, (offset * 100) / fsize);
-                gfxFlushBuffers();
-                gfxSwapBuffers();
+        const job &item = jobs.get(index);
+        u64 done = item.status.done;
+        u64 total = item.status.total;
+        if (pending > 1) snprintf(line, sizeof(line), "%3llu%% %-37.37s (+%lu)", total ? (done * 100) / total : 0, item.label.c_str(), (unsigned long)(pending - 1));
+        else snprintf(line, sizeof(line), "%3llu%% %s", total ? (done * 100) / total : 0, item.label.c_str());
+    }
+    topScreen.print(JOB_LINE, 0, line, 0, 50);
+}
+
+// The jobs keep running while the queue is shown.
+void manageJobs() {
+    u32 cursor = 0;
+    u32 scroll = 0;
+    botScreen.clear();
+    botScreen.printLines(0, "JOB QUEUE\n\nUP/DOWN: Select\nA: Pause / resume\nY: Cancel job\nL/R: Move job up / down\nX: Clear finished jobs\nB: Back");
+    while (aptMainLoop()) {
+        hidScanInput();
+        u32 kDown = hidKeysDown();
+        if (kDown & KEY_B) break;
+        if (jobs.count()) {
+            const job &item = jobs.get(cursor);
+            u32 id = item.id;
+            if ((kDown & KEY_DOWN) && cursor + 1 < jobs.count()) cursor++;
+            if ((kDown & KEY_UP) && cursor > 0) cursor--;
+            if (kDown & KEY_A) jobs.pause(id, !item.pauseRequested);
+            if ((kDown & KEY_Y) && item.status.state <= JOB_PAUSED && promptConfirm("Cancel " + item.label.substr(0, 40) + "?")) jobs.cancel(id);
+            if ((kDown & KEY_L) && jobs.move(id, -1)) cursor--;
+            if ((kDown & KEY_R) && jobs.move(id, 1)) cursor++;
+        }
+        if (kDown & KEY_X) {
+            jobs.clearFinished();
+            cursor = 0;
+        }
+        if (cursor < scroll) scroll = cursor;
+        if (cursor >= scroll + JOB_ROWS) scroll = cursor - JOB_ROWS + 1;
+        topScreen.clear();
+        if (!jobs.count()) topScreen.print(14, 18, "No jobs queued");
+        for (u32 i = scroll; i < jobs.count() && i < scroll + JOB_ROWS; i++) printJob((i - scroll) * 2, jobs.get(i), i == cursor);
+        render();
+        gspWaitForVBlank();
+    }
+    topScreen.clear();
+    botScreen.clear();
+}
+
+// Compares mount older against newer; the full list of changes goes to a report on the SD card.
+void compareMounts(int older, int newer) {
+    const RomFS *a = mounts.acquire(older);
+    const RomFS *b = mounts.acquire(newer);
+    Differ differ;
+    if (!a || !b || !differ.start(a, b)) promptError("Failed to start comparison.");
+    else {
+        topScreen.clear();
+        topScreen.print(14, 0, "Comparing " + mounts.root(older) + " with " + mounts.root(newer));
+        while (differ.isRunning()) {
+            hidScanInput();
+            if ((hidKeysHeld() & KEY_B) && promptConfirm("Cancel comparison?")) differ.cancel();
+            u64 done = differ.getProgress(), size = differ.getSize();
+            topScreen.printf(15, 0, "%llu b / %llu b hashed (%llu%%)", done, size, size ? (done * 100) / size : 100);
+            render();
+            gspWaitForVBlank();
+        }
+        int result = differ.wait();
+        if (result == COPY_CANCELLED) promptError("Comparison cancelled.");
+        else if (result != COPY_DONE) promptError("Failed to read romfs.");
+        else {
+            std::string report = "/3ds/data/romfs_explorer/diff-" + mounts.name(older) + "-" + mounts.name(newer) + ".txt";
+            bool saved = saveDiff(report, differ.getResults());
+            topScreen.clear();
+            u32 row = topScreen.printLines(0, "COMPARISON\n" + mounts.root(older) + " -> " + mounts.root(newer));
+            topScreen.printf(row + 1, 0, "%lu added", (unsigned long)differ.count(DIFF_ADDED));
+            topScreen.printf(row + 2, 0, "%lu removed", (unsigned long)differ.count(DIFF_REMOVED));
+            topScreen.printf(row + 3, 0, "%lu modified", (unsigned long)differ.count(DIFF_MODIFIED));
+            row = topScreen.printLines(row + 5, saved ? "Report saved to\n" + report : std::string("Failed to save report."));
+            topScreen.print(row + 1, 0, "A: Export added and modified files as a patch");
+            topScreen.print(row + 2, 0, "B: Done");
+            render();
+            u32 kDown = 0;
+            while (aptMainLoop() && !(kDown & (KEY_A | KEY_B))) {
+                hidScanInput();
+                kDown = hidKeysDown();
                 gspWaitForVBlank();
             }
-            fclose(dst);
-            free(buffer);
-            success = (offset==fsize);
+            std::vector<u32> files;
+            changedFiles(differ.getResults(), &files);
+            if (kDown & KEY_A) exportPatch(newer, files);
+            topScreen.clear();
         }
     }
-    FSFILE_Close(file_handle);
-    svcCloseHandle(fs_handle);
-    return success;
+    if (a) mounts.release(older);
+    if (b) mounts.release(newer);
 }
 
 int main(int argc, char **argv) {
@@ -420,41 +858,73 @@ int main(int argc, char **argv) {
     u32 scroll = 0;
     u32 count = 0;
     u8 timer = 0;
-    u8 source = 0;
+    u32 source = 0;
+    int active = -1;
     bool is3dsx = false;
     bool selected = false;
-    bool mounted = false;
+    bool sleepBlocked = false;
+    bool jobLine = false;
+    u32 jobsCompleted = 0;
+#ifdef PERF
+    bool overlay = false;
+#endif
     int easteregg[2] = {0};
-    std::string romfs_file = "";
-    std::string root[] = {"/", "romfs:/"};
+    std::string rootdir;
     std::string curdir;
     std::stack<std::string> innerpath;
-    std::vector<filedata> filelist;
+    FileList filelist;
+    ListingCache listings;
+    search_state search;
+    bool searching = false;
+    std::string searchdir;
     std::vector<filedata> clipboard;
     mkdir("/3ds", 0777);
     mkdir("/3ds/data", 0777);
     mkdir("/3ds/data/romfs_explorer", 0777);
+    mkdir("/3ds/data/romfs_explorer/index", 0777);
+    mounts.setCacheDir("/3ds/data/romfs_explorer/index/");
+    chunkTuner().load("/3ds/data/romfs_explorer/chunks.cfg");
+    queue_options queueOptions = defaultQueueOptions();
+    loadQueueOptions("/3ds/data/romfs_explorer/jobs.cfg", &queueOptions);
+    if (!jobs.start(queueOptions)) promptError("Failed to start the job queue.");
+#ifdef PERF
+    perfTraceOpen("/3ds/data/romfs_explorer/perf.csv");
+#endif
 
     // romFS initialization
-    is3dsx = getRomFSHandle(&romfs_handle);
-    if (is3dsx) mounted = (romfsInitFromFile(romfs_handle, 0x0)==0);
-    printSource(is3dsx, romfs_file, mounted);
+    is3dsx = mountTitle();
+    printSource();
+    printMenu(cursor);
 
     // main loop
     while (aptMainLoop()) {
         hidScanInput();
         u32 kDown = hidKeysDown();
 
-        if (!selected) {
-            printf("\x1b[1;2HSD\x1b[2;2HROMFS");
-            printf("\x1b[29;0HPress L for help");
-            printf("\x1b[%lu;0H \n>\n ", cursor);
+        u32 menuSize = mounts.count() ? mounts.count() : 1;
+
+        // file preview, has the D-pad and L/R to itself until closed
+        if (preview.isOpen()) {
+            int mode = preview.getMode();
+            if (kDown & KEY_B) {
+                closePreview();
+                printFiles(cursor, scroll, count, &filelist, curdir);
+            } else if (kDown & (KEY_DOWN | KEY_UP | KEY_LEFT | KEY_RIGHT | KEY_L | KEY_R)) {
+                if (kDown & KEY_DOWN) preview.pageDown();
+                else if (kDown & KEY_UP) preview.pageUp();
+                else if (kDown & KEY_RIGHT) preview.nextMode(1);
+                else if (kDown & KEY_LEFT) preview.nextMode(-1);
+                else if (kDown & KEY_L) preview.home();
+                else preview.end();
+                if (mode == PREVIEW_SMDH && preview.getMode() != mode) topScreen.invalidate();
+                printPreview();
+            }
+            kDown &= KEY_START;
         }
 
         if (kDown & KEY_DOWN) {
-            if (!selected) cursor=1;
+            if (!selected) { if (cursor < menuSize) cursor++; }
             else {
-                printf("\x1b[%lu;0H  ", 1 + cursor);
                 if (count < 28) {
                     if (cursor < count) cursor++;
                     else cursor=0;
@@ -468,9 +938,8 @@ int main(int argc, char **argv) {
             }
         }
         if (kDown & KEY_UP) {
-            if (!selected) cursor=0;
+            if (!selected) { if (cursor > 0) cursor--; }
             else {
-                printf("\x1b[%lu;0H  ", 1 + cursor);
                 if (cursor>13) cursor--;
                 else if (scroll>0) scroll--;
                 else if (cursor>0) cursor--;
@@ -485,52 +954,42 @@ int main(int argc, char **argv) {
         // select action
         if (kDown & KEY_A) {
             if (!selected) {
-                if (cursor==1 && !mounted) {
+                if (cursor>0 && !mounts.count()) {
                     easteregg[0]++;
                     if (easteregg[0]>=30) promptError("THE ROMFS IS NOT FUCKING MOUNTED!");
                     else promptError("RomFS not mounted.");
                 } else {
-                    printf("\x1b[%lu;0H  ", 1 + cursor);
                     selected = true;
                     source = cursor;
-                    curdir = root[source];
+                    // Keep the browsed mount's metadata pinned, the listing points into it.
+                    active = source - 1;
+                    if (source > 0) mounts.acquire(active);
+                    rootdir = (source > 0) ? mounts.root(active) : "/";
+                    curdir = rootdir;
                     if (!getFileList(&filelist, curdir)) promptError("Failed to scan current directory.");
                     cursor = 0; scroll = 0; count = filelist.size();
-                    consoleSelect(&bot);
-                    consoleClear();
+                    botScreen.clear();
                     printFiles(cursor, scroll, count, &filelist, curdir);
                 }
             } else {
                 if (cursor > 0) {
-                    if (filelist[cursor+scroll-1].isDir) {
+                    if (filelist.get(cursor+scroll-1).isDir) {
                         innerpath.push(curdir);
-                        curdir = curdir + filelist[cursor+scroll-1].name + "/";
-                        if (!getFileList(&filelist, curdir)) promptError("Failed to scan current directory.");
-                        printf("\x1b[%lu;0H  ", 1 + cursor);
-                        cursor = 0; scroll = 0; count = filelist.size();
+                        changeDirectory(&listings, &filelist, &curdir, filelist.get(cursor+scroll-1).path + "/", &cursor, &scroll);
+                        count = filelist.size();
                         printFiles(cursor, scroll, count, &filelist, curdir);
+                    } else if (source==0 && isListFile(filelist.get(cursor+scroll-1).name)) {
+                        if (promptConfirm("Export the files listed here?")) exportList(curdir + filelist.get(cursor+scroll-1).name);
                     } else if (source==0) {
-                        if (promptConfirm("Mount romFS from this file?")) {
-                            u32 magic = 0x0;
-                            FSUSER_OpenFileDirectly(&romfs_handle, ARCHIVE_SDMC, (FS_Path){PATH_EMPTY, 1, (u8*)""}, (FS_Path)fsMakePath(PATH_ASCII, (curdir + filelist[cursor+scroll-1].name).c_str()), FS_OPEN_READ, 0);
-                            FSFILE_Read(romfs_handle, NULL, 0x0, &magic, 0x4);
-                            if (magic==0x43465649) {
-                                romfsExit();
-                                mounted = false;
-                                romfs_file = curdir + filelist[cursor+scroll-1].name;
-                                Result res = romfsInitFromFile(romfs_handle, 0x1000);
-                                if (res!=0) promptError("Couldn't not mount romFS from file.");
-                                else mounted = true;
-                            } else promptError("Not a valid romFS file.");
-                        }
-                    }
+                        if (promptConfirm("Mount romFS from this file?")) mountFile(curdir + filelist.get(cursor+scroll-1).name);
+                    } else if (openPreview(filelist.get(cursor+scroll-1))) {
+                        printPreview();
+                    } else promptError("Failed to open file.");
                 } else {
-                    if (curdir!=root[source]) {
-                        curdir = innerpath.top();
+                    if (curdir!=rootdir) {
+                        changeDirectory(&listings, &filelist, &curdir, innerpath.top(), &cursor, &scroll);
                         innerpath.pop();
-                        if (!getFileList(&filelist, curdir)) promptError("Failed to scan current directory.");
-                        printf("\x1b[%lu;0H  ", 1 + cursor);
-                        cursor = 0; scroll = 0; count = filelist.size();
+                        count = filelist.size();
                         printFiles(cursor, scroll, count, &filelist, curdir);
                     }
                 }
@@ -540,20 +999,20 @@ int main(int argc, char **argv) {
         // copy files
         if (kDown & KEY_Y) {
             if (selected) {
-                if (source==1) {
+                if (source>0) {
                     if (cursor > 0) {
                         size_t cbsize = clipboard.size();
                         for (size_t i=0; i < cbsize; i++) {
-                            if (clipboard[i].path == (curdir + filelist[cursor+scroll-1].name)) {
+                            if (clipboard[i].path == filelist.get(cursor+scroll-1).path) {
                                 clipboard.erase(clipboard.begin()+i);
                                 break;
                             } else if (i == (cbsize-1)) {
-                                if (cbsize < 30) clipboard.push_back(filelist[cursor+scroll-1]);
+                                if (cbsize < 30) clipboard.push_back(filelist.get(cursor+scroll-1));
                                 else promptError("Clipboard full.");
                                 break;
                             }
                         }
-                        if (cbsize==0) clipboard.push_back(filelist[cursor+scroll-1]);
+                        if (cbsize==0) clipboard.push_back(filelist.get(cursor+scroll-1));
                         printClipboard(&clipboard);
                     } else {
                         easteregg[1]++;
@@ -561,67 +1020,146 @@ int main(int argc, char **argv) {
                     }
                 } else if (clipboard.size() > 0) {
                     if (promptConfirm("Copy files to this folder?")) {
-                        if (copyClipboard(&clipboard, curdir)) promptError("Copy done.");
-                        else promptError("Copy failed.");
+                        u32 queued = 0;
+                        if (!copyClipboard(&clipboard, curdir, &queued)) promptError("Copy failed.");
+                        else promptError(queued ? "Queued, see the job queue." : "Copy done.");
+                        listings.clear();
                         if (!getFileList(&filelist, curdir)) promptError("Failed to scan current directory.");
                         count = filelist.size();
                         printFiles(cursor, scroll, count, &filelist, curdir);
                     }
                 }
-            } else if ((cursor==1 && is3dsx) && (promptConfirm("Dump romfs to SD card?"))) {
-                if (dumpRomFS()) promptError("RomFS dump done.");
-                else promptError("RomFS dump failed.");
+            } else if ((cursor>0 && is3dsx) && (promptConfirm("Dump title romfs to SD card?"))) {
+                if (dumpRomFS()) promptError("RomFS dump queued.");
+                printSource();
             }
         }
 
         // clear clipboard
-        if ((kDown & KEY_X) && (promptConfirm("Clear clipboard?"))) clipboard.clear();
+        if ((kDown & KEY_X) && selected && (promptConfirm("Clear clipboard?"))) clipboard.clear();
+        else if ((kDown & KEY_X) && !selected) {
+            manageJobs();
+            printSource();
+        }
 
         // cancel/go back
         if (kDown & KEY_B) {
-            cursor = 0; scroll = 0;
-            if (curdir==root[source]) selected = false;
+            if (curdir==rootdir) selected = false;
             else if (!innerpath.empty()) {
-                curdir = innerpath.top();
+                changeDirectory(&listings, &filelist, &curdir, innerpath.top(), &cursor, &scroll);
                 innerpath.pop();
-                if (!getFileList(&filelist, curdir)) promptError("Failed to scan current directory.");
                 count = filelist.size();
-                consoleSelect(&bot);
-                consoleClear();
+                botScreen.clear();
                 printFiles(cursor, scroll, count, &filelist, curdir);
             } else selected = false;
-            if (!selected) printSource(is3dsx, romfs_file, mounted);
+            if (!selected) {
+                cursor = 0; scroll = 0;
+                while (!innerpath.empty()) innerpath.pop();
+                listings.clear();
+                filelist.clear();
+                mounts.release(active);
+                active = -1;
+                printSource();
+            }
+        }
+
+        // go to path, by touching the path bar
+        if ((kDown & KEY_TOUCH) && selected) {
+            touchPosition touch;
+            hidTouchRead(&touch);
+            std::string target;
+            if (touch.py < 8 && promptPath(rootdir, curdir, &target) && target != curdir) {
+                while (!innerpath.empty()) innerpath.pop();
+                for (size_t pos = rootdir.size(); pos < target.size(); pos = target.find('/', pos) + 1) innerpath.push(target.substr(0, pos));
+                changeDirectory(&listings, &filelist, &curdir, target, &cursor, &scroll);
+                count = filelist.size();
+                printFiles(cursor, scroll, count, &filelist, curdir);
+            }
+        }
+
+        // search the whole romfs, results stream into the listing as they are found
+        if ((kDown & KEY_RIGHT) && selected && source>0) {
+            std::string text;
+            search_query query;
+            if (promptInput("Name, *glob*, .ext, >size, <size", "", &text) && !text.empty()) {
+                if (!parseQuery(text, &query)) promptError("Invalid search.");
+                else {
+                    if (curdir.find('?') == std::string::npos) innerpath.push(curdir);
+                    listings.store(curdir, &filelist, cursor, scroll);
+                    searchdir = rootdir + "?" + text;
+                    listings.invalidate(searchdir);
+                    curdir = searchdir;
+                    search.mount = active;
+                    search.query = query;
+                    search.position = 0;
+                    search.done = false;
+                    searching = true;
+                    cursor = 0; scroll = 0; count = 0;
+                    botScreen.clear();
+                }
+            }
+        }
+        if (searching) {
+            if (curdir != searchdir) {
+                // Left before it finished; don't keep the partial listing around.
+                searching = false;
+                listings.invalidate(searchdir);
+            } else {
+                u32 before = filelist.size();
+                searching = !searchStep(&search, &filelist);
+                count = filelist.size();
+                if (count != before || !searching) printFiles(cursor, scroll, count, &filelist, curdir);
+            }
+        }
+
+        // compare the selected mount with another one
+        if ((kDown & KEY_RIGHT) && !selected && cursor>0 && mounts.count()>1) {
+            int other = (cursor == 1) ? 1 : 0;
+            std::string name;
+            if (mounts.count() == 2) {
+                if (!promptConfirm("Compare " + mounts.root(cursor-1) + " with " + mounts.root(other) + "?")) other = -1;
+            } else if (!promptInput("Compare " + mounts.root(cursor-1) + " with", mounts.name(other), &name)) other = -1;
+            else {
+                if (name.find(':') != std::string::npos) name.erase(name.find(':'));
+                other = mounts.find(name);
+                if (other < 0 || other == (int)cursor-1) { promptError("No other romfs mounted as " + name + "."); other = -1; }
+            }
+            if (other >= 0) compareMounts(cursor-1, other);
         }
 
         // print help
-        if (kDown & KEY_L) printHelp(selected, is3dsx, mounted, source);
+        if (kDown & KEY_L) printHelp(selected, is3dsx, (cursor>0 && mounts.count()), source);
 
         // print clipboard
         if (kDown & KEY_R) printClipboard(&clipboard);
 
         // unmount/remount romfs
         if (kDown & KEY_SELECT) {
-            if ((mounted && !selected) && (promptConfirm("Unmount romFS?"))) {
-                mounted = false;
+            if ((selected && source==0 && cursor > 0) && !filelist.get(cursor+scroll-1).isDir) {
+                if (promptConfirm("Verify romFS image?")) verifyImage(curdir + filelist.get(cursor+scroll-1).name);
+            } else if (selected && source==0 && cursor > 0) {
+                if (promptConfirm("Build romFS image from this folder?") && buildImage(curdir + filelist.get(cursor+scroll-1).name)) promptError("Build queued.");
+            } else if ((!selected && cursor>0 && mounts.count()) && (promptConfirm("Unmount " + mounts.root(cursor-1) + "?"))) {
+                std::string root = mounts.root(cursor-1);
+                if (!mounts.unmount(cursor-1)) promptError("RomFS is in use.");
+                else dropMount(&clipboard, root);
                 cursor = 0; scroll = 0;
-                romfsExit();
-                printSource(is3dsx, romfs_file, mounted);
-            } else if ((!mounted && is3dsx) && (promptConfirm("Remount romFS from title?"))) {
-                romfs_file = "";
-                getRomFSHandle(&romfs_handle);
-                mounted = (romfsInitFromFile(romfs_handle, 0x0)==0);
+                printSource();
+            } else if ((!selected && is3dsx && mounts.find("romfs")<0) && (promptConfirm("Remount romFS from title?"))) {
+                if (!mountTitle()) promptError("Failed to mount romFS from title.");
+                printSource();
             }
         }
 
         // exit
-        if ((kDown & KEY_START) && promptConfirm("Exit RomFS Explorer?")) break;
+        if ((kDown & KEY_START) && promptConfirm(jobs.getPending() ? "Exit and cancel unfinished jobs?" : "Exit RomFS Explorer?")) break;
+        if ((kDown & KEY_START) && preview.isOpen()) printPreview();
 
         // fast scrolling
-        if (selected) {
+        if (selected && !preview.isOpen()) {
             u32 kHeld = hidKeysHeld();
             if (kHeld & KEY_DOWN) {
                 if (timer>=30) {
-                    printf("\x1b[%lu;0H  ", 1 + cursor);
                     if (count < 28) {
                         if (cursor < count) cursor++;
                         else cursor=0;
@@ -636,7 +1174,6 @@ int main(int argc, char **argv) {
                 } else timer++;
             } else if (kHeld & KEY_UP) {
                 if (timer>=30) {
-                    printf("\x1b[%lu;0H  ", 1 + cursor);
                     if (cursor>13) cursor--;
                     else if (scroll>0) scroll--;
                     else if (cursor>0) cursor--;
@@ -650,17 +1187,62 @@ int main(int argc, char **argv) {
             } else timer = 0;
         }
 
-        gfxFlushBuffers();
-        gfxSwapBuffers();
-        gspWaitForVBlank();
+        if (!selected && kDown) printMenu(cursor);
+
+        // background jobs: keep the console awake while any are left, and rescan once one finishes
+        u32 pending = jobs.getPending();
+        if (pending && !sleepBlocked) aptSetSleepAllowed(false);
+        else if (!pending && sleepBlocked) aptSetSleepAllowed(true);
+        sleepBlocked = pending > 0;
+        if (jobs.getCompleted() != jobsCompleted) {
+            jobsCompleted = jobs.getCompleted();
+            if (selected && source==0 && !preview.isOpen()) {
+                listings.clear();
+                if (!getFileList(&filelist, curdir)) promptError("Failed to scan current directory.");
+                count = filelist.size();
+                printFiles(cursor, scroll, count, &filelist, curdir);
+            }
+        }
+        bool showJob = pending && !preview.isOpen();
+#ifdef PERF
+        showJob = showJob && !overlay;
+#endif
+        if (showJob) printJobLine();
+        else if (jobLine && !preview.isOpen()) topScreen.clearRow(JOB_LINE);
+        jobLine = showJob;
+#ifdef PERF
+        if (kDown & KEY_LEFT) {
+            overlay = !overlay;
+            if (overlay) {
+                perfReset();
+                mounts.resetCacheStats();
+            } else clearPerf();
+        }
+        if (overlay) printPerf();
+        perfTraceFlush();
+#endif
+        render();
+        if (iconPending) drawIcon();
+        {
+            PERF_SCOPE(PERF_VBLANK);
+            gspWaitForVBlank();
+        }
     }
+#ifdef PERF
+    perfTraceClose();
+#endif
+    jobs.stop();
+    if (sleepBlocked) aptSetSleepAllowed(true);
 
     consoleSelect(&top);
     consoleClear();
-    consoleSelect(&bot);
-    consoleClear();
+    botScreen.clear();
     gfxExit();
-    if (mounted) romfsExit();
+    if (preview.isOpen()) closePreview();
+    filelist.clear();
+    mounts.clear();
+    chunkTuner().save("/3ds/data/romfs_explorer/chunks.cfg");
+    bufferPool().trim();
     amExit();
     fsExit();
     return 0;
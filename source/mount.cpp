@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "crc32.h"
+#include "mount.h"
+#include "sha256.h"
+
+void titleKey(u64 titleId, u64 version, u64 size, mount_key *key) {
+    memset(key, 0, sizeof(*key));
+    key->titleId = titleId;
+    key->version = version;
+    key->size = size;
+}
+
+bool fileKey(const std::string &path, ImageSource *image, mount_key *key) {
+    struct stat st;
+    memset(key, 0, sizeof(*key));
+    if (stat(path.c_str(), &st) != 0) return false;
+    key->size = st.st_size;
+    key->mtime = st.st_mtime;
+    u8 head[0x1000];
+    u32 len = (image->size() < sizeof(head)) ? image->size() : sizeof(head);
+    if (!image->read(0, head, len)) return false;
+    sha256(head, len, key->hash);
+    return true;
+}
+
+MountManager::MountManager(size_t budget) : budget(budget), clock(0) {
+}
+
+MountManager::~MountManager() {
+    clear();
+}
+
+int MountManager::mount(const std::string &name, const std::string &label, ImageSource *image, u64 base, const mount_key *key) {
+    if (mounts.size() >= MOUNT_MAX || find(name) >= 0) { delete image; return -1; }
+    CachedImage *blocks = image->map(0, 0) ? NULL : new CachedImage(image, true);
+    if (blocks) image = blocks;
+    mount_entry ent = {name, label, image, blocks, base, NULL, NULL, 0, ++clock, "", mount_key()};
+    if (key && !cacheDir.empty()) {
+        char file[32];
+        if (key->titleId) snprintf(file, sizeof(file), "title-%016llx.idx", (unsigned long long)key->titleId);
+        else snprintf(file, sizeof(file), "sd-%08lx.idx", (unsigned long)crc32(0, label.data(), label.size()));
+        ent.cache = cacheDir + file;
+        ent.key = *key;
+    }
+    ent.index = parse(&ent);
+    if (!ent.index) {
+        delete image;
+        return -1;
+    }
+    mounts.push_back(ent);
+    evict(budget);
+    return mounts.size() - 1;
+}
+
+bool MountManager::unmount(int id) {
+    if (id < 0 || id >= (int)mounts.size() || mounts[id].users) return false;
+    unload(&mounts[id]);
+    delete mounts[id].image;
+    mounts.erase(mounts.begin() + id);
+    return true;
+}
+
+void MountManager::clear() {
+    for (size_t i = 0; i < mounts.size(); i++) {
+        unload(&mounts[i]);
+        delete mounts[i].image;
+    }
+    mounts.clear();
+}
+
+int MountManager::find(const std::string &name) const {
+    for (size_t i = 0; i < mounts.size(); i++) {
+        if (mounts[i].name == name) return i;
+    }
+    return -1;
+}
+
+int MountManager::findLabel(const std::string &label) const {
+    for (size_t i = 0; i < mounts.size(); i++) {
+        if (mounts[i].label == label) return i;
+    }
+    return -1;
+}
+
+int MountManager::resolve(const std::string &path, std::string *inner) const {
+    size_t colon = path.find(":/");
+    if (colon == std::string::npos) return -1;
+    int id = find(path.substr(0, colon));
+    if (id >= 0 && inner) *inner = path.substr(colon + 1);
+    return id;
+}
+
+const RomFS *MountManager::acquire(int id) {
+    if (id < 0 || id >= (int)mounts.size()) return NULL;
+    mount_entry &ent = mounts[id];
+    ent.lastUse = ++clock;
+    if (!ent.index) {
+        RomFS *index = parse(&ent);
+        if (!index) return NULL;
+        ent.users++;
+        ent.index = index;
+        evict(budget);
+        return index;
+    }
+    ent.users++;
+    return ent.index;
+}
+
+void MountManager::release(int id) {
+    if (id < 0 || id >= (int)mounts.size() || !mounts[id].users) return;
+    mounts[id].users--;
+    evict(budget);
+}
+
+const SearchIndex *MountManager::searchIndex(int id) {
+    if (id < 0 || id >= (int)mounts.size() || !mounts[id].index) return NULL;
+    mount_entry &ent = mounts[id];
+    if (!ent.search) {
+        ent.search = new SearchIndex();
+        ent.search->build(ent.index);
+    }
+    return ent.search;
+}
+
+cache_stats MountManager::cacheStats(int id) {
+    cache_stats total;
+    memset(&total, 0, sizeof(total));
+    for (size_t i = 0; i < mounts.size(); i++) {
+        if (!mounts[i].blocks || (id >= 0 && id != (int)i)) continue;
+        cache_stats stats = mounts[i].blocks->getStats();
+        total.hits += stats.hits;
+        total.misses += stats.misses;
+        total.bypassed += stats.bypassed;
+        total.prefetched += stats.prefetched;
+        total.prefetchHits += stats.prefetchHits;
+    }
+    return total;
+}
+
+void MountManager::resetCacheStats() {
+    for (size_t i = 0; i < mounts.size(); i++) {
+        if (mounts[i].blocks) mounts[i].blocks->resetStats();
+    }
+}
+
+void MountManager::setBudget(size_t bytes) {
+    budget = bytes;
+    evict(budget);
+}
+
+size_t MountManager::memoryUsage() const {
+    size_t total = 0;
+    for (size_t i = 0; i < mounts.size(); i++) {
+        if (mounts[i].index) total += mounts[i].index->memoryUsage();
+        if (mounts[i].search) total += mounts[i].search->memoryUsage();
+    }
+    return total;
+}
+
+void MountManager::evict(size_t limit) {
+    size_t used = memoryUsage();
+    while (used > limit) {
+        int victim = -1;
+        for (size_t i = 0; i < mounts.size(); i++) {
+            if (!mounts[i].index || mounts[i].users) continue;
+            if (victim < 0 || mounts[i].lastUse < mounts[victim].lastUse) victim = i;
+        }
+        if (victim < 0) break;
+        used -= mounts[victim].index->memoryUsage();
+        if (mounts[victim].search) used -= mounts[victim].search->memoryUsage();
+        unload(&mounts[victim]);
+    }
+}
+
+// Loads the index from the cache when it is still valid, else parses the image and refreshes the cache.
+RomFS *MountManager::parse(mount_entry *ent) {
+    RomFS *index = new RomFS();
+    if (!ent->cache.empty() && index->load(ent->image, ent->base, ent->cache, &ent->key, sizeof(ent->key))) return index;
+    if (!index->open(ent->image, ent->base)) {
+        delete index;
+        return NULL;
+    }
+    if (!ent->cache.empty()) index->save(ent->cache, &ent->key, sizeof(ent->key));
+    return index;
+}
+
+void MountManager::unload(mount_entry *ent) {
+    delete ent->search;
+    delete ent->index;
+    ent->search = NULL;
+    ent->index = NULL;
+}
@@ -0,0 +1,118 @@
+#include "perf.h"
+
+#ifdef PERF
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "thread.h"
+
+#ifdef _3DS
+#include <3ds.h>
+#else
+#include <time.h>
+#endif
+
+#define TRACE_FLUSH 0x400
+
+typedef struct {
+    u64 start;
+    u64 ticks;
+    u64 bytes;
+    int id;
+} perf_event;
+
+static const char *names[PERF_COUNTERS] = {"list", "sort", "read", "write", "image", "cache", "render", "vblank"};
+static perf_counter counters[PERF_COUNTERS];
+static Mutex mutex;
+static FILE *trace = NULL;
+static u64 traceStart = 0;
+static std::vector<perf_event> events;
+static std::vector<perf_event> pending;
+
+u64 perfTicks() {
+#ifdef _3DS
+    return svcGetSystemTick();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+double perfMs(u64 ticks) {
+#ifdef _3DS
+    return ticks / (SYSCLOCK_ARM11 / 1000.0);
+#else
+    return ticks / 1000000.0;
+#endif
+}
+
+void perfAdd(int id, u64 start, u64 bytes) {
+    u64 ticks = perfTicks() - start;
+    ScopedLock lock(mutex);
+    perf_counter &counter = counters[id];
+    counter.calls++;
+    counter.ticks += ticks;
+    counter.bytes += bytes;
+    if (ticks > counter.maxTicks) counter.maxTicks = ticks;
+    if (trace) {
+        perf_event event = {start, ticks, bytes, id};
+        events.push_back(event);
+    }
+}
+
+perf_counter perfGet(int id) {
+    ScopedLock lock(mutex);
+    perf_counter result = counters[id];
+    result.name = names[id];
+    return result;
+}
+
+void perfReset() {
+    ScopedLock lock(mutex);
+    memset(counters, 0, sizeof(counters));
+}
+
+bool perfTraceOpen(const char *path) {
+    perfTraceClose();
+    FILE *file = fopen(path, "w");
+    if (!file) return false;
+    fprintf(file, "time_ms,counter,duration_ms,bytes\n");
+    ScopedLock lock(mutex);
+    trace = file;
+    traceStart = perfTicks();
+    events.reserve(TRACE_FLUSH);
+    return true;
+}
+
+// Events are swapped out under the lock and formatted outside it, so the timed threads never
+// wait on the SD card. Small batches are left to accumulate unless the trace is being closed.
+static void writeEvents(bool all) {
+    FILE *file;
+    {
+        ScopedLock lock(mutex);
+        file = trace;
+        if (!file || events.empty() || (!all && events.size() < TRACE_FLUSH)) return;
+        pending.swap(events);
+        events.reserve(TRACE_FLUSH);
+    }
+    for (size_t i = 0; i < pending.size(); i++) {
+        const perf_event &event = pending[i];
+        fprintf(file, "%.3f,%s,%.4f,%llu\n", perfMs(event.start - traceStart), names[event.id], perfMs(event.ticks), (unsigned long long)event.bytes);
+    }
+    pending.clear();
+}
+
+void perfTraceFlush() {
+    writeEvents(false);
+}
+
+void perfTraceClose() {
+    writeEvents(true);
+    ScopedLock lock(mutex);
+    if (trace) fclose(trace);
+    trace = NULL;
+}
+
+#endif
@@ -0,0 +1,293 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "preview.h"
+#include "smdh.h"
+
+#define DETECT_BYTES 0x200
+#define TAB_WIDTH 4
+
+static const char *modeNames[PREVIEW_MODES] = {"HEX", "TEXT", "SMDH"};
+
+static const char *regionNames[] = {"Japan", "America", "Europe", "Australia", "China", "Korea", "Taiwan"};
+
+static const struct {
+    u32 bit;
+    const char *name;
+} smdhFlags[] = {
+    {0x1, "visible"}, {0x2, "autoboot"}, {0x4, "3D"}, {0x8, "EULA"}, {0x10, "autosave"}, {0x20, "extended banner"},
+    {0x40, "rating required"}, {0x80, "save data"}, {0x100, "record usage"}, {0x400, "no save backup"}, {0x1000, "New 3DS only"}
+};
+
+Preview::Preview() : image(NULL), offset(0), size(0), mode(PREVIEW_HEX), utf16(false), position(0), windowEnd(0), page(0), rowBytes(8), view(NULL) {}
+
+void Preview::open(ImageSource *src, u64 start, u64 length) {
+    image = src;
+    offset = start;
+    size = length;
+    home();
+    detect();
+}
+
+void Preview::close() {
+    image = NULL;
+    view = NULL;
+    history.clear();
+    std::vector<u8>().swap(window);
+}
+
+const char *Preview::modeName(int mode) {
+    return (mode >= 0 && mode < PREVIEW_MODES) ? modeNames[mode] : "";
+}
+
+bool Preview::read(u64 from, u32 len) {
+    if ((view = image->map(offset + from, len))) return true;
+    window.resize(len);
+    view = window.data();
+    if (len == 0 || image->read(offset + from, window.data(), len)) return true;
+    view = NULL;
+    return false;
+}
+
+bool Preview::isSmdh() {
+    u32 magic = 0;
+    return size >= sizeof(smdh_s) && image->read(offset, &magic, sizeof(magic)) && magic == SMDH_MAGIC;
+}
+
+bool Preview::setMode(int next) {
+    if (next < 0 || next >= PREVIEW_MODES || (next == PREVIEW_SMDH && !isSmdh())) return false;
+    mode = next;
+    home();
+    return true;
+}
+
+void Preview::nextMode(int step) {
+    for (int i = 1; i < PREVIEW_MODES; i++) {
+        if (setMode((mode + i * step + PREVIEW_MODES * 2) % PREVIEW_MODES)) return;
+    }
+}
+
+// Text if the first bytes are printable as UTF-8, or look like UTF-16LE (a BOM, or mostly zero
+// high bytes); hex otherwise.
+void Preview::detect() {
+    utf16 = false;
+    mode = PREVIEW_HEX;
+    if (isSmdh()) { mode = PREVIEW_SMDH; return; }
+    u32 len = (size < DETECT_BYTES) ? size : DETECT_BYTES;
+    if (len < 2 || !read(0, len)) return;
+    const u8 *data = view;
+    u32 pairs = len / 2, oddZeros = 0, evenZeros = 0, printable = 0, zeros = 0;
+    for (u32 i = 0; i < len; i++) {
+        u8 c = data[i];
+        if (c == 0) { zeros++; if (i & 1) oddZeros++; else evenZeros++; }
+        else if (c >= 0x20 || c == '\t' || c == '\n' || c == '\r') printable++;
+    }
+    if ((data[0] == 0xFF && data[1] == 0xFE) || (oddZeros * 10 >= pairs * 8 && evenZeros * 10 <= pairs)) {
+        utf16 = true;
+        mode = PREVIEW_TEXT;
+    } else if (zeros == 0 && printable * 100 >= len * 95) mode = PREVIEW_TEXT;
+}
+
+bool Preview::render(u32 rows, u32 cols, std::vector<std::string> *lines) {
+    lines->clear();
+    if (!image || !rows || !cols) return false;
+    if (mode == PREVIEW_SMDH) renderSmdh(cols, lines);
+    else if (mode == PREVIEW_TEXT) renderText(rows, cols, lines);
+    else renderHex(rows, cols, lines);
+    if (lines->size() > rows) lines->resize(rows);
+    return view || size == 0;
+}
+
+void Preview::renderHex(u32 rows, u32 cols, std::vector<std::string> *lines) {
+    rowBytes = (cols >= 74) ? 16 : 8;
+    page = rows * rowBytes;
+    u32 len = (size - position < page) ? size - position : page;
+    if (!read(position, len)) return;
+    windowEnd = position + len;
+    for (u32 row = 0; row * rowBytes < len; row++) {
+        char line[96];
+        int pos = snprintf(line, sizeof(line), "%08llx ", (unsigned long long)(position + row * rowBytes));
+        for (u32 i = 0; i < rowBytes; i++) {
+            u32 at = row * rowBytes + i;
+            if (at < len) pos += snprintf(line + pos, sizeof(line) - pos, "%02x ", view[at]);
+            else pos += snprintf(line + pos, sizeof(line) - pos, "   ");
+        }
+        line[pos++] = ' ';
+        for (u32 i = 0; i < rowBytes && row * rowBytes + i < len; i++) {
+            u8 c = view[row * rowBytes + i];
+            line[pos++] = (c >= 0x20 && c < 0x7F) ? c : '.';
+        }
+        line[pos] = '\0';
+        lines->push_back(line);
+    }
+}
+
+// Decodes one character at data[i]; returns its length in bytes, or 0 if it's cut off by the
+// end of the window. Anything outside ASCII shows as '?', the console font has nothing better.
+static u32 decodeChar(const u8 *data, u32 i, u32 len, bool utf16, u32 *code) {
+    if (utf16) {
+        if (i + 2 > len) return 0;
+        u32 c = data[i] | (data[i + 1] << 8);
+        if (c >= 0xD800 && c < 0xDC00) {
+            if (i + 4 > len) return 0;
+            *code = '?';
+            return 4;
+        }
+        *code = (c < 0x80) ? c : '?';
+        return 2;
+    }
+    u8 c = data[i];
+    u32 n = (c < 0x80) ? 1 : (c >= 0xF0 && c < 0xF8) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+    if (i + n > len) return 0;
+    *code = (n == 1 && c < 0x80) ? c : '?';
+    return n;
+}
+
+void Preview::renderText(u32 rows, u32 cols, std::vector<std::string> *lines) {
+    u32 unit = utf16 ? 2 : 1;
+    u64 want = (u64)rows * cols * (utf16 ? 2 : 4);
+    u32 len = (size - position < want) ? size - position : want;
+    page = len;
+    if (!read(position, len)) return;
+    const u8 *data = view;
+    bool atEnd = (position + len == size);
+    u32 i = (position == 0 && utf16 && len >= 2 && data[0] == 0xFF && data[1] == 0xFE) ? 2 : 0;
+    u32 used = i;
+    bool wrapped = false;
+    std::string line;
+    while (lines->size() < rows) {
+        u32 code = 0;
+        u32 n = (i < len) ? decodeChar(data, i, len, utf16, &code) : 0;
+        if (n == 0) {
+            if (atEnd && !line.empty()) { lines->push_back(line); used = len; }
+            else if (atEnd) used = len;
+            break;
+        }
+        i += n;
+        if (code == '\n') {
+            if (!wrapped || !line.empty()) lines->push_back(line);
+            line.clear();
+            wrapped = false;
+            used = i;
+            continue;
+        }
+        if (code == '\r') continue;
+        if (code == '\t') {
+            do line += ' '; while (line.size() % TAB_WIDTH && line.size() < cols);
+        } else line += (code < 0x20 || code == 0x7F) ? '.' : (char)code;
+        wrapped = false;
+        if (line.size() >= cols) {
+            lines->push_back(line.substr(0, cols));
+            line.clear();
+            wrapped = true;
+            used = i;
+        }
+    }
+    windowEnd = position + used;
+    if (windowEnd == position && len) windowEnd = position + unit;
+}
+
+static std::string smdhString(const u16 *src, u32 max) {
+    std::string result;
+    for (u32 i = 0; i < max && src[i]; i++) result += (src[i] < 0x80) ? (char)src[i] : '?';
+    return result;
+}
+
+static void wrap(const std::string &label, const std::string &text, u32 cols, std::vector<std::string> *lines) {
+    std::string rest = label + text;
+    for (size_t nl; (nl = rest.find('\n')) != std::string::npos; ) rest[nl] = ' ';
+    while (rest.size() > cols) {
+        lines->push_back(rest.substr(0, cols));
+        rest = std::string(label.size(), ' ') + rest.substr(cols);
+    }
+    lines->push_back(rest);
+}
+
+// Everything up to the icons; the icon itself is drawn by the caller from readIcon().
+void Preview::renderSmdh(u32 cols, std::vector<std::string> *lines) {
+    page = 0;
+    if (!read(0, offsetof(smdh_s, smallIconData))) return;
+    const smdh_s *smdh = (const smdh_s*)view;
+    // English first, then the first language with a title; 0 if none has one
+    int lang = 0;
+    for (int n = 0; n < 16; n++) {
+        if (smdh->titles[(1 + n) % 16].shortDescription[0]) {
+            lang = (1 + n) % 16;
+            break;
+        }
+    }
+    const smdhTitle_s &title = smdh->titles[lang];
+    wrap("Title:     ", smdhString(title.shortDescription, 0x40), cols, lines);
+    wrap("Long:      ", smdhString(title.longDescription, 0x80), cols, lines);
+    wrap("Publisher: ", smdhString(title.publisher, 0x40), cols, lines);
+    lines->push_back("");
+    std::string regions;
+    u32 lock = smdh->settings.regionLock;
+    if (lock == SMDH_REGION_FREE) regions = "region free";
+    for (u32 i = 0; lock != SMDH_REGION_FREE && i < sizeof(regionNames) / sizeof(regionNames[0]); i++) {
+        if (lock & (1 << i)) regions += std::string(regions.empty() ? "" : ", ") + regionNames[i];
+    }
+    wrap("Regions:   ", regions.empty() ? "none" : regions, cols, lines);
+    std::string flags;
+    for (u32 i = 0; i < sizeof(smdhFlags) / sizeof(smdhFlags[0]); i++) {
+        if (smdh->settings.flags & smdhFlags[i].bit) flags += std::string(flags.empty() ? "" : ", ") + smdhFlags[i].name;
+    }
+    wrap("Flags:     ", flags.empty() ? "none" : flags, cols, lines);
+    char version[32];
+    snprintf(version, sizeof(version), "%u.%u", smdh->settings.eulaVersion >> 8, smdh->settings.eulaVersion & 0xFF);
+    wrap("EULA:      ", version, cols, lines);
+    windowEnd = size;
+}
+
+bool Preview::readIcon(u16 *pixels) {
+    if (!image || !isSmdh()) return false;
+    u32 len = sizeof(((smdh_s*)0)->bigIconData);
+    if (!read(offsetof(smdh_s, bigIconData), len)) return false;
+    smdhUntileIcon((const u16*)view, pixels);
+    return true;
+}
+
+void Preview::pageDown() {
+    if (mode == PREVIEW_TEXT) {
+        if (windowEnd >= size) return;
+        history.push_back(position);
+        position = windowEnd;
+    } else if (page && position + page < size) position += page;
+}
+
+// Text pages have no fixed size; going back past the pages seen steps back by a window's bytes.
+void Preview::pageUp() {
+    if (mode == PREVIEW_TEXT && !history.empty()) {
+        position = history.back();
+        history.pop_back();
+        return;
+    }
+    position = (position > page) ? position - page : 0;
+    if (mode == PREVIEW_TEXT && utf16) position &= ~1ULL;
+}
+
+void Preview::home() {
+    position = 0;
+    windowEnd = 0;
+    history.clear();
+}
+
+void Preview::end() {
+    history.clear();
+    if (!page || size <= page) { position = 0; return; }
+    if (mode == PREVIEW_HEX) position = (size - page + rowBytes - 1) / rowBytes * rowBytes;
+    else if (mode == PREVIEW_TEXT) position = (size - page) & (utf16 ? ~1ULL : ~0ULL);
+}
+
+void smdhUntileIcon(const u16 *tiled, u16 *pixels) {
+    u32 i = 0;
+    for (u32 ty = 0; ty < SMDH_ICON_SIZE; ty += 8) {
+        for (u32 tx = 0; tx < SMDH_ICON_SIZE; tx += 8) {
+            for (u32 k = 0; k < 64; k++) {
+                u32 x = (k & 1) | ((k >> 1) & 2) | ((k >> 2) & 4);
+                u32 y = ((k >> 1) & 1) | ((k >> 2) & 2) | ((k >> 3) & 4);
+                pixels[(ty + y) * SMDH_ICON_SIZE + tx + x] = tiled[i++];
+            }
+        }
+    }
+}
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <cstring>
+#include <deque>
+#include "romfs.h"
+
+#define DIR_META_SIZE 0x18
+#define FILE_META_SIZE 0x20
+
+#define INDEX_MAGIC 0x58444952 // "RIDX"
+#define INDEX_VERSION 1
+#define INDEX_KEY_MAX 0x40
+
+typedef struct {
+    u32 magic;
+    u16 version;
+    u16 entrySize;
+    u32 keySize;
+    u8 key[INDEX_KEY_MAX];
+    romfs_header header;
+    u32 entries;
+    u32 names;
+    u32 buckets;
+    u32 reserved;
+    u64 base;
+} index_header;
+
+static inline u32 getU32(const u8 *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static inline u64 getU64(const u8 *p) {
+    return getU32(p) | ((u64)getU32(p + 4) << 32);
+}
+
+std::string utf16to8(const u16 *src, u32 len) {
+    std::string out;
+    out.reserve(len);
+    for (u32 i = 0; i < len; i++) {
+        u32 c = src[i];
+        if (c >= 0xD800 && c < 0xDC00 && (i + 1) < len && src[i+1] >= 0xDC00 && src[i+1] < 0xE000) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (src[i+1] - 0xDC00);
+            i++;
+        }
+        if (c < 0x80) out += (char)c;
+        else if (c < 0x800) {
+            out += (char)(0xC0 | (c >> 6));
+            out += (char)(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            out += (char)(0xE0 | (c >> 12));
+            out += (char)(0x80 | ((c >> 6) & 0x3F));
+            out += (char)(0x80 | (c & 0x3F));
+        } else {
+            out += (char)(0xF0 | (c >> 18));
+            out += (char)(0x80 | ((c >> 12) & 0x3F));
+            out += (char)(0x80 | ((c >> 6) & 0x3F));
+            out += (char)(0x80 | (c & 0x3F));
+        }
+    }
+    return out;
+}
+
+std::vector<u16> utf8to16(const std::string &src) {
+    std::vector<u16> out;
+    out.reserve(src.size());
+    for (size_t i = 0; i < src.size(); ) {
+        u8 c = src[i];
+        u32 n = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+        u32 code = (n == 1) ? c : c & (0x3F >> (n - 1));
+        for (u32 k = 1; k < n && i + k < src.size(); k++) code = (code << 6) | (src[i + k] & 0x3F);
+        i += n;
+        if (code >= 0x10000) {
+            out.push_back(0xD800 + ((code - 0x10000) >> 10));
+            out.push_back(0xDC00 + ((code - 0x10000) & 0x3FF));
+        } else out.push_back(code);
+    }
+    return out;
+}
+
+// Hash of the index's own bucket table (buckets, chained through nextHash), built after parsing;
+// the image's hash tables are never read. It is keyed by the parent's entry index and the UTF-8
+// name, so path lookups need no UTF-16 conversion.
+static inline u32 hashName(u32 parent, const char *name, u32 len) {
+    u32 hash = parent ^ 123456789;
+    for (u32 i = 0; i < len; i++) {
+        hash = (hash >> 5) | (hash << 27);
+        hash ^= (u8)name[i];
+    }
+    return hash;
+}
+
+// Same bucket count rule as Nintendo's romfs builder: odd, and not divisible by small primes.
+u32 bucketCount(u32 entries) {
+    u32 count = entries;
+    if (count < 3) count = 3;
+    else if (count < 19) count |= 1;
+    else {
+        while (count % 2 == 0 || count % 3 == 0 || count % 5 == 0 || count % 7 == 0 ||
+               count % 11 == 0 || count % 13 == 0 || count % 17 == 0) count++;
+    }
+    return count;
+}
+
+typedef struct {
+    const u8 *data;
+    u32 size;
+} meta_table;
+
+// Metadata tables are parsed in place when the image is mapped, else from a copy read into buffer.
+static bool loadTable(ImageSource *src, u64 offset, u32 size, std::vector<u8> *buffer, meta_table *table) {
+    table->size = size;
+    table->data = src->map(offset, size);
+    if (table->data || !size) return true;
+    buffer->resize(size);
+    table->data = buffer->data();
+    return src->read(offset, buffer->data(), size);
+}
+
+// Metadata names are stored as little endian UTF-16 right after the fixed part of the entry.
+static bool readName(const meta_table &table, u32 off, u32 fixed, std::string *dest) {
+    u32 len = getU32(&table.data[off + fixed - 4]);
+    if ((len & 1) || (u64)off + fixed + len > table.size) return false;
+    std::vector<u16> wide(len / 2);
+    for (u32 i = 0; i < len / 2; i++) wide[i] = table.data[off + fixed + i*2] | (table.data[off + fixed + i*2 + 1] << 8);
+    *dest = utf16to8(wide.data(), wide.size());
+    return true;
+}
+
+RomFS::RomFS() : image(NULL), base(0) {
+    memset(&header, 0, sizeof(header));
+}
+
+void RomFS::close() {
+    image = NULL;
+    base = 0;
+    memset(&header, 0, sizeof(header));
+    std::vector<romfs_entry>().swap(entries);
+    std::vector<char>().swap(names);
+    std::vector<u32>().swap(buckets);
+}
+
+bool RomFS::open(ImageSource *src, u64 offset) {
+    close();
+    u8 raw[sizeof(romfs_header)];
+    if (!src->read(offset, raw, sizeof(raw))) return false;
+    u32 *fields = (u32*)&header;
+    for (u32 i = 0; i < sizeof(romfs_header) / 4; i++) fields[i] = getU32(raw + i*4);
+    if (header.headerSize != sizeof(romfs_header)) return false;
+
+    std::vector<u8> dirCopy, fileCopy;
+    meta_table dirMeta, fileMeta;
+    if (header.dirMetaSize < DIR_META_SIZE) return false;
+    if (!loadTable(src, offset + header.dirMetaOff, header.dirMetaSize, &dirCopy, &dirMeta)) return false;
+    if (!loadTable(src, offset + header.fileMetaOff, header.fileMetaSize, &fileCopy, &fileMeta)) return false;
+
+    // Breadth-first walk, so that every directory's children end up next to each other.
+    u32 maxEntries = dirMeta.size / DIR_META_SIZE + fileMeta.size / FILE_META_SIZE;
+    std::deque<std::pair<u32, u32> > pending; // (metadata offset, entry index)
+    std::string name;
+    entries.reserve(maxEntries);
+    names.reserve(header.dirMetaSize / 4 + header.fileMetaSize / 4);
+    names.push_back('\0');
+    romfs_entry top = {0, 0, 0, ROMFS_NONE, ROMFS_NONE, 0, ROMFS_NONE, 0, true};
+    entries.push_back(top);
+    pending.push_back(std::make_pair(0u, 0u));
+    while (!pending.empty()) {
+        u32 doff = pending.front().first;
+        u32 index = pending.front().second;
+        pending.pop_front();
+        u32 prev = ROMFS_NONE;
+        u32 dchild = getU32(&dirMeta.data[doff + 0x8]);
+        u32 fchild = getU32(&dirMeta.data[doff + 0xC]);
+        while (dchild != ROMFS_NONE || fchild != ROMFS_NONE) {
+            bool isDir = (dchild != ROMFS_NONE);
+            const meta_table &table = isDir ? dirMeta : fileMeta;
+            u32 off = isDir ? dchild : fchild;
+            u32 fixed = isDir ? DIR_META_SIZE : FILE_META_SIZE;
+            if (entries.size() >= maxEntries || (u64)off + fixed > table.size) { close(); return false; }
+            if (!readName(table, off, fixed, &name) || name.size() > 0xFFFF) { close(); return false; }
+            romfs_entry ent = {0, 0, index, ROMFS_NONE, ROMFS_NONE, (u32)names.size(), ROMFS_NONE, (u16)name.size(), isDir};
+            if (isDir) dchild = getU32(&table.data[off + 0x4]);
+            else {
+                ent.offset = offset + header.fileDataOff + getU64(&table.data[off + 0x8]);
+                ent.size = getU64(&table.data[off + 0x10]);
+                fchild = getU32(&table.data[off + 0x4]);
+            }
+            names.insert(names.end(), name.begin(), name.end());
+            names.push_back('\0');
+            u32 cur = entries.size();
+            if (prev == ROMFS_NONE) entries[index].child = cur;
+            else entries[prev].sibling = cur;
+            prev = cur;
+            entries.push_back(ent);
+            if (isDir) pending.push_back(std::make_pair(off, cur));
+        }
+    }
+    buckets.assign(bucketCount(entries.size()), ROMFS_NONE);
+    for (u32 i = entries.size() - 1; i > 0; i--) {
+        u32 &head = buckets[hashName(entries[i].parent, this->name(i), entries[i].nameLen) % buckets.size()];
+        entries[i].nextHash = head;
+        head = i;
+    }
+    image = src;
+    base = offset;
+    return true;
+}
+
+std::string RomFS::path(u32 index) const {
+    std::string result;
+    while (index != root() && index < entries.size()) {
+        result = "/" + std::string(name(index)) + result;
+        index = entries[index].parent;
+    }
+    return result.empty() ? "/" : result;
+}
+
+u32 RomFS::find(const std::string &path) const {
+    if (!isOpen()) return ROMFS_NONE;
+    u32 cur = root();
+    size_t pos = 0;
+    while (pos < path.size()) {
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos) end = path.size();
+        if (end > pos) {
+            cur = findChild(cur, path.data() + pos, end - pos);
+            if (cur == ROMFS_NONE) return ROMFS_NONE;
+        }
+        pos = end + 1;
+    }
+    return cur;
+}
+
+u32 RomFS::findChild(u32 dir, const char *str, u32 len) const {
+    if (dir >= entries.size() || !entries[dir].isDir || buckets.empty()) return ROMFS_NONE;
+    u32 next = buckets[hashName(dir, str, len) % buckets.size()];
+    while (next != ROMFS_NONE) {
+        const romfs_entry &ent = entries[next];
+        if (ent.parent == dir && ent.nameLen == len && !memcmp(name(next), str, len)) return next;
+        next = ent.nextHash;
+    }
+    return ROMFS_NONE;
+}
+
+bool RomFS::list(u32 dir, std::vector<u32> *dest) const {
+    if (dir >= entries.size() || !entries[dir].isDir) return false;
+    dest->clear();
+    for (u32 i = entries[dir].child; i != ROMFS_NONE; i = entries[i].sibling) dest->push_back(i);
+    return true;
+}
+
+bool RomFS::save(const std::string &path, const void *key, u32 keySize) const {
+    if (!isOpen() || keySize > INDEX_KEY_MAX) return false;
+    index_header head;
+    memset(&head, 0, sizeof(head));
+    head.magic = INDEX_MAGIC;
+    head.version = INDEX_VERSION;
+    head.entrySize = sizeof(romfs_entry);
+    head.keySize = keySize;
+    memcpy(head.key, key, keySize);
+    head.header = header;
+    head.entries = entries.size();
+    head.names = names.size();
+    head.buckets = buckets.size();
+    head.base = base;
+    std::string tmp = path + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "wb");
+    if (!out) return false;
+    bool ok = fwrite(&head, sizeof(head), 1, out) == 1
+        && fwrite(entries.data(), sizeof(romfs_entry), entries.size(), out) == entries.size()
+        && fwrite(buckets.data(), sizeof(u32), buckets.size(), out) == buckets.size()
+        && fwrite(names.data(), 1, names.size(), out) == names.size();
+    ok = (fclose(out) == 0) && ok;
+    remove(path.c_str());
+    if (ok && rename(tmp.c_str(), path.c_str()) == 0) return true;
+    remove(tmp.c_str());
+    return false;
+}
+
+bool RomFS::load(ImageSource *src, u64 offset, const std::string &path, const void *key, u32 keySize) {
+    close();
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in) return false;
+    fseek(in, 0, SEEK_END);
+    long length = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    std::vector<u8> data(length > (long)sizeof(index_header) ? length : 0);
+    bool ok = !data.empty() && fread(data.data(), 1, data.size(), in) == data.size();
+    fclose(in);
+    if (!ok) return false;
+
+    index_header head;
+    memcpy(&head, data.data(), sizeof(head));
+    if (head.magic != INDEX_MAGIC || head.version != INDEX_VERSION || head.entrySize != sizeof(romfs_entry)) return false;
+    if (head.keySize != keySize || keySize > INDEX_KEY_MAX || memcmp(head.key, key, keySize) || head.base != offset) return false;
+    u64 expected = sizeof(head) + (u64)head.entries * sizeof(romfs_entry) + (u64)head.buckets * sizeof(u32) + head.names;
+    if (expected != data.size() || !head.entries || !head.buckets || !head.names) return false;
+
+    // The image itself is only asked for its header, to catch a cache that outlived its image.
+    u8 raw[sizeof(romfs_header)];
+    if (!src->read(offset, raw, sizeof(raw))) return false;
+    for (u32 i = 0; i < sizeof(romfs_header) / 4; i++) {
+        if (getU32(raw + i*4) != ((u32*)&head.header)[i]) return false;
+    }
+
+    const u8 *p = data.data() + sizeof(head);
+    entries.assign((const romfs_entry*)p, (const romfs_entry*)p + head.entries);
+    p += head.entries * sizeof(romfs_entry);
+    buckets.assign((const u32*)p, (const u32*)p + head.buckets);
+    p += head.buckets * sizeof(u32);
+    names.assign((const char*)p, (const char*)p + head.names);
+    // Everything below indexes into these arrays, so reject anything pointing outside them.
+    for (size_t i = 0; i < entries.size(); i++) {
+        const romfs_entry &ent = entries[i];
+        if (ent.name + (u64)ent.nameLen >= names.size() || names[ent.name + ent.nameLen] != '\0' || (ent.parent >= entries.size()) ||
+            (ent.sibling != ROMFS_NONE && ent.sibling >= entries.size()) || (ent.child != ROMFS_NONE && ent.child >= entries.size()) ||
+            (ent.nextHash != ROMFS_NONE && ent.nextHash >= entries.size())) { close(); return false; }
+    }
+    for (size_t i = 0; i < buckets.size(); i++) {
+        if (buckets[i] != ROMFS_NONE && buckets[i] >= entries.size()) { close(); return false; }
+    }
+    header = head.header;
+    image = src;
+    base = offset;
+    return true;
+}
@@ -0,0 +1,107 @@
+#include <stdarg.h>
+#include "screen.h"
+
+// Unchanged cells between two changes are rewritten rather than skipped when the gap is
+// shorter than a cursor move escape.
+#define GAP_MERGE 6
+
+TextScreen::TextScreen(u32 rows, u32 cols) : height(rows), width(cols), cells(rows * cols, ' '), colors(rows * cols, 0),
+    shown(rows * cols, ' '), shownColors(rows * cols, 0), dirty(false) {
+}
+
+void TextScreen::clear() {
+    std::fill(cells.begin(), cells.end(), ' ');
+    std::fill(colors.begin(), colors.end(), 0);
+    dirty = true;
+}
+
+void TextScreen::clearRow(u32 row) {
+    if (row >= height) return;
+    std::fill(cells.begin() + row * width, cells.begin() + (row + 1) * width, ' ');
+    std::fill(colors.begin() + row * width, colors.begin() + (row + 1) * width, 0);
+    dirty = true;
+}
+
+void TextScreen::print(u32 row, u32 col, const std::string &text, u8 color, u32 len) {
+    if (row >= height || col >= width) return;
+    if (!len) len = text.size();
+    if (col + len > width) len = width - col;
+    u32 pos = row * width + col;
+    for (u32 i = 0; i < len; i++) {
+        char c = (i < text.size()) ? text[i] : ' ';
+        if (c == '\n' || c == '\r' || c == '\t') c = ' ';
+        cells[pos + i] = c;
+        colors[pos + i] = color;
+    }
+    dirty = true;
+}
+
+void TextScreen::printf(u32 row, u32 col, const char *format, ...) {
+    char text[0x100];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    print(row, col, text);
+}
+
+u32 TextScreen::printLines(u32 row, const std::string &text) {
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos) end = text.size();
+        print(row++, 0, text.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return row;
+}
+
+void TextScreen::invalidate() {
+    // Anything that can't be a model cell forces the cell to be rewritten.
+    std::fill(shown.begin(), shown.end(), '\0');
+    dirty = true;
+}
+
+bool TextScreen::flush(FILE *out) {
+    if (!dirty) return false;
+    dirty = false;
+    buffer.clear();
+    u8 color = 0xFF;
+    char escape[32];
+    for (u32 row = 0; row < height; row++) {
+        u32 base = row * width;
+        u32 col = 0;
+        while (col < width) {
+            // Writing the bottom right cell would make the console scroll.
+            if (row == height - 1 && col == width - 1) break;
+            if (cells[base + col] == shown[base + col] && colors[base + col] == shownColors[base + col]) { col++; continue; }
+            // Extend the run over short unchanged gaps.
+            u32 end = col + 1;
+            u32 last = col;
+            while (end < width && end - last <= GAP_MERGE) {
+                if (cells[base + end] != shown[base + end] || colors[base + end] != shownColors[base + end]) last = end;
+                end++;
+            }
+            if (row == height - 1 && last == width - 1) last--;
+            snprintf(escape, sizeof(escape), "\x1b[%lu;%luH", (unsigned long)row, (unsigned long)col);
+            buffer += escape;
+            for (u32 i = col; i <= last; i++) {
+                if (colors[base + i] != color) {
+                    color = colors[base + i];
+                    if (color) snprintf(escape, sizeof(escape), "\x1b[%um", color);
+                    else snprintf(escape, sizeof(escape), "\x1b[0m");
+                    buffer += escape;
+                }
+                buffer += cells[base + i];
+                shown[base + i] = cells[base + i];
+                shownColors[base + i] = colors[base + i];
+            }
+            col = last + 1;
+        }
+    }
+    if (color != 0 && color != 0xFF) buffer += "\x1b[0m";
+    if (buffer.empty()) return false;
+    fwrite(buffer.data(), 1, buffer.size(), out);
+    fflush(out);
+    return true;
+}
@@ -0,0 +1,137 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "search.h"
+
+static std::string lower(const std::string &str) {
+    std::string result(str);
+    for (size_t i = 0; i < result.size(); i++) result[i] = tolower((u8)result[i]);
+    return result;
+}
+
+static bool parseSize(const char *str, u64 *size) {
+    char *end;
+    double value = strtod(str, &end);
+    if (end == str) return false;
+    if (*end == 'k' || *end == 'K') { value *= 1024; end++; }
+    else if (*end == 'm' || *end == 'M') { value *= 1024 * 1024; end++; }
+    if (*end == 'b' || *end == 'B') end++;
+    *size = value;
+    return *end == '\0';
+}
+
+bool parseQuery(const std::string &text, search_query *query) {
+    query->pattern.clear();
+    query->extension.clear();
+    query->minSize = 0;
+    query->maxSize = ~0ULL;
+    query->filesOnly = false;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find(' ', pos);
+        if (end == std::string::npos) end = text.size();
+        std::string word = text.substr(pos, end - pos);
+        pos = end + 1;
+        if (word.empty()) continue;
+        if (word[0] == '>' || word[0] == '<') {
+            u64 size;
+            if (!parseSize(word.c_str() + 1, &size)) return false;
+            if (word[0] == '>') query->minSize = size + 1;
+            else query->maxSize = size ? size - 1 : 0;
+            query->filesOnly = true;
+        } else if (word[0] == '.' && word.size() > 1 && word.find_first_of("*?", 1) == std::string::npos) {
+            query->extension = lower(word.substr(1));
+            query->filesOnly = true;
+        } else if (word.compare(0, 4, "ext:") == 0 && word.size() > 4) {
+            query->extension = lower(word.substr(4));
+            query->filesOnly = true;
+        } else {
+            if (!query->pattern.empty()) query->pattern += ' ';
+            query->pattern += lower(word);
+        }
+    }
+    return true;
+}
+
+// Iterative glob with single-star backtracking; both strings are already lower case.
+static bool globMatch(const char *pattern, const char *name) {
+    const char *star = NULL;
+    const char *retry = NULL;
+    while (*name) {
+        if (*pattern == '*') { star = pattern++; retry = name; }
+        else if (*pattern == '?' || *pattern == *name) { pattern++; name++; }
+        else if (star) { pattern = star + 1; name = ++retry; }
+        else return false;
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+SearchIndex::SearchIndex() : romfs(NULL) {}
+
+void SearchIndex::clear() {
+    romfs = NULL;
+    std::vector<char>().swap(pool);
+    std::vector<u32>().swap(starts);
+}
+
+void SearchIndex::build(const RomFS *fs) {
+    clear();
+    romfs = fs;
+    u32 count = fs->count();
+    size_t total = 0;
+    for (u32 i = 0; i < count; i++) total += fs->entry(i).nameLen + 1;
+    pool.reserve(total);
+    starts.reserve(count + 1);
+    for (u32 i = 0; i < count; i++) {
+        starts.push_back(pool.size());
+        const char *name = fs->name(i);
+        for (u32 j = 0; j < fs->entry(i).nameLen; j++) pool.push_back(tolower((u8)name[j]));
+        pool.push_back('\0');
+    }
+    starts.push_back(pool.size());
+}
+
+bool SearchIndex::filter(const search_query &query, u32 index) const {
+    const romfs_entry &ent = romfs->entry(index);
+    if (index == romfs->root()) return false;
+    if (ent.isDir) return !query.filesOnly;
+    if (ent.size < query.minSize || ent.size > query.maxSize) return false;
+    if (!query.extension.empty()) {
+        u32 len = query.extension.size();
+        u32 nameLen = starts[index + 1] - starts[index] - 1;
+        const char *name = &pool[starts[index]];
+        if (nameLen <= len || name[nameLen - len - 1] != '.' || memcmp(name + nameLen - len, query.extension.data(), len)) return false;
+    }
+    return true;
+}
+
+bool SearchIndex::search(const search_query &query, u32 *position, u32 budget, std::vector<u32> *results) const {
+    u32 first = *position;
+    u32 last = std::min(count(), first + budget);
+    const std::string &pattern = query.pattern;
+    if (pattern.find_first_of("*?") != std::string::npos) {
+        for (u32 i = first; i < last; i++) {
+            if (globMatch(pattern.c_str(), &pool[starts[i]]) && filter(query, i)) results->push_back(i);
+        }
+    } else if (pattern.empty()) {
+        for (u32 i = first; i < last; i++) {
+            if (filter(query, i)) results->push_back(i);
+        }
+    } else {
+        // Names never contain NUL, so a hit can't straddle two entries.
+        const char *base = pool.data();
+        const char *cur = base + starts[first];
+        const char *end = base + starts[last];
+        while (cur < end) {
+            const char *hit = (const char*)memmem(cur, end - cur, pattern.data(), pattern.size());
+            if (!hit) break;
+            u32 index = std::upper_bound(starts.begin() + first, starts.begin() + last, (u32)(hit - base)) - starts.begin() - 1;
+            if (filter(query, index)) results->push_back(index);
+            cur = base + starts[index + 1];
+        }
+    }
+    *position = last;
+    return last >= count();
+}
@@ -0,0 +1,158 @@
+#include <cstring>
+#include "sha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86
+#endif
+
+static const u32 K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline u32 ror(u32 x, u32 n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void transform(u32 *state, const u8 *data, size_t blocks) {
+    u32 w[64];
+    while (blocks--) {
+        for (int i = 0; i < 16; i++) w[i] = (data[i*4] << 24) | (data[i*4+1] << 16) | (data[i*4+2] << 8) | data[i*4+3];
+        for (int i = 16; i < 64; i++) {
+            u32 s0 = ror(w[i-15], 7) ^ ror(w[i-15], 18) ^ (w[i-15] >> 3);
+            u32 s1 = ror(w[i-2], 17) ^ ror(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+        u32 a = state[0], b = state[1], c = state[2], d = state[3];
+        u32 e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            u32 t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            u32 t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        data += SHA256_BLOCK_SIZE;
+    }
+}
+
+#ifdef SHA256_X86
+// SHA extensions: four rounds per pair of sha256rnds2, schedule with sha256msg1/msg2.
+__attribute__((target("sha,sse4.1,ssse3")))
+static void transformShaNi(u32 *state, const u8 *data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);     // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);           // CDGH
+    while (blocks--) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w[16];
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), mask);
+            else {
+                __m128i x = _mm_sha256msg1_epu32(w[i-4], w[i-3]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(w[i-1], w[i-2], 4));
+                w[i] = _mm_sha256msg2_epu32(x, w[i-1]);
+            }
+            __m128i msg = _mm_add_epi32(w[i], _mm_loadu_si128((const __m128i*)&K[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        data += SHA256_BLOCK_SIZE;
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1B);                 // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);              // DCHG
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static bool hasShaNi() {
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1) || !(c & bit_SSSE3)) return false;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+    return (b & (1 << 29)) != 0;
+}
+#endif
+
+typedef void (*transform_func)(u32 *state, const u8 *data, size_t blocks);
+
+static transform_func pickTransform() {
+#ifdef SHA256_X86
+    if (hasShaNi()) return transformShaNi;
+#endif
+    return transform;
+}
+
+static const transform_func transformBlocks = pickTransform();
+
+const char *sha256Backend() {
+    return (transformBlocks == transform) ? "generic" : "sha-ni";
+}
+
+void sha256Init(sha256_ctx *ctx) {
+    static const u32 init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->length = 0;
+}
+
+void sha256Update(sha256_ctx *ctx, const void *data, size_t size) {
+    const u8 *src = (const u8*)data;
+    u32 used = ctx->length % SHA256_BLOCK_SIZE;
+    ctx->length += size;
+    if (used) {
+        u32 fill = SHA256_BLOCK_SIZE - used;
+        if (size < fill) { memcpy(ctx->buffer + used, src, size); return; }
+        memcpy(ctx->buffer + used, src, fill);
+        transformBlocks(ctx->state, ctx->buffer, 1);
+        src += fill;
+        size -= fill;
+    }
+    if (size >= SHA256_BLOCK_SIZE) transformBlocks(ctx->state, src, size / SHA256_BLOCK_SIZE);
+    src += size & ~(size_t)(SHA256_BLOCK_SIZE - 1);
+    memcpy(ctx->buffer, src, size % SHA256_BLOCK_SIZE);
+}
+
+void sha256Final(sha256_ctx *ctx, u8 *hash) {
+    u64 bits = ctx->length * 8;
+    u8 pad[SHA256_BLOCK_SIZE * 2] = {0x80};
+    u32 used = ctx->length % SHA256_BLOCK_SIZE;
+    u32 padlen = (used < 56) ? (56 - used) : (120 - used);
+    for (int i = 0; i < 8; i++) pad[padlen + i] = bits >> (56 - i * 8);
+    sha256Update(ctx, pad, padlen + 8);
+    for (int i = 0; i < 8; i++) {
+        hash[i*4] = ctx->state[i] >> 24;
+        hash[i*4+1] = ctx->state[i] >> 16;
+        hash[i*4+2] = ctx->state[i] >> 8;
+        hash[i*4+3] = ctx->state[i];
+    }
+}
+
+void sha256(const void *data, size_t size, u8 *hash) {
+    sha256_ctx ctx;
+    sha256Init(&ctx);
+    sha256Update(&ctx, data, size);
+    sha256Final(&ctx, hash);
+}
+
+std::string hashToString(const u8 *hash, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string result;
+    for (size_t i = 0; i < size; i++) {
+        result += digits[hash[i] >> 4];
+        result += digits[hash[i] & 0xF];
+    }
+    return result;
+}